@@ -1,22 +1,36 @@
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <chrono>
-#include <ctime> 
+#include <ctime>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 enum LogStatus {LOG_NORMAL, LOG_WARNING, LOG_ERROR};
-//c C++20 можно, использовав enum class, 
+// Источник времени для сообщений:
+// LOG_CLOCK_SYSTEM - system_clock::now() на каждое сообщение (как раньше),
+// LOG_CLOCK_CACHED - значение, которое раз в миллисекунду обновляет фоновый поток,
+// LOG_CLOCK_TSC - счётчик тактов процессора, откалиброванный по system_clock
+enum LogClock {LOG_CLOCK_SYSTEM, LOG_CLOCK_CACHED, LOG_CLOCK_TSC};
+//c C++20 можно, использовав enum class,
 // подключить его к области видимости с помощью using enum LogStatus;
 
 
-class Log 
+class Log
 {
     Log()
     {
         std::cout<<"Logger initialized"<<"\n";
     };
-    static Log* logInstance;
 
     typedef struct logData
     {
@@ -28,38 +42,333 @@ class Log
             std::cout<<std::ctime(&time)<<status<<" | "<<message <<"\n";
         }
     } dataPiece;
-    std::vector<dataPiece> data;
+
+    // Одно завершённое событие трассировки (complete event в терминах Chrome).
+    // Время - сырые такты readTsc(), в наносекунды оно переводится при экспорте
+    struct TraceEvent
+    {
+        const char* name;
+        std::uint64_t beginTicks;
+        std::uint64_t endTicks;
+    };
+
+    // Буфер событий и сообщений одного потока. Пишет в него только поток-владелец,
+    // поэтому запись идёт без блокировок. Память не резервируется заранее:
+    // векторы растут по мере записи
+    struct ThreadTrace
+    {
+        std::uint32_t threadId;
+        std::vector<TraceEvent> events;
+        std::vector<dataPiece> messages;
+        bool inUse = true;
+    };
+    std::vector<std::unique_ptr<ThreadTrace>> traces;
+    mutable std::mutex tracesMutex;
+
+    // Буфер завершившегося потока достаётся следующему новому потоку, так что
+    // буферов не больше, чем потоков, живших одновременно. Записанное в буфер
+    // сохраняется до экспорта или очистки, а в трассировке у обоих потоков один tid
+    ThreadTrace* registerThread()
+    {
+        std::lock_guard<std::mutex> lock(tracesMutex);
+        for(auto& trace: traces)
+            if(!trace->inUse)
+            {
+                trace->inUse = true;
+                return trace.get();
+            }
+        auto trace = std::make_unique<ThreadTrace>();
+        trace->threadId = static_cast<std::uint32_t>(traces.size() + 1);
+        traces.push_back(std::move(trace));
+        return traces.back().get();
+    }
+
+    void releaseThread(ThreadTrace* trace)
+    {
+        std::lock_guard<std::mutex> lock(tracesMutex);
+        trace->inUse = false;
+    }
+
+    // Владелец буфера в потоке: при завершении потока возвращает буфер логгеру
+    struct ThreadTraceOwner
+    {
+        ThreadTrace* trace = Instance()->registerThread();
+        ThreadTraceOwner() = default;
+        ThreadTraceOwner(const ThreadTraceOwner&) = delete;
+        ThreadTraceOwner& operator=(const ThreadTraceOwner&) = delete;
+        ~ThreadTraceOwner() {Instance()->releaseThread(trace);}
+    };
+
+    static ThreadTrace* threadTrace()
+    {
+        thread_local ThreadTraceOwner owner;
+        return owner.trace;
+    }
+
+    std::atomic<LogClock> clock{LOG_CLOCK_SYSTEM};
+    std::atomic<std::time_t> cachedTime{0};
+    std::once_flag cachedClockStarted;
+    std::once_flag tscCalibrated;
+    std::uint64_t tscBase = 0;
+    std::uint64_t tscBaseNs = 0;
+    std::time_t tscBaseTime = 0;
+    double tscTicksPerSecond = 1;
+
+    static std::uint64_t readTsc()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return nowNs();
+#endif
+    }
+
+    void startCachedClock()
+    {
+        cachedTime.store(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+        // Логгер живёт до конца программы, поэтому поток можно отпустить
+        std::thread([this]{
+            for(;;)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                cachedTime.store(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()),
+                                 std::memory_order_relaxed);
+            }
+        }).detach();
+    }
+
+    void calibrateTsc()
+    {
+        auto wallStart = std::chrono::system_clock::now();
+        auto steadyStart = std::chrono::steady_clock::now();
+        std::uint64_t tscStart = readTsc();
+        tscBaseNs = std::chrono::duration_cast<std::chrono::nanoseconds>(steadyStart.time_since_epoch()).count();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::uint64_t tscFinish = readTsc();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - steadyStart;
+        tscTicksPerSecond = (tscFinish - tscStart) / elapsed.count();
+        tscBase = tscStart;
+        tscBaseTime = std::chrono::system_clock::to_time_t(wallStart);
+    }
+
+    std::time_t currentTime() const
+    {
+        switch(clock.load(std::memory_order_acquire))
+        {
+            case LOG_CLOCK_CACHED:
+                return cachedTime.load(std::memory_order_relaxed);
+            case LOG_CLOCK_TSC:
+                return tscBaseTime + std::time_t((readTsc() - tscBase) / tscTicksPerSecond);
+            default:
+                return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        }
+    }
 
 public:
     Log(const Log&) = delete;
     void operator* (const Log&) = delete;
 
+    // Инициализация локальной статической переменной потокобезопасна (C++11),
+    // а после неё каждый вызов - это одна проверка флага без блокировки
     static Log* Instance()
     {
-        if(logInstance==nullptr)
-            logInstance = new Log();
+        static Log* logInstance = new Log();
         return logInstance;
     }
 
+    void setClock(LogClock newClock)
+    {
+        if(newClock == LOG_CLOCK_CACHED)
+            std::call_once(cachedClockStarted, &Log::startCachedClock, this);
+        if(newClock == LOG_CLOCK_TSC)
+            std::call_once(tscCalibrated, &Log::calibrateTsc, this);
+        // release: поля калибровки, записанные выше, видны потоку,
+        // прочитавшему новые часы с acquire в currentTime()
+        clock.store(newClock, std::memory_order_release);
+    }
+
     void message(LogStatus status, std::string text)
     {
-        auto curTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-        dataPiece message = {text, curTime, status};
-        data.push_back(message);
+        threadTrace()->messages.push_back({std::move(text), currentTime(), status});
     }
+    // Сообщения всех потоков выводятся по времени, внутри потока порядок сохраняется.
+    // message() пишет в буфер потока без блокировки, поэтому print() и
+    // clearMessages() вызывать, когда пишущие потоки уже завершили работу
     void print() const
     {
+        std::vector<dataPiece> data;
+        {
+            std::lock_guard<std::mutex> lock(tracesMutex);
+            for(auto& trace: traces)
+                data.insert(data.end(), trace->messages.begin(), trace->messages.end());
+        }
+        std::stable_sort(data.begin(), data.end(),
+                         [](const dataPiece& a, const dataPiece& b){return a.time < b.time;});
         for(auto dataPiece: data)
             dataPiece.print();
     }
+    // Буферы завершившихся потоков при очистке отдают и память
+    void clearMessages()
+    {
+        std::lock_guard<std::mutex> lock(tracesMutex);
+        for(auto& trace: traces)
+        {
+            trace->messages.clear();
+            if(!trace->inUse)
+                trace->messages.shrink_to_fit();
+        }
+    }
+
+    static std::uint64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // RAII-область трассировки: время начала берётся в конструкторе,
+    // событие попадает в буфер текущего потока в деструкторе. Время читается
+    // счётчиком тактов: он в несколько раз дешевле steady_clock::now().
+    // name должен жить до экспорта (обычно это строковый литерал)
+    class Span
+    {
+        ThreadTrace* trace;
+        const char* name;
+        std::uint64_t beginTicks;
+    public:
+        explicit Span(const char* name): trace(threadTrace()), name(name), beginTicks(readTsc()) {}
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+        ~Span()
+        {
+            trace->events.push_back({name, beginTicks, readTsc()});
+        }
+    };
+
+    // Экспорт в формат Chrome trace-event (chrome://tracing, Perfetto).
+    // Вызывать, когда трассируемые потоки уже завершили работу.
+    // Такты переводятся в наносекунды steady_clock по калибровке счётчика
+    void exportChromeTrace(std::ostream& out)
+    {
+        std::call_once(tscCalibrated, &Log::calibrateTsc, this);
+        auto toNs = [this](std::uint64_t ticks) {
+            double sinceBase = double(std::int64_t(ticks - tscBase)) / tscTicksPerSecond * 1e9;
+            return std::uint64_t(std::int64_t(tscBaseNs) + std::int64_t(sinceBase));
+        };
+        std::lock_guard<std::mutex> lock(tracesMutex);
+        out<<"{\"traceEvents\":[";
+        bool first = true;
+        for(auto& trace: traces)
+        {
+            for(auto& event: trace->events)
+            {
+                if(!first)
+                    out<<",";
+                first = false;
+                std::uint64_t beginNs = toNs(event.beginTicks);
+                std::uint64_t endNs = toNs(event.endTicks);
+                out<<"\n{\"name\":";
+                writeJsonString(out, event.name);
+                out<<",\"ph\":\"X\",\"pid\":1"
+                   <<",\"tid\":"<<trace->threadId
+                   <<",\"ts\":"<<beginNs / 1000<<"."<<beginNs % 1000 / 100
+                   <<",\"dur\":"<<(endNs - beginNs) / 1000.0<<"}";
+            }
+        }
+        out<<"\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+
+    // Строка в кавычках с экранированием по правилам JSON
+    static void writeJsonString(std::ostream& out, const char* text)
+    {
+        out<<'"';
+        for(const char* c = text; *c; c++)
+        {
+            unsigned char symbol = static_cast<unsigned char>(*c);
+            if(symbol == '"' || symbol == '\\')
+                out<<'\\'<<*c;
+            else if(symbol < 0x20)
+            {
+                static const char hex[] = "0123456789abcdef";
+                out<<"\\u00"<<hex[symbol >> 4]<<hex[symbol & 15];
+            }
+            else
+                out<<*c;
+        }
+        out<<'"';
+    }
+
+    // Как и clearMessages, отдаёт память буферов завершившихся потоков
+    void clearTrace()
+    {
+        std::lock_guard<std::mutex> lock(tracesMutex);
+        for(auto& trace: traces)
+        {
+            trace->events.clear();
+            if(!trace->inUse)
+                trace->events.shrink_to_fit();
+        }
+    }
+};
+
 
+void tracedWork(int depth)
+{
+    Log::Span span("tracedWork");
+    volatile int sum = 0;
+    for(int i=0; i<10000; i++)
+        sum = sum + i;
+    if(depth > 0)
+        tracedWork(depth - 1);
+}
+
+
+// Прежняя реализация: ленивое создание через if и общий вектор сообщений.
+// Без мьютекса её нельзя вызывать из нескольких потоков, так что для сравнения он добавлен
+class LegacyLog
+{
+    LegacyLog() {}
+    static LegacyLog* logInstance;
+    std::vector<std::pair<std::string, std::time_t>> data;
+    std::mutex dataMutex;
+    static std::mutex instanceMutex;
+public:
+    static LegacyLog* Instance()
+    {
+        std::lock_guard<std::mutex> lock(instanceMutex);
+        if(logInstance==nullptr)
+            logInstance = new LegacyLog();
+        return logInstance;
+    }
+    void message(LogStatus /*status*/, std::string text)
+    {
+        auto curTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::lock_guard<std::mutex> lock(dataMutex);
+        data.push_back({text, curTime});
+    }
 };
 
-Log* Log::logInstance = nullptr;
+LegacyLog* LegacyLog::logInstance = nullptr;
+std::mutex LegacyLog::instanceMutex;
 
 
+template <typename Logger>
+double benchmarkMessages(int threadsCount, int messagesPerThread)
+{
+    auto start = Log::nowNs();
+    std::vector<std::thread> workers;
+    for(int t=0; t<threadsCount; t++)
+        workers.emplace_back([messagesPerThread]{
+            for(int i=0; i<messagesPerThread; i++)
+                Logger::Instance()->message(LOG_NORMAL, "benchmark");
+        });
+    for(auto& worker: workers)
+        worker.join();
+    auto finish = Log::nowNs();
+    return double(threadsCount) * messagesPerThread / ((finish - start) / 1e9);
+}
+
 
-int main(void) 
+int main(void)
 {
     Log *log = Log::Instance();
     log->message(LOG_NORMAL, "program loaded");
@@ -75,5 +384,43 @@ int main(void)
     //std::cout<<"a try to create by constructor failed\n";
     //Log *log3 = new Log;
     //Log log = Log();
+
+    std::cout<<"\nTracing nested spans from several threads\n";
+    {
+        Log::Span span("main");
+        std::vector<std::thread> workers;
+        for(int i=0; i<4; i++)
+            workers.emplace_back(tracedWork, 3);
+        for(auto& worker: workers)
+            worker.join();
+    }
+    std::ofstream traceFile("trace.json");
+    log->exportChromeTrace(traceFile);
+    std::cout<<"trace written to trace.json\n";
+
+    log->clearTrace();
+    const int spansCount = 1000000;
+    auto start = Log::nowNs();
+    for(int i=0; i<spansCount; i++)
+        Log::Span span("empty");
+    auto finish = Log::nowNs();
+    std::cout<<"span overhead: "<<double(finish - start) / spansCount<<" ns\n";
+    log->clearTrace();
+
+    std::cout<<"\nInstance() + message() throughput, messages/sec\n";
+    const int messagesPerThread = 200000;
+    for(int threadsCount: {1, 4, 16})
+    {
+        std::cout<<threadsCount<<" threads: legacy "
+                 <<benchmarkMessages<LegacyLog>(threadsCount, messagesPerThread);
+        for(LogClock clock: {LOG_CLOCK_SYSTEM, LOG_CLOCK_CACHED, LOG_CLOCK_TSC})
+        {
+            log->setClock(clock);
+            std::cout<<(clock == LOG_CLOCK_SYSTEM ? " | system " : clock == LOG_CLOCK_CACHED ? " | cached " : " | tsc ")
+                     <<benchmarkMessages<Log>(threadsCount, messagesPerThread);
+            log->clearMessages();
+        }
+        std::cout<<"\n";
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,80 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <span>
+#include <tuple>
+#include <limits>
+#include <random>
+#include <cmath>
+#include <charconv>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+enum CheckPointKind : std::uint8_t {CHECKPOINT_OBLIGATORY, CHECKPOINT_NOT_OBLIGATORY};
+
+// Текст сообщения о контрольной точке строится только по запросу, в буфер
+// вызывающего кода. Возвращает длину полного сообщения, как snprintf
+inline size_t renderCheckPointMessage(char* buffer,
+                                      size_t bufferSize,
+                                      CheckPointKind kind,
+                                      std::string_view name,
+                                      float latitude,
+                                      float longitude,
+                                      float penalty)
+{
+    int length;
+    if(kind == CHECKPOINT_OBLIGATORY)
+        length = std::snprintf(buffer, bufferSize,
+                               "Obligatory CheckPoint <<%.*s>> on coordinates (%f,%f). Failed SU.\n",
+                               int(name.size()), name.data(), latitude, longitude);
+    else
+        length = std::snprintf(buffer, bufferSize,
+                               "Not Obligatory CheckPoint <<%.*s>> on coordinates (%f,%f). Penalty %f\n",
+                               int(name.size()), name.data(), latitude, longitude, penalty);
+    return length < 0 ? 0 : size_t(length);
+}
+
+// Дописывает сообщение в конец out, не заводя промежуточных строк
+inline void appendCheckPointMessage(std::string& out,
+                                    CheckPointKind kind,
+                                    std::string_view name,
+                                    float latitude,
+                                    float longitude,
+                                    float penalty)
+{
+    size_t oldSize = out.size();
+    out.resize(oldSize + name.size() + 128);
+    size_t length = renderCheckPointMessage(out.data() + oldSize, out.size() - oldSize + 1,
+                                            kind, name, latitude, longitude, penalty);
+    if(length > out.size() - oldSize)
+    {
+        out.resize(oldSize + length);
+        renderCheckPointMessage(out.data() + oldSize, length + 1, kind, name, latitude, longitude, penalty);
+    }
+    out.resize(oldSize + length);
+}
 
 struct CheckPoint
 {
@@ -8,129 +82,1809 @@ struct CheckPoint
     float latitude;
     float longitude;
     float penalty;
+    CheckPointKind kind;
 
-    CheckPoint(std::string name, 
+    CheckPoint(std::string_view name, 
                 float latitude, 
                 float longitude, 
                 float penalty,
-                std::string message): 
+                CheckPointKind kind): 
                                     name(name), 
                                     latitude(latitude),
                                     longitude(longitude),
                                     penalty(penalty),
-                                    message(message) {};
+                                    kind(kind) {};
+
+    size_t renderMessage(char* buffer, size_t bufferSize) const
+    {
+        return renderCheckPointMessage(buffer, bufferSize, kind, name, latitude, longitude, penalty);
+    }
+    void printMessage() const
+    {
+        std::string text;
+        appendCheckPointMessage(text, kind, name, latitude, longitude, penalty);
+        std::cout << text;
+    }
+};
+
+// Хранилище трассы в виде структуры массивов: координаты, штрафы и вид точки
+// лежат в отдельных непрерывных столбцах, а названия всех контрольных точек -
+// подряд в одной общей строке-арене. Название точки i занимает в арене
+// отрезок [nameOffset[i], nameOffset[i+1])
+class TraceStorage
+{
+    public:
+        TraceStorage(): nameOffset(1, 0) {};
+
+        void reserve(size_t checkPoints, size_t nameBytes)
+        {
+            latitude.reserve(checkPoints);
+            longitude.reserve(checkPoints);
+            penalty.reserve(checkPoints);
+            kind.reserve(checkPoints);
+            nameOffset.reserve(checkPoints + 1);
+            names.reserve(nameBytes);
+        }
+
+        void append(std::string_view name,
+                    float lat,
+                    float lon,
+                    float checkPointPenalty,
+                    CheckPointKind checkPointKind)
+        {
+            latitude.push_back(lat);
+            longitude.push_back(lon);
+            penalty.push_back(checkPointPenalty);
+            kind.push_back(checkPointKind);
+            names.append(name);
+            nameOffset.push_back(names.size());
+        }
 
-    void printMessage(){std::cout << message;}
-    void setMessage(std::string text){message=text;};
+        void append(const CheckPoint& checkPoint)
+        {
+            append(checkPoint.name,
+                   checkPoint.latitude,
+                   checkPoint.longitude,
+                   checkPoint.penalty,
+                   checkPoint.kind);
+        }
+
+        // Пакетное добавление: одно резервирование под весь диапазон
+        template <typename Range>
+        void appendAll(const Range& checkPoints)
+        {
+            size_t nameBytes = 0;
+            for(const CheckPoint& checkPoint: checkPoints)
+                nameBytes += checkPoint.name.size();
+            reserve(size() + std::size(checkPoints), names.size() + nameBytes);
+            for(const CheckPoint& checkPoint: checkPoints)
+                append(checkPoint);
+        }
+
+        // Пакетное добавление целых столбцов. offsets содержит count+1 смещений
+        // названий внутри columnNames, первое из них нулевое
+        template <typename Offset>
+        void appendColumns(size_t count,
+                           const float* lats,
+                           const float* lons,
+                           const float* penalties,
+                           const CheckPointKind* kinds,
+                           const Offset* offsets,
+                           std::string_view columnNames)
+        {
+            latitude.insert(latitude.end(), lats, lats + count);
+            longitude.insert(longitude.end(), lons, lons + count);
+            penalty.insert(penalty.end(), penalties, penalties + count);
+            kind.insert(kind.end(), kinds, kinds + count);
+            size_t base = names.size();
+            nameOffset.reserve(nameOffset.size() + count);
+            for(size_t i = 1; i <= count; ++i)
+                nameOffset.push_back(base + static_cast<size_t>(offsets[i]));
+            names.append(columnNames);
+        }
+
+        void append(const TraceStorage& other)
+        {
+            appendColumns(other.size(),
+                          other.latitude.data(),
+                          other.longitude.data(),
+                          other.penalty.data(),
+                          other.kind.data(),
+                          other.nameOffset.data(),
+                          other.names);
+        }
+
+        size_t size() const {return latitude.size();}
+        void clear()
+        {
+            latitude.clear();
+            longitude.clear();
+            penalty.clear();
+            kind.clear();
+            nameOffset.assign(1, 0);
+            names.clear();
+        }
+
+        std::string_view name(size_t i) const
+        {
+            return std::string_view(names).substr(nameOffset[i], nameOffset[i + 1] - nameOffset[i]);
+        }
+        size_t renderMessage(size_t i, char* buffer, size_t bufferSize) const
+        {
+            return renderCheckPointMessage(buffer, bufferSize, kind[i], name(i), latitude[i], longitude[i], penalty[i]);
+        }
+        void appendMessage(size_t i, std::string& out) const
+        {
+            appendCheckPointMessage(out, kind[i], name(i), latitude[i], longitude[i], penalty[i]);
+        }
+        const std::vector<float>& latitudes() const {return latitude;}
+        const std::vector<float>& longitudes() const {return longitude;}
+        const std::vector<float>& penalties() const {return penalty;}
+        const std::vector<CheckPointKind>& kinds() const {return kind;}
+        const std::vector<size_t>& nameOffsets() const {return nameOffset;}
+        std::string_view allNames() const {return names;}
+
+        size_t memoryUsage() const
+        {
+            return latitude.capacity() * sizeof(float) +
+                   longitude.capacity() * sizeof(float) +
+                   penalty.capacity() * sizeof(float) +
+                   kind.capacity() * sizeof(CheckPointKind) +
+                   nameOffset.capacity() * sizeof(size_t) +
+                   names.capacity();
+        }
 
     private:
-        std::string message;
+        std::vector<float> latitude;
+        std::vector<float> longitude;
+        std::vector<float> penalty;
+        std::vector<CheckPointKind> kind;
+        std::vector<size_t> nameOffset;
+        std::string names;
+};
+
+constexpr double earthRadiusMeters = 6371008.8;
+constexpr double pi = 3.14159265358979323846;
+constexpr double degreesToRadians = pi / 180.0;
+constexpr double metersPerDegree = earthRadiusMeters * degreesToRadians;
+
+// Расстояние по большому кругу между двумя точками (сферическая модель Земли)
+inline double haversineMeters(double lat1, double lon1, double lat2, double lon2)
+{
+    double sinDLat = std::sin((lat2 - lat1) * degreesToRadians * 0.5);
+    double sinDLon = std::sin((lon2 - lon1) * degreesToRadians * 0.5);
+    double a = sinDLat * sinDLat +
+               std::cos(lat1 * degreesToRadians) * std::cos(lat2 * degreesToRadians) * sinDLon * sinDLon;
+    return 2.0 * earthRadiusMeters * std::asin(std::sqrt(std::min(1.0, a)));
+}
+
+// Делит [0, count) на непрерывные куски не короче minChunk и обрабатывает их
+// в отдельных потоках; при малом объёме работы всё выполняется в вызывающем потоке
+template <typename Function>
+void forEachChunk(size_t count, unsigned threadsCount, size_t minChunk, Function function)
+{
+    threadsCount = static_cast<unsigned>(std::clamp<size_t>(std::min<size_t>(threadsCount, count / minChunk), 1, 64));
+    if(threadsCount == 1)
+    {
+        function(size_t(0), count);
+        return;
+    }
+    std::vector<std::thread> workers;
+    size_t chunk = (count + threadsCount - 1) / threadsCount;
+    for(size_t first = 0; first < count; first += chunk)
+        workers.emplace_back(function, first, std::min(count, first + chunk));
+    for(auto& worker: workers)
+        worker.join();
+}
+
+// Ядра геометрии маршрута. Точки переводятся в единичные векторы (тригонометрия
+// один раз на точку, а не дважды на отрезок), длина отрезка берётся по хорде:
+// d = 2R·asin(|p2 - p1| / 2). Циклы без ветвлений над непрерывными массивами,
+// обработка идёт блоками, чтобы промежуточные векторы не покидали кэш
+class RouteKernels
+{
+    public:
+        static constexpr size_t block = 1024;
+        static constexpr double shortChord = 0.01;
+
+        // sin и cos угла в градусах без вызовов libm, чтобы цикл по точкам
+        // векторизовался. Угол приводится к [-45°, 45°] вычитанием ближайшего
+        // кратного 90° (в градусах это вычитание точное), на нём - многочлены
+        // ядра fdlibm с погрешностью около единицы последнего разряда.
+        // Четверть берётся из младших битов округлённого частного, а перестановка
+        // sin/cos и знаки выбираются битовыми масками без ветвлений
+        static void sinCosDegrees(double degrees, double& sine, double& cosine)
+        {
+            const double roundShifter = 6755399441055744.0; // 1.5 * 2^52
+            double shifted = degrees * (1.0 / 90.0) + roundShifter;
+            double quarter = shifted - roundShifter;
+            std::uint64_t quarterBits;
+            std::memcpy(&quarterBits, &shifted, sizeof(quarterBits));
+            double x = (degrees - quarter * 90.0) * degreesToRadians;
+            double x2 = x * x;
+            double s = x + x * x2 * (-1.66666666666666324348e-01 + x2 * (8.33333333332248946124e-03 +
+                       x2 * (-1.98412698298579493134e-04 + x2 * (2.75573137070700676789e-06 +
+                       x2 * (-2.50507602534068634195e-08 + x2 * 1.58969099521155010221e-10)))));
+            double c = 1.0 - 0.5 * x2 + x2 * x2 * (4.16666666666666019037e-02 + x2 * (-1.38888888888741095749e-03 +
+                       x2 * (2.48015872894767294178e-05 + x2 * (-2.75573143513906633035e-07 +
+                       x2 * (2.08757232129817482790e-09 + x2 * -1.13596475577881948265e-11)))));
+            std::uint64_t sBits, cBits;
+            std::memcpy(&sBits, &s, sizeof(sBits));
+            std::memcpy(&cBits, &c, sizeof(cBits));
+            std::uint64_t swap = 0 - (quarterBits & 1);
+            std::uint64_t sineBits = ((cBits & swap) | (sBits & ~swap)) ^ ((quarterBits & 2) << 62);
+            std::uint64_t cosineBits = ((sBits & swap) | (cBits & ~swap)) ^ (((quarterBits + 1) & 2) << 62);
+            std::memcpy(&sine, &sineBits, sizeof(sine));
+            std::memcpy(&cosine, &cosineBits, sizeof(cosine));
+        }
+
+        // Точки идут группами по lanes: у внутреннего цикла постоянное число
+        // итераций и локальные массивы, поэтому он векторизуется уже при -O2
+        static void unitVectors(const float* lat, const float* lon, double* x, double* y, double* z, size_t count)
+        {
+            constexpr size_t lanes = 4;
+            size_t i = 0;
+            for(; i + lanes <= count; i += lanes)
+            {
+                double sinPhi[lanes], cosPhi[lanes], sinLambda[lanes], cosLambda[lanes];
+                for(size_t k = 0; k < lanes; ++k)
+                {
+                    sinCosDegrees(lat[i + k], sinPhi[k], cosPhi[k]);
+                    sinCosDegrees(lon[i + k], sinLambda[k], cosLambda[k]);
+                }
+                for(size_t k = 0; k < lanes; ++k)
+                {
+                    x[i + k] = cosPhi[k] * cosLambda[k];
+                    y[i + k] = cosPhi[k] * sinLambda[k];
+                    z[i + k] = sinPhi[k];
+                }
+            }
+            for(; i < count; ++i)
+            {
+                double sinPhi, cosPhi, sinLambda, cosLambda;
+                sinCosDegrees(lat[i], sinPhi, cosPhi);
+                sinCosDegrees(lon[i], sinLambda, cosLambda);
+                x[i] = cosPhi * cosLambda;
+                y[i] = cosPhi * sinLambda;
+                z[i] = sinPhi;
+            }
+        }
+
+        // out[i] - расстояние между точками i и i+1
+        static void chordDistances(const double* x, const double* y, const double* z, double* out, size_t segments)
+        {
+            for(size_t i = 0; i < segments; ++i)
+            {
+                double dx = x[i + 1] - x[i];
+                double dy = y[i + 1] - y[i];
+                double dz = z[i + 1] - z[i];
+                out[i] = std::sqrt(dx * dx + dy * dy + dz * dz) * 0.5;
+            }
+            // Для хорд короче ~127 км asin заменяется рядом Тейлора (погрешность ниже
+            // точности double), длинные отрезки досчитываются отдельным проходом
+            bool hasLong = false;
+            for(size_t i = 0; i < segments; ++i)
+            {
+                double h = out[i];
+                double h2 = h * h;
+                hasLong |= h > shortChord;
+                out[i] = 2.0 * earthRadiusMeters * h * (1.0 + h2 * (1.0 / 6 + h2 * (3.0 / 40 + h2 * (15.0 / 336))));
+            }
+            if(hasLong)
+                for(size_t i = 0; i < segments; ++i)
+                {
+                    double dx = x[i + 1] - x[i];
+                    double dy = y[i + 1] - y[i];
+                    double dz = z[i + 1] - z[i];
+                    double h = std::sqrt(dx * dx + dy * dy + dz * dz) * 0.5;
+                    if(h > shortChord)
+                        out[i] = 2.0 * earthRadiusMeters * std::asin(std::min(1.0, h));
+                }
+        }
+
+        // Четыре независимых аккумулятора, чтобы сложение не упиралось в задержку
+        static double sum(const double* values, size_t count)
+        {
+            double partial[4] = {0, 0, 0, 0};
+            size_t i = 0;
+            for(; i + 4 <= count; i += 4)
+                for(int k = 0; k < 4; ++k)
+                    partial[k] += values[i + k];
+            for(; i < count; ++i)
+                partial[0] += values[i];
+            return (partial[0] + partial[1]) + (partial[2] + partial[3]);
+        }
+
+        // Длины отрезков [first, last) трассы в out[first, last)
+        static void segmentLengths(const TraceStorage& trace, double* out, size_t first, size_t last)
+        {
+            double x[block + 1], y[block + 1], z[block + 1];
+            for(size_t s = first; s < last; s += block)
+            {
+                size_t segments = std::min(block, last - s);
+                unitVectors(trace.latitudes().data() + s, trace.longitudes().data() + s, x, y, z, segments + 1);
+                chordDistances(x, y, z, out + s, segments);
+            }
+        }
+
+        static double totalLength(const TraceStorage& trace, size_t first, size_t last)
+        {
+            double lengths[block];
+            double total = 0;
+            double x[block + 1], y[block + 1], z[block + 1];
+            for(size_t s = first; s < last; s += block)
+            {
+                size_t segments = std::min(block, last - s);
+                unitVectors(trace.latitudes().data() + s, trace.longitudes().data() + s, x, y, z, segments + 1);
+                chordDistances(x, y, z, lengths, segments);
+                total += sum(lengths, segments);
+            }
+            return total;
+        }
 
+        static size_t segmentsCount(const TraceStorage& trace) {return trace.size() > 1 ? trace.size() - 1 : 0;}
+};
+
+// Равномерная сетка по широте и долготе поверх TraceStorage. Сама трасса в индексе
+// не хранится: он помнит только номера точек в ячейках и дополняется по мере
+// добавления точек. По долготе ячейки замкнуты через антимеридиан.
+// Если обход ячеек выходит дороже полного просмотра трассы, запрос решается перебором
+class TraceSpatialIndex
+{
+    public:
+        static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+        explicit TraceSpatialIndex(double cellDegrees = 0.01):
+            cellDegrees(cellDegrees),
+            lonCells(static_cast<std::int64_t>(std::ceil(360.0 / cellDegrees))) {};
+
+        void clear()
+        {
+            cells.clear();
+            indexedCount = 0;
+            maxAbsLatitude = 0;
+        }
+
+        // Корзины и узлы хеш-таблицы (узел - пара и два указателя) плюс списки точек ячеек
+        size_t memoryUsage() const
+        {
+            size_t bytes = cells.bucket_count() * sizeof(void*) +
+                           cells.size() * (sizeof(decltype(cells)::value_type) + 2 * sizeof(void*));
+            for(const auto& cell: cells)
+                bytes += cell.second.capacity() * sizeof(std::uint32_t);
+            return bytes;
+        }
+
+        // Доиндексирует точки, появившиеся в трассе с прошлого вызова
+        void update(const TraceStorage& trace)
+        {
+            if(trace.size() < indexedCount)
+                clear();
+            for(; indexedCount < trace.size(); ++indexedCount)
+            {
+                float lat = trace.latitudes()[indexedCount];
+                float lon = trace.longitudes()[indexedCount];
+                cells[cellKey(latCell(lat), lonCell(lon))].push_back(static_cast<std::uint32_t>(indexedCount));
+                maxAbsLatitude = std::max(maxAbsLatitude, std::abs(double(lat)));
+            }
+        }
+
+        // Ближайшая точка: кольца ячеек вокруг запроса обходятся, пока нижняя
+        // оценка расстояния до следующего кольца не превысит найденный минимум
+        size_t nearest(const TraceStorage& trace, double lat, double lon, double* distance = nullptr) const
+        {
+            size_t best = npos;
+            double bestDistance = std::numeric_limits<double>::infinity();
+            auto consider = [&](std::uint32_t i){
+                double d = haversineMeters(lat, lon, trace.latitudes()[i], trace.longitudes()[i]);
+                if(d < bestDistance || (d == bestDistance && i < best))
+                {
+                    bestDistance = d;
+                    best = i;
+                }
+            };
+            std::int64_t y = latCell(lat);
+            std::int64_t x = lonCell(lon);
+            double cosMaxLat = std::cos(std::min(90.0, std::max(maxAbsLatitude, std::abs(lat))) * degreesToRadians);
+            size_t visitedCells = 0;
+            bool exhaustive = false;
+            for(std::int64_t r = 0; ; ++r)
+            {
+                // Точки кольца r отстоят от запроса минимум на r-1 ячейку по широте или долготе
+                double gap = std::max<std::int64_t>(r - 1, 0) * cellDegrees * degreesToRadians;
+                double latBound = gap * earthRadiusMeters;
+                double lonBound = 2.0 * earthRadiusMeters *
+                                  std::asin(std::min(1.0, cosMaxLat * std::sin(std::min(gap, pi) * 0.5)));
+                if(std::min(latBound, lonBound) > bestDistance)
+                    break;
+                visitedCells += r == 0 ? 1 : 8 * r;
+                if(visitedCells > trace.size() || 2 * r + 1 >= lonCells)
+                {
+                    exhaustive = true;
+                    break;
+                }
+                forEachRingCell(y, x, r, [&](const std::vector<std::uint32_t>& points){
+                    for(std::uint32_t i: points)
+                        consider(i);
+                });
+            }
+            if(exhaustive)
+            {
+                best = npos;
+                bestDistance = std::numeric_limits<double>::infinity();
+                for(size_t i = 0; i < indexedCount; ++i)
+                    consider(static_cast<std::uint32_t>(i));
+            }
+            if(distance)
+                *distance = bestDistance;
+            return best;
+        }
+
+        // Все точки на расстоянии не больше radius метров, по возрастанию номера
+        void within(const TraceStorage& trace, double lat, double lon, double radius, std::vector<size_t>& result) const
+        {
+            result.clear();
+            auto consider = [&](std::uint32_t i){
+                if(haversineMeters(lat, lon, trace.latitudes()[i], trace.longitudes()[i]) <= radius)
+                    result.push_back(i);
+            };
+            double dLat = radius / metersPerDegree;
+            std::int64_t yFirst = latCell(std::max(-90.0, lat - dLat));
+            std::int64_t yLast = latCell(std::min(90.0, lat + dLat));
+            // Из sin(d/2R) >= cos(φ)·sin(Δλ/2) следует наибольшая возможная разница долгот
+            double cosMaxLat = std::cos(std::min(90.0, std::abs(lat) + dLat) * degreesToRadians);
+            double sinHalfLon = cosMaxLat > 0 ? std::sin(std::min(radius / earthRadiusMeters, pi) * 0.5) / cosMaxLat : 2.0;
+            std::int64_t xReach = lonCells;
+            if(sinHalfLon < 1.0)
+                xReach = static_cast<std::int64_t>(2.0 * std::asin(sinHalfLon) / degreesToRadians / cellDegrees) + 1;
+            std::int64_t xCount = std::min(lonCells, 2 * xReach + 1);
+            if(double(yLast - yFirst + 1) * xCount > double(trace.size()))
+            {
+                for(size_t i = 0; i < indexedCount; ++i)
+                    consider(static_cast<std::uint32_t>(i));
+                return;
+            }
+            std::int64_t x = lonCell(lon);
+            for(std::int64_t cy = yFirst; cy <= yLast; ++cy)
+                for(std::int64_t dx = 0; dx < xCount; ++dx)
+                {
+                    std::int64_t cx = xCount == lonCells ? dx : wrapLon(x - xReach + dx);
+                    auto it = cells.find(cellKey(cy, cx));
+                    if(it != cells.end())
+                        for(std::uint32_t i: it->second)
+                            consider(i);
+                }
+            std::sort(result.begin(), result.end());
+        }
+
+        // Пакетные запросы: упорядочиваются по ячейкам, чтобы соседние запросы
+        // читали одни и те же ячейки, и делятся между потоками
+        void nearestMany(const TraceStorage& trace,
+                         std::span<const double> lats,
+                         std::span<const double> lons,
+                         std::span<size_t> result,
+                         unsigned threadsCount = std::thread::hardware_concurrency()) const
+        {
+            std::vector<size_t> order = queryOrder(lats, lons);
+            forEachChunk(order.size(), threadsCount, 1024, [&](size_t first, size_t last){
+                for(size_t k = first; k < last; ++k)
+                    result[order[k]] = nearest(trace, lats[order[k]], lons[order[k]]);
+            });
+        }
+
+        void withinMany(const TraceStorage& trace,
+                        std::span<const double> lats,
+                        std::span<const double> lons,
+                        double radius,
+                        std::vector<std::vector<size_t>>& result,
+                        unsigned threadsCount = std::thread::hardware_concurrency()) const
+        {
+            result.resize(lats.size());
+            std::vector<size_t> order = queryOrder(lats, lons);
+            forEachChunk(order.size(), threadsCount, 1024, [&](size_t first, size_t last){
+                for(size_t k = first; k < last; ++k)
+                    within(trace, lats[order[k]], lons[order[k]], radius, result[order[k]]);
+            });
+        }
+
+    private:
+        std::int64_t latCell(double lat) const
+        {
+            return static_cast<std::int64_t>(std::floor((lat + 90.0) / cellDegrees));
+        }
+        std::int64_t wrapLon(std::int64_t x) const
+        {
+            x %= lonCells;
+            return x < 0 ? x + lonCells : x;
+        }
+        std::int64_t lonCell(double lon) const
+        {
+            return wrapLon(static_cast<std::int64_t>(std::floor((lon + 180.0) / cellDegrees)));
+        }
+        std::int64_t cellKey(std::int64_t y, std::int64_t x) const
+        {
+            return y * lonCells + x;
+        }
+
+        // Обход ячеек, отстоящих от (y, x) ровно на r по метрике Чебышёва
+        template <typename Visitor>
+        void forEachRingCell(std::int64_t y, std::int64_t x, std::int64_t r, Visitor visit) const
+        {
+            auto visitCell = [&](std::int64_t cy, std::int64_t cx){
+                auto it = cells.find(cellKey(cy, wrapLon(cx)));
+                if(it != cells.end())
+                    visit(it->second);
+            };
+            if(r == 0)
+            {
+                visitCell(y, x);
+                return;
+            }
+            for(std::int64_t dx = -r; dx <= r; ++dx)
+            {
+                visitCell(y - r, x + dx);
+                visitCell(y + r, x + dx);
+            }
+            for(std::int64_t dy = -r + 1; dy <= r - 1; ++dy)
+            {
+                visitCell(y + dy, x - r);
+                visitCell(y + dy, x + r);
+            }
+        }
+
+        std::vector<size_t> queryOrder(std::span<const double> lats, std::span<const double> lons) const
+        {
+            std::vector<size_t> order(lats.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::vector<std::int64_t> keys(lats.size());
+            for(size_t i = 0; i < lats.size(); ++i)
+                keys[i] = cellKey(latCell(lats[i]), lonCell(lons[i]));
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b){return keys[a] < keys[b];});
+            return order;
+        }
+
+        double cellDegrees;
+        std::int64_t lonCells;
+        std::unordered_map<std::int64_t, std::vector<std::uint32_t>> cells;
+        size_t indexedCount = 0;
+        double maxAbsLatitude = 0;
+};
+
+// Описание контрольной точки для пакетного построения
+struct CheckPointSpec
+{
+    std::string_view name;
+    float latitude;
+    float longitude;
+    float penalty;
 };
 
 class CheckPointBuilder
 {
     public:
-    virtual CheckPoint* BuildCheckPoint(std::string name, 
+    virtual CheckPoint* BuildCheckPoint(std::string_view name, 
                                         float latitude,
                                         float longitude,
                                         float penalty)=0;
+    // Пакет точек строится одним виртуальным вызовом прямо в хранилище трассы.
+    // По умолчанию - через BuildCheckPoint для каждой точки
+    virtual void BuildCheckPoints(std::span<const CheckPointSpec> specs, TraceStorage& trace)
+    {
+        for(const CheckPointSpec& spec: specs)
+        {
+            std::unique_ptr<CheckPoint> cp(BuildCheckPoint(spec.name, spec.latitude, spec.longitude, spec.penalty));
+            trace.append(*cp);
+        }
+    }
+    virtual ~CheckPointBuilder() {};
 };
 
-class ObligatoryCheckPointsBuilder: public CheckPointBuilder
+// Политики видов контрольных точек: всё, чем строители отличаются друг от друга,
+// известно на этапе компиляции
+struct ObligatoryPolicy
 {
-    public:
-    CheckPoint* BuildCheckPoint(std::string name, 
-                                float latitude,
-                                float longitude,
-                                float penalty) override
-    {
-        std::string message = "Obligatory CheckPoint <<" +
-                               name + ">>" +
-                               " on coordinates (" + 
-                               std::to_string(latitude) + 
-                               "," +
-                               std::to_string(longitude) +
-                               "). Failed SU.\n";
-        CheckPoint *obligatory_checkPoint = new CheckPoint(name, 
-                                                          latitude, 
-                                                          longitude, 
-                                                          0,
-                                                          message);
-        return obligatory_checkPoint;
-    }
+    static constexpr CheckPointKind kind = CHECKPOINT_OBLIGATORY;
+    static float penalty(float) {return 0;}
 };
 
-class NotObligatoryCheckPointsBuilder: public CheckPointBuilder
+struct NotObligatoryPolicy
+{
+    static constexpr CheckPointKind kind = CHECKPOINT_NOT_OBLIGATORY;
+    static float penalty(float penalty) {return penalty;}
+};
+
+// Строитель, параметризованный политикой. Через указатель на CheckPointBuilder
+// он работает как обычный, а buildInto() вызывается статически и встраивается
+template <typename Policy>
+class PolicyCheckPointsBuilder: public CheckPointBuilder
 {
     public:
-    CheckPoint* BuildCheckPoint(std::string name, 
+    CheckPoint* BuildCheckPoint(std::string_view name, 
                                 float latitude,
                                 float longitude,
                                 float penalty) override
     {
-        std::string message = "Not Obligatory CheckPoint <<" + 
-                                name + ">>" +
-                               " on coordinates (" + 
-                               std::to_string(latitude) + 
-                               "," +
-                               std::to_string(longitude) +
-                               "). Penalty " + 
-                               std::to_string(penalty)
-                               +"\n";
-        CheckPoint* notObligatory_checkPoint = new CheckPoint(name, 
-                                                              latitude, 
-                                                              longitude, 
-                                                              penalty,
-                                                              message);
-        return notObligatory_checkPoint;
+        return new CheckPoint(name, latitude, longitude, Policy::penalty(penalty), Policy::kind);
+    }
+
+    void BuildCheckPoints(std::span<const CheckPointSpec> specs, TraceStorage& trace) override
+    {
+        buildInto(specs, trace);
+    }
+
+    static void buildInto(std::span<const CheckPointSpec> specs, TraceStorage& trace)
+    {
+        for(const CheckPointSpec& spec: specs)
+            trace.append(spec.name, spec.latitude, spec.longitude, Policy::penalty(spec.penalty), Policy::kind);
     }
 };
 
+class ObligatoryCheckPointsBuilder: public PolicyCheckPointsBuilder<ObligatoryPolicy> {};
+
+class NotObligatoryCheckPointsBuilder: public PolicyCheckPointsBuilder<NotObligatoryPolicy> {};
+
+// Строитель принадлежит вызывающему коду, директор лишь пользуется им.
+// Построенные точки переносятся в TraceStorage и освобождаются сразу
 class TraceDirector
 {
     public:
         TraceDirector(CheckPointBuilder* newBuilder): builder(newBuilder){};
         void setBuilder(CheckPointBuilder* newBuilder){builder=newBuilder;};
-        void addCheckPoint(std::string name, 
+        void reserve(size_t checkPoints, size_t nameBytes=0){trace.reserve(checkPoints, nameBytes);};
+        // Пакетное добавление уже построенной части трассы
+        void appendTrace(const TraceStorage& part)
+        {
+            trace.append(part);
+        }
+        // То же для столбцов, лежащих вне TraceStorage (например, в отображённом файле)
+        template <typename Offset>
+        void appendColumns(size_t count,
+                           const float* lats,
+                           const float* lons,
+                           const float* penalties,
+                           const CheckPointKind* kinds,
+                           const Offset* offsets,
+                           std::string_view names)
+        {
+            trace.appendColumns(count, lats, lons, penalties, kinds, offsets, names);
+        }
+        void addCheckPoint(std::string_view name, 
                             float latitude,
                             float longitude,
                             float penalty=0)
         {
-            CheckPoint* cp = builder->BuildCheckPoint(name, latitude, longitude, penalty);
-            trace.push_back(cp);
+            std::unique_ptr<CheckPoint> cp(builder->BuildCheckPoint(name, latitude, longitude, penalty));
+            trace.append(*cp);
+        }
+        // Пакетное добавление текущим строителем: одно резервирование
+        // и один виртуальный вызов на весь пакет
+        void addCheckPoints(std::span<const CheckPointSpec> specs)
+        {
+            reserveFor(specs);
+            builder->BuildCheckPoints(specs, trace);
         }
-        float getSumPenalty()
+        // То же со строителем, выбранным на этапе компиляции: цикл без виртуальных
+        // вызовов и без промежуточных CheckPoint
+        template <typename Policy>
+        void addCheckPoints(std::span<const CheckPointSpec> specs)
         {
-            float sum;
-            for(auto checkPoint: trace)
-                sum+=checkPoint->penalty;
-            return sum;
+            reserveFor(specs);
+            PolicyCheckPointsBuilder<Policy>::buildInto(specs, trace);
         }
-        void aboutTrace()
+        float getSumPenalty() const
         {
-            for(auto checkPoint: trace)
-                checkPoint->printMessage();
+            double sum = 0;
+            for(float penalty: trace.penalties())
+                sum+=penalty;
+            return static_cast<float>(sum);
+        }
+        // Все сообщения собираются в один буфер и выводятся одной записью
+        void aboutTrace(std::ostream& out = std::cout) const
+        {
+            std::string text;
+            text.reserve(trace.size() * 96);
+            for(size_t i = 0; i < trace.size(); ++i)
+                trace.appendMessage(i, text);
+            out.write(text.data(), text.size());
+        }
+        size_t nearestCheckPoint(double latitude, double longitude, double* distance = nullptr) const
+        {
+            return getSpatialIndex().nearest(trace, latitude, longitude, distance);
+        }
+        std::vector<size_t> checkPointsWithin(double latitude, double longitude, double radius) const
+        {
+            std::vector<size_t> result;
+            getSpatialIndex().within(trace, latitude, longitude, radius, result);
+            return result;
+        }
+
+        // Геометрия маршрута. threadsCount > 1 включает параллельный расчёт,
+        // который имеет смысл только на очень длинных трассах
+        double getRouteLength(unsigned threadsCount = 1) const
+        {
+            size_t segments = RouteKernels::segmentsCount(trace);
+            std::vector<std::pair<size_t, double>> partial;
+            std::mutex partialMutex;
+            forEachChunk(segments, threadsCount, routeChunk, [&](size_t first, size_t last){
+                double length = RouteKernels::totalLength(trace, first, last);
+                std::lock_guard<std::mutex> lock(partialMutex);
+                partial.push_back({first, length});
+            });
+            // Куски складываются в порядке трассы, чтобы результат не зависел от планировщика
+            std::sort(partial.begin(), partial.end());
+            double total = 0;
+            for(auto& chunk: partial)
+                total += chunk.second;
+            return total;
+        }
+        std::vector<double> getSegmentLengths(unsigned threadsCount = 1) const
+        {
+            std::vector<double> lengths(RouteKernels::segmentsCount(trace));
+            forEachChunk(lengths.size(), threadsCount, routeChunk, [&](size_t first, size_t last){
+                RouteKernels::segmentLengths(trace, lengths.data(), first, last);
+            });
+            return lengths;
+        }
+        // Расстояние вдоль маршрута от старта до каждой точки. Параллельно
+        // считаются отрезки и частичные суммы кусков, затем куски сдвигаются
+        std::vector<double> getCumulativeDistances(unsigned threadsCount = 1) const
+        {
+            std::vector<double> distances(trace.size(), 0.0);
+            size_t segments = RouteKernels::segmentsCount(trace);
+            std::vector<std::pair<size_t, double>> chunkTotals;
+            std::mutex totalsMutex;
+            forEachChunk(segments, threadsCount, routeChunk, [&](size_t first, size_t last){
+                RouteKernels::segmentLengths(trace, distances.data() + 1, first, last);
+                double running = 0;
+                for(size_t i = first + 1; i <= last; ++i)
+                {
+                    running += distances[i];
+                    distances[i] = running;
+                }
+                std::lock_guard<std::mutex> lock(totalsMutex);
+                chunkTotals.push_back({first, running});
+            });
+            std::sort(chunkTotals.begin(), chunkTotals.end());
+            double offset = 0;
+            for(size_t c = 0; c < chunkTotals.size(); ++c)
+            {
+                size_t first = chunkTotals[c].first;
+                size_t last = c + 1 < chunkTotals.size() ? chunkTotals[c + 1].first : segments;
+                if(offset != 0)
+                    for(size_t i = first + 1; i <= last; ++i)
+                        distances[i] += offset;
+                offset += chunkTotals[c].second;
+            }
+            return distances;
+        }
+
+        struct PenaltySummary
+        {
+            double obligatory;
+            double notObligatory;
+            size_t obligatoryCount;
+            size_t notObligatoryCount;
+        };
+        // Суммы штрафов по видам точек без ветвлений в цикле
+        PenaltySummary getPenaltyByKind() const
+        {
+            const float* penalties = trace.penalties().data();
+            const CheckPointKind* kinds = trace.kinds().data();
+            double obligatory = 0, total = 0;
+            size_t obligatoryCount = 0;
+            for(size_t i = 0; i < trace.size(); ++i)
+            {
+                bool isObligatory = kinds[i] == CHECKPOINT_OBLIGATORY;
+                obligatory += isObligatory ? penalties[i] : 0.0f;
+                total += penalties[i];
+                obligatoryCount += isObligatory;
+            }
+            return {obligatory, total - obligatory, obligatoryCount, trace.size() - obligatoryCount};
+        }
+
+        const TraceStorage& getTrace() const {return trace;}
+        // Индекс строится при первом запросе и доиндексирует точки, добавленные
+        // после предыдущего, так что загрузка трассы его не ждёт. Запросы можно
+        // делать из нескольких потоков, пока трасса не меняется
+        const TraceSpatialIndex& getSpatialIndex() const
+        {
+            if(indexedSize.load(std::memory_order_acquire) != trace.size())
+            {
+                std::lock_guard<std::mutex> lock(indexMutex);
+                index.update(trace);
+                indexedSize.store(trace.size(), std::memory_order_release);
+            }
+            return index;
+        }
+        void clear()
+        {
+            trace.clear();
+            index.clear();
+            indexedSize.store(0, std::memory_order_release);
         }
 
     private:
+        static constexpr size_t routeChunk = 1 << 16;
+
+        void reserveFor(std::span<const CheckPointSpec> specs)
+        {
+            size_t nameBytes = 0;
+            for(const CheckPointSpec& spec: specs)
+                nameBytes += spec.name.size();
+            trace.reserve(trace.size() + specs.size(), trace.allNames().size() + nameBytes);
+        }
+
         CheckPointBuilder* builder;
-        std::vector<CheckPoint*> trace;
+        TraceStorage trace;
+        mutable TraceSpatialIndex index;
+        mutable std::atomic<size_t> indexedSize{0};
+        mutable std::mutex indexMutex;
+};
+
+
+struct TrackPoint
+{
+    double latitude;
+    double longitude;
+};
+
+// Итог проверки одного участника: какие точки взяты по порядку трассы,
+// какие обязательные пропущены (незачёт СУ) и сумма штрафов за пропущенные необязательные
+struct ScoringResult
+{
+    size_t participant;
+    std::vector<std::uint32_t> visited;
+    std::vector<std::uint32_t> missedObligatory;
+    double penalty;
+
+    bool disqualified() const {return !missedObligatory.empty();}
+};
+
+// Проверка треков участников по трассе директора в пуле потоков. Треки подаются
+// потоком через submit(); очередь ограничена, поэтому при медленной проверке
+// submit() ждёт, а не копит все треки в памяти. Трасса не должна меняться,
+// пока движок работает
+class RaceScoringEngine
+{
+    public:
+        RaceScoringEngine(const TraceDirector& director,
+                          double visitRadius,
+                          unsigned threadsCount = std::thread::hardware_concurrency(),
+                          size_t queueCapacity = 256):
+            director(director),
+            visitRadius(visitRadius),
+            queueCapacity(queueCapacity)
+        {
+            threadsCount = std::max(1u, threadsCount);
+            workerResults.resize(threadsCount);
+            for(unsigned i = 0; i < threadsCount; ++i)
+                workers.emplace_back(&RaceScoringEngine::work, this, i);
+        };
+        RaceScoringEngine(const RaceScoringEngine&) = delete;
+        RaceScoringEngine& operator=(const RaceScoringEngine&) = delete;
+        ~RaceScoringEngine() {stop();}
+
+        void submit(size_t participant, std::vector<TrackPoint> track)
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueNotFull.wait(lock, [this]{return queue.size() < queueCapacity;});
+            // Время считается от первого трека, а не от создания движка
+            if(!started)
+            {
+                started = true;
+                startTime = std::chrono::steady_clock::now();
+            }
+            queue.push_back({participant, std::move(track)});
+            queueNotEmpty.notify_one();
+        }
+
+        // Дожидается проверки всех поданных треков; результаты по возрастанию номера участника
+        std::vector<ScoringResult> finish()
+        {
+            stop();
+            std::vector<ScoringResult> results;
+            for(auto& partial: workerResults)
+                for(auto& result: partial)
+                    results.push_back(std::move(result));
+            std::sort(results.begin(), results.end(),
+                      [](const ScoringResult& a, const ScoringResult& b){return a.participant < b.participant;});
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+            tracksRate = started ? results.size() / elapsed.count() : 0;
+            return results;
+        }
+
+        double tracksPerSecond() const {return tracksRate;}
+
+        // Рабочие буферы scoreTrack, переиспользуются между треками одного потока
+        struct Scratch
+        {
+            // Ценность цепочки взятых точек: сначала число обязательных,
+            // затем сумма штрафов, которых удалось избежать, затем число точек
+            using Score = std::tuple<size_t, double, size_t>;
+            struct Match
+            {
+                size_t checkPoint;
+                size_t previous;
+            };
+            static constexpr size_t noMatch = std::numeric_limits<size_t>::max();
+
+            std::vector<size_t> around;
+            // Дерево Фенвика по номерам точек трассы: максимум ценности цепочки,
+            // оканчивающейся на точке из префикса, и последнее сопоставление цепочки
+            std::vector<std::pair<Score, size_t>> best;
+            std::vector<size_t> touched;
+            std::vector<Match> matches;
+        };
+
+        // Сопоставление с сохранением порядка: из всех цепочек точек трассы,
+        // взятых по возрастанию номера и по ходу трека, выбирается самая ценная.
+        // Одна точка трека может подтвердить несколько соседних точек трассы.
+        // В отличие от жадного выбора, петли, трассы "туда и обратно" и финиш
+        // рядом со стартом не приводят к пропуску середины трассы
+        static ScoringResult scoreTrack(const TraceDirector& director,
+                                        double visitRadius,
+                                        size_t participant,
+                                        std::span<const TrackPoint> track,
+                                        Scratch& scratch)
+        {
+            const TraceStorage& trace = director.getTrace();
+            const TraceSpatialIndex& index = director.getSpatialIndex();
+            const size_t n = trace.size();
+            using Score = Scratch::Score;
+            const std::pair<Score, size_t> empty{Score{0, 0.0, 0}, Scratch::noMatch};
+            if(scratch.best.size() != n + 1)
+                scratch.best.assign(n + 1, empty);
+            scratch.matches.clear();
+
+            auto bestBefore = [&](size_t checkPoint){
+                std::pair<Score, size_t> found = empty;
+                for(size_t i = checkPoint; i > 0; i -= i & (~i + 1))
+                    if(std::get<0>(found) < std::get<0>(scratch.best[i]))
+                        found = scratch.best[i];
+                return found;
+            };
+            for(const TrackPoint& point: track)
+            {
+                index.within(trace, point.latitude, point.longitude, visitRadius, scratch.around);
+                // По возрастанию номера, чтобы точка трека могла продолжить цепочку,
+                // которую сама же только что удлинила
+                for(size_t checkPoint: scratch.around)
+                {
+                    auto [score, previous] = bestBefore(checkPoint);
+                    bool obligatory = trace.kinds()[checkPoint] == CHECKPOINT_OBLIGATORY;
+                    Score extended{std::get<0>(score) + obligatory,
+                                   std::get<1>(score) + (obligatory ? 0.0 : trace.penalties()[checkPoint]),
+                                   std::get<2>(score) + 1};
+                    size_t match = scratch.matches.size();
+                    bool stored = false;
+                    for(size_t i = checkPoint + 1; i <= n; i += i & (~i + 1))
+                        if(std::get<0>(scratch.best[i]) < extended)
+                        {
+                            scratch.best[i] = {extended, match};
+                            scratch.touched.push_back(i);
+                            stored = true;
+                        }
+                    if(stored)
+                        scratch.matches.push_back({checkPoint, previous});
+                }
+            }
+
+            ScoringResult result{participant, {}, {}, 0};
+            for(size_t match = bestBefore(n).second; match != Scratch::noMatch; match = scratch.matches[match].previous)
+                result.visited.push_back(static_cast<std::uint32_t>(scratch.matches[match].checkPoint));
+            std::reverse(result.visited.begin(), result.visited.end());
+            size_t taken = 0;
+            for(size_t i = 0; i < n; ++i)
+            {
+                if(taken < result.visited.size() && result.visited[taken] == i)
+                {
+                    ++taken;
+                    continue;
+                }
+                if(trace.kinds()[i] == CHECKPOINT_OBLIGATORY)
+                    result.missedObligatory.push_back(static_cast<std::uint32_t>(i));
+                else
+                    result.penalty += trace.penalties()[i];
+            }
+            for(size_t i: scratch.touched)
+                scratch.best[i] = empty;
+            scratch.touched.clear();
+            return result;
+        }
+
+    private:
+        struct Job
+        {
+            size_t participant;
+            std::vector<TrackPoint> track;
+        };
+
+        void work(unsigned workerIndex)
+        {
+            Scratch scratch;
+            for(;;)
+            {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(queueMutex);
+                    queueNotEmpty.wait(lock, [this]{return stopping || !queue.empty();});
+                    if(queue.empty())
+                        return;
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                    queueNotFull.notify_one();
+                }
+                workerResults[workerIndex].push_back(
+                    scoreTrack(director, visitRadius, job.participant, job.track, scratch));
+            }
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queueNotEmpty.notify_all();
+            for(auto& worker: workers)
+                if(worker.joinable())
+                    worker.join();
+        }
+
+        const TraceDirector& director;
+        double visitRadius;
+        size_t queueCapacity;
+        std::chrono::steady_clock::time_point startTime;
+        bool started = false;
+        double tracksRate = 0;
+
+        std::mutex queueMutex;
+        std::condition_variable queueNotEmpty;
+        std::condition_variable queueNotFull;
+        std::deque<Job> queue;
+        bool stopping = false;
+
+        std::vector<std::thread> workers;
+        std::vector<std::vector<ScoringResult>> workerResults;
+};
+
+
+// Файл, отображённый в память только для чтения. Там, где нет mmap,
+// содержимое просто читается целиком
+class MappedFile
+{
+    public:
+        explicit MappedFile(const std::string& path)
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error("cannot open " + path);
+            struct stat info;
+            if(::fstat(fd, &info) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("cannot stat " + path);
+            }
+            length = static_cast<size_t>(info.st_size);
+            if(length > 0)
+            {
+                void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(mapped == MAP_FAILED)
+                {
+                    ::close(fd);
+                    throw std::runtime_error("cannot mmap " + path);
+                }
+                ::madvise(mapped, length, MADV_SEQUENTIAL);
+                bytes = static_cast<const char*>(mapped);
+            }
+            ::close(fd);
+#else
+            std::ifstream in(path, std::ios::binary);
+            if(!in)
+                throw std::runtime_error("cannot open " + path);
+            buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            bytes = buffer.data();
+            length = buffer.size();
+#endif
+        };
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile()
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            if(bytes)
+                ::munmap(const_cast<char*>(bytes), length);
+#endif
+        }
+
+        std::string_view view() const {return std::string_view(bytes ? bytes : "", length);}
+
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+#if !(defined(__unix__) || defined(__APPLE__))
+        std::string buffer;
+#endif
+};
+
+// Загрузка и выгрузка трасс.
+// CSV: строки вида name,type,latitude,longitude,penalty; type начинается с O
+// (обязательная) или N (необязательная); первая строка пропускается, только если
+// она в точности равна заголовку name,type,latitude,longitude,penalty. Название
+// с запятой или кавычкой берётся в кавычки, кавычки внутри удваиваются; перевода
+// строки в названии быть не может. Координаты и штрафы пишутся с %.9g, так что
+// float читается обратно без потерь.
+// Двоичный формат: заголовок TraceFileHeader, затем столбцы latitude, longitude,
+// penalty (float), kind (uint8), смещения названий (uint64, count+1 штук) и сами
+// названия; каждый столбец выровнен на 8 байт, порядок байтов - родной для машины
+class TraceFile
+{
+    public:
+        struct TraceFileHeader
+        {
+            char magic[4];
+            std::uint32_t version;
+            std::uint64_t count;
+            std::uint64_t nameBytes;
+        };
+
+        // Файл делится на куски по границам строк, куски разбираются параллельно
+        // и добавляются в трассу по порядку
+        static size_t importCsv(const std::string& path,
+                                TraceDirector& director,
+                                CheckPointBuilder& obligatoryBuilder,
+                                CheckPointBuilder& notObligatoryBuilder,
+                                unsigned threadsCount = std::thread::hardware_concurrency())
+        {
+            MappedFile file(path);
+            std::string_view text = file.view();
+            std::string_view firstLine = text.substr(0, text.find('\n'));
+            if(!firstLine.empty() && firstLine.back() == '\r')
+                firstLine.remove_suffix(1);
+            if(firstLine == csvHeader)
+                text.remove_prefix(std::min(text.size(), text.find('\n') + 1));
+
+            threadsCount = std::max(1u, std::min<unsigned>(threadsCount, static_cast<unsigned>(text.size() / (1 << 20) + 1)));
+            std::vector<std::string_view> chunks;
+            size_t begin = 0;
+            for(unsigned i = 1; i <= threadsCount && begin < text.size(); ++i)
+            {
+                size_t end = i == threadsCount ? text.size() : std::max(begin, text.size() * i / threadsCount);
+                end = text.find('\n', end);
+                end = end == std::string_view::npos ? text.size() : end + 1;
+                chunks.push_back(text.substr(begin, end - begin));
+                begin = end;
+            }
+
+            std::vector<TraceStorage> parts(chunks.size());
+            std::vector<std::string> errors(chunks.size());
+            std::vector<std::thread> workers;
+            for(size_t i = 0; i < chunks.size(); ++i)
+                workers.emplace_back([&, i]{
+                    try
+                    {
+                        parseCsvChunk(chunks[i], parts[i], obligatoryBuilder, notObligatoryBuilder);
+                    }
+                    catch(const std::exception& e)
+                    {
+                        errors[i] = e.what();
+                    }
+                });
+            for(auto& worker: workers)
+                worker.join();
+
+            size_t rows = 0;
+            size_t nameBytes = 0;
+            for(size_t i = 0; i < parts.size(); ++i)
+            {
+                if(!errors[i].empty())
+                    throw std::runtime_error(path + ": " + errors[i]);
+                rows += parts[i].size();
+                nameBytes += parts[i].allNames().size();
+            }
+            director.reserve(director.getTrace().size() + rows, director.getTrace().allNames().size() + nameBytes);
+            for(auto& part: parts)
+                director.appendTrace(part);
+            return rows;
+        }
+
+        static void exportCsv(const std::string& path, const TraceStorage& trace)
+        {
+            std::ofstream out(path, std::ios::binary);
+            std::string line;
+            out << csvHeader << "\n";
+            for(size_t i = 0; i < trace.size(); ++i)
+            {
+                char numbers[96];
+                int length = std::snprintf(numbers, sizeof(numbers), ",%c,%.9g,%.9g,%.9g\n",
+                                           trace.kinds()[i] == CHECKPOINT_OBLIGATORY ? 'O' : 'N',
+                                           trace.latitudes()[i], trace.longitudes()[i], trace.penalties()[i]);
+                writeCsvName(out, trace.name(i));
+                out.write(numbers, length);
+            }
+            if(!out)
+                throw std::runtime_error("cannot write " + path);
+        }
+
+        static void exportBinary(const std::string& path, const TraceStorage& trace)
+        {
+            std::ofstream out(path, std::ios::binary);
+            TraceFileHeader header = {{'T', 'R', 'C', 'B'}, 1, trace.size(), trace.allNames().size()};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            auto writeColumn = [&](const void* data, size_t bytes){
+                out.write(static_cast<const char*>(data), bytes);
+                static const char padding[8] = {};
+                out.write(padding, paddedSize(bytes) - bytes);
+            };
+            writeColumn(trace.latitudes().data(), trace.size() * sizeof(float));
+            writeColumn(trace.longitudes().data(), trace.size() * sizeof(float));
+            writeColumn(trace.penalties().data(), trace.size() * sizeof(float));
+            writeColumn(trace.kinds().data(), trace.size() * sizeof(CheckPointKind));
+            std::vector<std::uint64_t> offsets(trace.nameOffsets().begin(), trace.nameOffsets().end());
+            writeColumn(offsets.data(), offsets.size() * sizeof(std::uint64_t));
+            writeColumn(trace.allNames().data(), trace.allNames().size());
+            if(!out)
+                throw std::runtime_error("cannot write " + path);
+        }
+
+        // Столбцы берутся из отображения файла напрямую, без разбора
+        static size_t importBinary(const std::string& path, TraceDirector& director)
+        {
+            MappedFile file(path);
+            std::string_view bytes = file.view();
+            TraceFileHeader header;
+            if(bytes.size() < sizeof(header))
+                throw std::runtime_error(path + ": truncated header");
+            std::memcpy(&header, bytes.data(), sizeof(header));
+            if(std::memcmp(header.magic, "TRCB", 4) != 0 || header.version != 1)
+                throw std::runtime_error(path + ": not a trace file");
+            // Каждая точка занимает в столбцах не меньше minRowBytes, поэтому после
+            // этих проверок размеры столбцов ниже не переполняются
+            const size_t minRowBytes = 3 * sizeof(float) + sizeof(CheckPointKind) + sizeof(std::uint64_t);
+            if(header.count > bytes.size() / minRowBytes || header.nameBytes > bytes.size())
+                throw std::runtime_error(path + ": truncated columns");
+            size_t count = header.count;
+            size_t columnsSize = 3 * paddedSize(count * sizeof(float)) +
+                                 paddedSize(count * sizeof(CheckPointKind)) +
+                                 paddedSize((count + 1) * sizeof(std::uint64_t)) +
+                                 paddedSize(header.nameBytes);
+            if(bytes.size() < sizeof(header) + columnsSize)
+                throw std::runtime_error(path + ": truncated columns");
+
+            const char* cursor = bytes.data() + sizeof(header);
+            auto column = [&](size_t bytesCount){
+                const char* begin = cursor;
+                cursor += paddedSize(bytesCount);
+                return begin;
+            };
+            auto lats = reinterpret_cast<const float*>(column(count * sizeof(float)));
+            auto lons = reinterpret_cast<const float*>(column(count * sizeof(float)));
+            auto penalties = reinterpret_cast<const float*>(column(count * sizeof(float)));
+            auto kinds = reinterpret_cast<const CheckPointKind*>(column(count * sizeof(CheckPointKind)));
+            auto offsets = reinterpret_cast<const std::uint64_t*>(column((count + 1) * sizeof(std::uint64_t)));
+            std::string_view names(column(header.nameBytes), header.nameBytes);
+            if(offsets[0] != 0 || offsets[count] != header.nameBytes)
+                throw std::runtime_error(path + ": corrupted name offsets");
+            for(size_t i = 0; i < count; ++i)
+                if(offsets[i + 1] < offsets[i])
+                    throw std::runtime_error(path + ": corrupted name offsets");
+            for(size_t i = 0; i < count; ++i)
+                if(static_cast<std::uint8_t>(kinds[i]) > CHECKPOINT_NOT_OBLIGATORY)
+                    throw std::runtime_error(path + ": unknown checkpoint kind");
+
+            director.appendColumns(count, lats, lons, penalties, kinds, offsets, names);
+            return count;
+        }
+
+    private:
+        static constexpr std::string_view csvHeader = "name,type,latitude,longitude,penalty";
+        static constexpr size_t csvBatchSize = 1024;
+
+        static size_t paddedSize(size_t bytes) {return (bytes + 7) / 8 * 8;}
+
+        // Название с запятой или кавычкой берётся в кавычки, кавычки внутри удваиваются.
+        // Перевод строки в названии записать нельзя: файл делится на куски по строкам
+        static void writeCsvName(std::ostream& out, std::string_view name)
+        {
+            if(name.find_first_of(",\"\r\n") == std::string_view::npos)
+            {
+                out << name;
+                return;
+            }
+            if(name.find_first_of("\r\n") != std::string_view::npos)
+                throw std::runtime_error("line break in checkpoint name \"" + std::string(name) + "\"");
+            out << '"';
+            for(char c: name)
+            {
+                if(c == '"')
+                    out << '"';
+                out << c;
+            }
+            out << '"';
+        }
+
+        // Название в кавычках вместе с запятой после него убирается из начала line;
+        // результат без кавычек складывается в unquoted
+        static std::string_view takeQuotedName(std::string_view& line, std::string& unquoted)
+        {
+            unquoted.clear();
+            size_t i = 1;
+            for(;;)
+            {
+                size_t quote = line.find('"', i);
+                if(quote == std::string_view::npos)
+                    throw std::runtime_error("unterminated quoted name in \"" + std::string(line) + "\"");
+                unquoted.append(line.substr(i, quote - i));
+                i = quote + 1;
+                if(i < line.size() && line[i] == '"')
+                {
+                    unquoted += '"';
+                    ++i;
+                    continue;
+                }
+                break;
+            }
+            if(i >= line.size() || line[i] != ',')
+                throw std::runtime_error("expected 5 fields in \"" + std::string(line) + "\"");
+            line.remove_prefix(i + 1);
+            return unquoted;
+        }
+
+        static void parseCsvChunk(std::string_view chunk,
+                                  TraceStorage& part,
+                                  CheckPointBuilder& obligatoryBuilder,
+                                  CheckPointBuilder& notObligatoryBuilder)
+        {
+            part.reserve(chunk.size() / 32, chunk.size() / 4);
+            // Строки копятся пачкой точек одного вида и строятся одним вызовом
+            // BuildCheckPoints прямо в столбцы part, без CheckPoint на каждую строку.
+            // Названия из кавычек (они редки) живут в unquotedNames до конца куска
+            std::vector<CheckPointSpec> batch;
+            std::deque<std::string> unquotedNames;
+            CheckPointBuilder* batchBuilder = nullptr;
+            auto flush = [&]{
+                if(!batch.empty())
+                    batchBuilder->BuildCheckPoints(batch, part);
+                batch.clear();
+            };
+            while(!chunk.empty())
+            {
+                size_t end = chunk.find('\n');
+                std::string_view line = chunk.substr(0, end);
+                chunk.remove_prefix(end == std::string_view::npos ? chunk.size() : end + 1);
+                if(!line.empty() && line.back() == '\r')
+                    line.remove_suffix(1);
+                if(line.empty())
+                    continue;
+
+                std::string_view fields[5];
+                int first = 0;
+                if(line[0] == '"')
+                {
+                    unquotedNames.emplace_back();
+                    fields[first++] = takeQuotedName(line, unquotedNames.back());
+                }
+                for(int f = first; f < 5; ++f)
+                {
+                    size_t comma = f == 4 ? std::string_view::npos : line.find(',');
+                    if(f < 4 && comma == std::string_view::npos)
+                        throw std::runtime_error("expected 5 fields in \"" + std::string(line) + "\"");
+                    fields[f] = line.substr(0, comma);
+                    line.remove_prefix(comma == std::string_view::npos ? line.size() : comma + 1);
+                }
+                CheckPointBuilder* builder;
+                if(!fields[1].empty() && (fields[1][0] == 'O' || fields[1][0] == 'o'))
+                    builder = &obligatoryBuilder;
+                else if(!fields[1].empty() && (fields[1][0] == 'N' || fields[1][0] == 'n'))
+                    builder = &notObligatoryBuilder;
+                else
+                    throw std::runtime_error("unknown checkpoint type \"" + std::string(fields[1]) + "\"");
+                CheckPointSpec spec{fields[0], parseFloat(fields[2]), parseFloat(fields[3]), parseFloat(fields[4])};
+                if(builder != batchBuilder || batch.size() == csvBatchSize)
+                {
+                    flush();
+                    batchBuilder = builder;
+                }
+                batch.push_back(spec);
+            }
+            flush();
+        }
+
+        static float parseFloat(std::string_view field)
+        {
+            float value = 0;
+            auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), value);
+            if(error != std::errc() || end != field.data() + field.size())
+                throw std::runtime_error("bad number \"" + std::string(field) + "\"");
+            return value;
+        }
 };
 
 
-int main(){
-    CheckPointBuilder* o_builder = new ObligatoryCheckPointsBuilder;
-    TraceDirector director = TraceDirector(o_builder);
+// Сравнение прежней раскладки (вектор указателей на отдельные CheckPoint)
+// с TraceStorage: память на точку и время прохода по штрафам
+void benchmarkStorage(size_t checkPointsCount)
+{
+    using Clock = std::chrono::steady_clock;
+    NotObligatoryCheckPointsBuilder builder;
+    std::unique_ptr<CheckPoint> sample(builder.BuildCheckPoint("checkpoint 1234567", 60.5, 30.5, 10));
+    std::cout << "\n" << checkPointsCount << " checkpoints\n";
+
+    {
+        std::vector<std::unique_ptr<CheckPoint>> pointers;
+        pointers.reserve(checkPointsCount);
+        for(size_t i = 0; i < checkPointsCount; ++i)
+            pointers.emplace_back(new CheckPoint(*sample));
+        // Строки длиннее SSO-буфера лежат в куче отдельно от объекта
+        size_t bytes = pointers.capacity() * sizeof(CheckPoint*);
+        for(auto& checkPoint: pointers)
+            bytes += sizeof(CheckPoint) + checkPoint->name.capacity() + 1;
+        auto start = Clock::now();
+        double sum = 0;
+        for(auto& checkPoint: pointers)
+            sum += checkPoint->penalty;
+        std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+        std::cout << "pointers: " << double(bytes) / checkPointsCount << " bytes/checkpoint, scan "
+                  << elapsed.count() << " ms (sum " << sum << ")\n";
+    }
+    {
+        // Точки разбросаны по области, чтобы сетка индекса была похожа на настоящую
+        TraceStorage storage;
+        storage.reserve(checkPointsCount,
+                        checkPointsCount * sample->name.size());
+        std::mt19937 rng(28);
+        std::uniform_real_distribution<float> latitude(59.0f, 61.0f), longitude(29.0f, 33.0f);
+        for(size_t i = 0; i < checkPointsCount; ++i)
+            storage.append(sample->name, latitude(rng), longitude(rng), sample->penalty, sample->kind);
+        auto start = Clock::now();
+        double sum = 0;
+        for(float penalty: storage.penalties())
+            sum += penalty;
+        std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+        std::cout << "columns:  " << double(storage.memoryUsage()) / checkPointsCount << " bytes/checkpoint, scan "
+                  << elapsed.count() << " ms (sum " << sum << ")\n";
+        // Индекс директор строит только при первом поиске, но тогда он занимает память сверх столбцов
+        TraceSpatialIndex index;
+        index.update(storage);
+        std::cout << "grid index: " << double(index.memoryUsage()) / checkPointsCount << " bytes/checkpoint more, "
+                  << double(storage.memoryUsage() + index.memoryUsage()) / checkPointsCount << " with columns\n";
+    }
+}
+
+// Скорость построения трассы через директор и виртуальный строитель
+void benchmarkBuild(size_t checkPointsCount)
+{
+    using Clock = std::chrono::steady_clock;
+    ObligatoryCheckPointsBuilder o_builder;
+    NotObligatoryCheckPointsBuilder no_builder;
+    TraceDirector director(&o_builder);
+    director.reserve(checkPointsCount, checkPointsCount * 18);
+    auto start = Clock::now();
+    for(size_t i = 0; i < checkPointsCount; ++i)
+    {
+        director.setBuilder(i % 4 == 0 ? static_cast<CheckPointBuilder*>(&o_builder) : &no_builder);
+        director.addCheckPoint("checkpoint 1234567", 60.5f + i * 1e-6f, 30.5f, 10);
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::cout << "build: " << checkPointsCount / elapsed.count() << " checkpoints/sec\n";
+
+    start = Clock::now();
+    std::string text;
+    for(size_t i = 0; i < director.getTrace().size(); ++i)
+        director.getTrace().appendMessage(i, text);
+    elapsed = Clock::now() - start;
+    std::cout << "render: " << text.size() / elapsed.count() / 1e6 << " MB/sec\n";
+}
+
+// Поиск ближайшей точки и точек в радиусе: индекс против полного перебора
+void benchmarkSpatialIndex(size_t checkPointsCount, size_t queriesCount)
+{
+    using Clock = std::chrono::steady_clock;
+    NotObligatoryCheckPointsBuilder builder;
+    TraceDirector director(&builder);
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> latitude(59.0, 61.0), longitude(29.0, 33.0);
+    director.reserve(checkPointsCount, checkPointsCount * 2);
+    for(size_t i = 0; i < checkPointsCount; ++i)
+        director.addCheckPoint("cp", latitude(rng), longitude(rng), 1);
+    auto buildStart = Clock::now();
+    director.getSpatialIndex();
+    std::chrono::duration<double, std::milli> buildTime = Clock::now() - buildStart;
+    std::cout << "grid index over " << checkPointsCount << " checkpoints: built on first query in "
+              << buildTime.count() << " ms\n";
+    std::vector<double> lats(queriesCount), lons(queriesCount);
+    for(size_t i = 0; i < queriesCount; ++i)
+    {
+        lats[i] = latitude(rng);
+        lons[i] = longitude(rng);
+    }
+    const TraceStorage& trace = director.getTrace();
+
+    // Перебор слишком медленный, чтобы гонять его на всех запросах
+    size_t bruteForceCount = std::min<size_t>(queriesCount, 1000);
+    auto start = Clock::now();
+    std::vector<size_t> bruteForce(bruteForceCount);
+    for(size_t q = 0; q < bruteForceCount; ++q)
+    {
+        double bestDistance = std::numeric_limits<double>::infinity();
+        for(size_t i = 0; i < trace.size(); ++i)
+        {
+            double d = haversineMeters(lats[q], lons[q], trace.latitudes()[i], trace.longitudes()[i]);
+            if(d < bestDistance)
+            {
+                bestDistance = d;
+                bruteForce[q] = i;
+            }
+        }
+    }
+    std::chrono::duration<double> linearTime = Clock::now() - start;
+
+    start = Clock::now();
+    std::vector<size_t> indexed(queriesCount);
+    director.getSpatialIndex().nearestMany(trace, lats, lons, indexed);
+    std::chrono::duration<double> indexTime = Clock::now() - start;
+
+    start = Clock::now();
+    std::vector<std::vector<size_t>> around;
+    director.getSpatialIndex().withinMany(trace, lats, lons, 500, around);
+    std::chrono::duration<double> withinTime = Clock::now() - start;
+    size_t found = 0;
+    for(auto& points: around)
+        found += points.size();
+
+    std::cout << "nearest among " << checkPointsCount << " checkpoints: linear "
+              << bruteForceCount / linearTime.count() << " queries/sec, grid "
+              << queriesCount / indexTime.count() << " queries/sec, "
+              << (std::equal(bruteForce.begin(), bruteForce.end(), indexed.begin()) ? "results match" : "RESULTS DIFFER")
+              << "\n";
+    std::cout << "within 500 m: " << queriesCount / withinTime.count() << " queries/sec, "
+              << double(found) / queriesCount << " checkpoints per query\n";
+}
+
+// Проверка треков: трасса вдоль параллели, каждый участник идёт вдоль неё
+// с шумом GPS и с некоторой вероятностью срезает контрольную точку
+void benchmarkScoring(size_t checkPointsCount, size_t participantsCount)
+{
+    ObligatoryCheckPointsBuilder o_builder;
+    NotObligatoryCheckPointsBuilder no_builder;
+    TraceDirector director(&o_builder);
+    for(size_t i = 0; i < checkPointsCount; ++i)
+    {
+        director.setBuilder(i % 10 == 0 ? static_cast<CheckPointBuilder*>(&o_builder) : &no_builder);
+        director.addCheckPoint("cp", 60.0, 30.0 + i * 0.002, 100);
+    }
+
+    RaceScoringEngine engine(director, 30);
+    std::mt19937 rng(7);
+    std::normal_distribution<double> noise(0.0, 0.00005);
+    std::bernoulli_distribution skip(0.01);
+    const int pointsPerCheckPoint = 5;
+    for(size_t participant = 0; participant < participantsCount; ++participant)
+    {
+        std::vector<TrackPoint> track;
+        track.reserve(checkPointsCount * pointsPerCheckPoint);
+        for(size_t i = 0; i < checkPointsCount; ++i)
+        {
+            double offset = skip(rng) ? 0.003 : 0.0;
+            for(int k = 0; k < pointsPerCheckPoint; ++k)
+                track.push_back({60.0 + offset + noise(rng),
+                                 30.0 + (i + 0.5 * k / pointsPerCheckPoint) * 0.002 + noise(rng)});
+        }
+        engine.submit(participant, std::move(track));
+    }
+    std::vector<ScoringResult> results = engine.finish();
+    size_t disqualified = 0;
+    double penalty = 0;
+    for(auto& result: results)
+    {
+        disqualified += result.disqualified();
+        penalty += result.penalty;
+    }
+    std::cout << "scored " << results.size() << " tracks of " << checkPointsCount * pointsPerCheckPoint
+              << " points: " << engine.tracksPerSecond() << " tracks/sec, "
+              << disqualified << " disqualified, mean penalty " << penalty / results.size() << "\n";
+}
+
+// Проверка на трассе-восьмёрке: середина проходится дважды, финиш рядом со стартом,
+// участник стоит на старте несколько отсчётов. Все точки должны быть взяты
+void checkSelfCrossingRoute()
+{
+    ObligatoryCheckPointsBuilder o_builder;
+    TraceDirector director(&o_builder);
+    const double route[][2] = {{60.0, 30.0}, {60.0, 30.01}, {60.005, 30.02}, {59.995, 30.02},
+                               {60.0, 30.01}, {60.005, 30.0}, {59.995, 30.0}, {60.0, 30.0001}};
+    for(auto& checkPoint: route)
+        director.addCheckPoint("cp", checkPoint[0], checkPoint[1]);
+
+    std::vector<TrackPoint> track(5, TrackPoint{route[0][0], route[0][1]});
+    const int stepsPerLeg = 40;
+    for(size_t leg = 0; leg + 1 < std::size(route); ++leg)
+        for(int k = 1; k <= stepsPerLeg; ++k)
+        {
+            double t = double(k) / stepsPerLeg;
+            track.push_back({route[leg][0] + (route[leg + 1][0] - route[leg][0]) * t,
+                             route[leg][1] + (route[leg + 1][1] - route[leg][1]) * t});
+        }
+    RaceScoringEngine::Scratch scratch;
+    ScoringResult result = RaceScoringEngine::scoreTrack(director, 30, 0, track, scratch);
+    std::cout << "self-crossing route: " << result.visited.size() << " of " << std::size(route)
+              << " checkpoints taken, " << (result.disqualified() ? "DISQUALIFIED" : "ok") << "\n";
+}
+
+// Скорость загрузки трассы из CSV и из двоичного файла
+void benchmarkImport(size_t checkPointsCount)
+{
+    using Clock = std::chrono::steady_clock;
+    ObligatoryCheckPointsBuilder o_builder;
+    NotObligatoryCheckPointsBuilder no_builder;
+    TraceDirector source(&o_builder);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> latitude(-60, 70), longitude(-180, 180);
+    for(size_t i = 0; i < checkPointsCount; ++i)
+    {
+        source.setBuilder(i % 10 == 0 ? static_cast<CheckPointBuilder*>(&o_builder) : &no_builder);
+        source.addCheckPoint("checkpoint " + std::to_string(i), latitude(rng), longitude(rng), float(i % 500));
+    }
+    auto directory = std::filesystem::temp_directory_path();
+    std::string csvPath = (directory / "task6_trace.csv").string();
+    std::string binaryPath = (directory / "task6_trace.bin").string();
+    TraceFile::exportCsv(csvPath, source.getTrace());
+    TraceFile::exportBinary(binaryPath, source.getTrace());
+
+    auto report = [](const char* format, size_t rows, const std::string& path, std::chrono::duration<double> elapsed){
+        std::cout << format << ": " << rows / elapsed.count() << " rows/sec, "
+                  << std::filesystem::file_size(path) / elapsed.count() / 1e6 << " MB/sec\n";
+    };
+    {
+        TraceDirector director(&o_builder);
+        auto start = Clock::now();
+        size_t rows = TraceFile::importCsv(csvPath, director, o_builder, no_builder);
+        report("csv import", rows, csvPath, Clock::now() - start);
+        if(director.getSumPenalty() != source.getSumPenalty())
+            std::cout << "csv import: PENALTY MISMATCH\n";
+    }
+    {
+        TraceDirector director(&o_builder);
+        auto start = Clock::now();
+        size_t rows = TraceFile::importBinary(binaryPath, director);
+        report("binary import", rows, binaryPath, Clock::now() - start);
+        if(director.getTrace().name(rows - 1) != source.getTrace().name(rows - 1))
+            std::cout << "binary import: NAME MISMATCH\n";
+    }
+    std::filesystem::remove(csvPath);
+    std::filesystem::remove(binaryPath);
+}
+
+// Геометрия маршрута: блочные ядра против построчного haversine,
+// в одном потоке и во всех доступных
+void benchmarkRouteMetrics(size_t checkPointsCount)
+{
+    using Clock = std::chrono::steady_clock;
+    NotObligatoryCheckPointsBuilder builder;
+    TraceDirector director(&builder);
+    TraceStorage route;
+    route.reserve(checkPointsCount, checkPointsCount);
+    std::mt19937 rng(11);
+    std::normal_distribution<float> step(0.0f, 0.0005f);
+    float lat = 55.0f, lon = 37.0f;
+    for(size_t i = 0; i < checkPointsCount; ++i)
+    {
+        lat += step(rng);
+        lon += step(rng);
+        route.append("p", lat, lon, float(i % 7), i % 5 == 0 ? CHECKPOINT_OBLIGATORY : CHECKPOINT_NOT_OBLIGATORY);
+    }
+    director.appendTrace(route);
+    const TraceStorage& trace = director.getTrace();
+
+    auto start = Clock::now();
+    std::vector<double> reference(RouteKernels::segmentsCount(trace));
+    for(size_t i = 0; i < reference.size(); ++i)
+        reference[i] = haversineMeters(trace.latitudes()[i], trace.longitudes()[i],
+                                       trace.latitudes()[i + 1], trace.longitudes()[i + 1]);
+    double referenceTotal = 0;
+    for(double length: reference)
+        referenceTotal += length;
+    std::chrono::duration<double, std::milli> scalarTime = Clock::now() - start;
+
+    start = Clock::now();
+    double total = director.getRouteLength();
+    std::chrono::duration<double, std::milli> kernelTime = Clock::now() - start;
+
+    unsigned threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    start = Clock::now();
+    double parallelTotal = director.getRouteLength(threadsCount);
+    std::chrono::duration<double, std::milli> parallelTime = Clock::now() - start;
+
+    std::vector<double> lengths = director.getSegmentLengths(threadsCount);
+    std::vector<double> cumulative = director.getCumulativeDistances(threadsCount);
+    double maxError = 0;
+    for(size_t i = 0; i < reference.size(); ++i)
+        maxError = std::max(maxError, std::abs(lengths[i] - reference[i]));
+
+    std::cout << "route of " << checkPointsCount << " points: " << total / 1000 << " km, scalar haversine "
+              << scalarTime.count() << " ms, kernels " << kernelTime.count() << " ms, "
+              << threadsCount << " threads " << parallelTime.count() << " ms\n";
+    std::cout << "max segment error " << maxError << " m, total error " << std::abs(total - referenceTotal)
+              << " m, parallel total error " << std::abs(parallelTotal - referenceTotal)
+              << " m, cumulative end error " << std::abs(cumulative.back() - referenceTotal) << " m\n";
+    TraceDirector::PenaltySummary penalties = director.getPenaltyByKind();
+    std::cout << "penalties: obligatory " << penalties.obligatory << " in " << penalties.obligatoryCount
+              << ", not obligatory " << penalties.notObligatory << " in " << penalties.notObligatoryCount << "\n";
+}
+
+// Построение трассы по одной точке через виртуальный строитель против пакетного
+// построения. Отдельно - только построение в хранилище, без обновления индекса
+void benchmarkBatchBuild(size_t checkPointsCount)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<CheckPointSpec> specs(checkPointsCount);
+    for(size_t i = 0; i < checkPointsCount; ++i)
+        specs[i] = {"checkpoint", 60.0f + i * 1e-5f, 30.0f + i * 1e-5f, float(i % 100)};
+    NotObligatoryCheckPointsBuilder builder;
+    CheckPointBuilder* virtualBuilder = &builder;
+
+    auto measure = [&](const char* title, auto build){
+        auto start = Clock::now();
+        build();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        std::cout << title << ": " << checkPointsCount / elapsed.count() / 1e6 << " M checkpoints/sec\n";
+    };
+    {
+        TraceStorage storage;
+        measure("storage, virtual BuildCheckPoint", [&]{
+            for(const CheckPointSpec& spec: specs)
+            {
+                std::unique_ptr<CheckPoint> cp(virtualBuilder->BuildCheckPoint(spec.name, spec.latitude, spec.longitude, spec.penalty));
+                storage.append(*cp);
+            }
+        });
+    }
+    {
+        TraceStorage storage;
+        measure("storage, policy buildInto", [&]{
+            storage.reserve(checkPointsCount, checkPointsCount * 10);
+            PolicyCheckPointsBuilder<NotObligatoryPolicy>::buildInto(specs, storage);
+        });
+    }
+    {
+        TraceDirector director(&builder);
+        measure("director, addCheckPoint", [&]{
+            for(const CheckPointSpec& spec: specs)
+                director.addCheckPoint(spec.name, spec.latitude, spec.longitude, spec.penalty);
+        });
+    }
+    {
+        TraceDirector director(&builder);
+        measure("director, addCheckPoints<Policy>", [&]{
+            director.addCheckPoints<NotObligatoryPolicy>(specs);
+        });
+    }
+}
+
+
+int main(int argc, char* argv[]){
+    ObligatoryCheckPointsBuilder o_builder;
+    TraceDirector director = TraceDirector(&o_builder);
     director.addCheckPoint("Start", 60.002, 30.013);
     director.addCheckPoint("first stop", 60.402, 30.113, 122.0);
 
-    CheckPointBuilder* no_builder = new NotObligatoryCheckPointsBuilder;
-    director.setBuilder(no_builder);
+    NotObligatoryCheckPointsBuilder no_builder;
+    director.setBuilder(&no_builder);
     director.addCheckPoint("half of the way", 62.56, 36.467, 1000);
     director.addCheckPoint("finish", 65.015, 40.89, 500);
 
     std::cout<< "Sum penalty: " << std::to_string(director.getSumPenalty())<<"\n";
     director.aboutTrace();
+    checkSelfCrossingRoute();
+
+    size_t checkPointsCount = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    benchmarkStorage(checkPointsCount);
+    benchmarkBuild(checkPointsCount);
+    benchmarkSpatialIndex(100000, 10000);
+    benchmarkScoring(300, 1000);
+    benchmarkImport(checkPointsCount);
+    benchmarkRouteMetrics(checkPointsCount);
+    benchmarkBatchBuild(checkPointsCount);
     return 0;
 }
\ No newline at end of file
@@ -1,367 +1,4405 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <span>
+#include <array>
+#include <variant>
+#include <type_traits>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_set>
+#include <bit>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Вид конкретной реализации - чтобы мост мог выбирать и сравнивать реализации без RTTI
+enum SetBackend {SET_ARRAY, SET_TREAP, SET_SORTED_ARRAY, SET_HASH, SET_BITMAP, SET_PERSISTENT_TREAP};
+
+// Последовательный обход множества. Упорядоченные реализации выдают элементы
+// по возрастанию. Пока обход не закончен, множество менять нельзя
+template <typename T>
+class SetCursor {
+public:
+    virtual ~SetCursor() {}
+    // Записывает в buffer до capacity следующих элементов и возвращает их число, 0 - конец обхода
+    virtual size_t read(T* buffer, size_t capacity) = 0;
+};
 
 // Абстрактная реализация
 template <typename T>
 class SetImplementation {
 public:
+    virtual ~SetImplementation() {}
+
+    virtual SetBackend getBackend() const = 0;
     virtual void addElement(T element) = 0;
     virtual void removeElement(T element) = 0;
     virtual bool containsElement(T element) const = 0;
     virtual int getSize() const = 0;
     virtual std::vector<T> getAsVector()=0;
     virtual void fillFromVector(std::vector<T>& dataVector) = 0;
+    // Забирает содержимое, оставляя множество пустым. Вместе с fillFromVector
+    // позволяет сменить реализацию одним переносом данных
+    virtual std::vector<T> takeAsVector() = 0;
+    // Занятая память в байтах, вместе с запасом ёмкости
+    virtual size_t memoryUsage() const = 0;
+
+    virtual std::unique_ptr<SetCursor<T>> cursor() const = 0;
+    // true, если cursor() выдаёт элементы по возрастанию
+    virtual bool isOrdered() const = 0;
+    virtual SetImplementation<T>* createEmpty() const = 0;
+    virtual SetImplementation<T>* clone() const;
+    virtual void reserve(size_t) {}
+    // Добавление элемента, которого заведомо нет в множестве. У упорядоченных
+    // реализаций возрастающая серия таких добавлений стоит O(1) на элемент.
+    // После серии вызывается finishAppend
+    virtual void appendNew(T element) = 0;
+    virtual void finishAppend() {}
+
+    // Пакетные операции. По умолчанию это поэлементные вызовы, реализации
+    // переопределяют их своими алгоритмами для всего пакета сразу
+    virtual void addElements(std::span<const T> batch) {
+        for (const T& element : batch) {
+            addElement(element);
+        }
+    }
+    virtual void removeElements(std::span<const T> batch) {
+        for (const T& element : batch) {
+            removeElement(element);
+        }
+    }
+    virtual std::vector<bool> containsMany(std::span<const T> queries) const {
+        std::vector<bool> result(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            result[i] = containsElement(queries[i]);
+        }
+        return result;
+    }
 
-    virtual SetImplementation<T>* unionSet(SetImplementation<T>* other)=0;
-    virtual SetImplementation<T>* intersect(SetImplementation<T>* other)=0;
+    // Если обе реализации упорядочены, операции - слияния за O(n + m),
+    // иначе меньшее множество проверяется поиском в большем
+    virtual SetImplementation<T>* unionSet(SetImplementation<T>* other);
+    virtual SetImplementation<T>* intersect(SetImplementation<T>* other);
+    virtual SetImplementation<T>* difference(SetImplementation<T>* other);
+
+protected:
+    // Множество, в котором ищутся элементы другого: большее, а при равных
+    // размерах неупорядоченное (поиск в хеш-таблице дешевле)
+    static const SetImplementation<T>* probeTarget(const SetImplementation<T>* first, const SetImplementation<T>* second) {
+        if (first->getSize() != second->getSize()) {
+            return first->getSize() > second->getSize() ? first : second;
+        }
+        return first->isOrdered() ? second : first;
+    }
 };
 
-// Конкретная реализация для хранения множества в виде массива
+// Чтение курсора через буфер: один виртуальный вызов на bufferSize элементов
 template <typename T>
-class ArraySet : public SetImplementation<T> {
+class SetReader {
 private:
-    T* elements;
-    int capacity;
-    int size;
+    static constexpr size_t bufferSize = 256;
+    std::unique_ptr<SetCursor<T>> setCursor;
+    std::array<T, bufferSize> buffer;
+    size_t position = 0;
+    size_t count = 0;
+
+    void refill() {
+        position = 0;
+        count = setCursor->read(buffer.data(), bufferSize);
+    }
 
 public:
-    ArraySet() : capacity(10), size(0) {
-        elements = new T[capacity];
+    explicit SetReader(const SetImplementation<T>& set) : setCursor(set.cursor()) {
+        refill();
     }
 
-    ArraySet(const ArraySet& vs)
-    {
-        elements = vs.elements;
-        capacity = vs.capacity;
-        size = vs.size;
+    bool valid() const {
+        return position < count;
+    }
+    T current() const {
+        return buffer[position];
+    }
+    void advance() {
+        if (++position == count) {
+            refill();
+        }
     }
+};
 
-    ~ArraySet() {
-        delete[] elements;
+template <typename T>
+SetImplementation<T>* SetImplementation<T>::clone() const {
+    SetImplementation<T>* result = createEmpty();
+    result->reserve(getSize());
+    for (SetReader<T> reader(*this); reader.valid(); reader.advance()) {
+        result->appendNew(reader.current());
     }
+    result->finishAppend();
+    return result;
+}
 
-    void addElement(T element) override {
-        if (size >= capacity) {
-            // Увеличиваем размер массива вдвое, если он заполнен
-            capacity *= 2;
-            T* newElements = new T[capacity];
-            for (int i = 0; i < size; ++i) {
-                newElements[i] = elements[i];
+template <typename T>
+SetImplementation<T>* SetImplementation<T>::unionSet(SetImplementation<T>* other) {
+    if (isOrdered() && other->isOrdered()) {
+        SetImplementation<T>* result = createEmpty();
+        result->reserve(getSize() + other->getSize());
+        SetReader<T> first(*this), second(*other);
+        while (first.valid() && second.valid()) {
+            if (first.current() < second.current()) {
+                result->appendNew(first.current());
+                first.advance();
+            } else if (second.current() < first.current()) {
+                result->appendNew(second.current());
+                second.advance();
+            } else {
+                result->appendNew(first.current());
+                first.advance();
+                second.advance();
             }
-            delete[] elements;
-            elements = newElements;
         }
-        elements[size++] = element;
+        for (; first.valid(); first.advance()) {
+            result->appendNew(first.current());
+        }
+        for (; second.valid(); second.advance()) {
+            result->appendNew(second.current());
+        }
+        result->finishAppend();
+        return result;
+    }
+    // К копии большего множества дописываются недостающие элементы меньшего
+    const SetImplementation<T>* larger = probeTarget(this, other);
+    const SetImplementation<T>* smaller = larger == this ? other : this;
+    SetImplementation<T>* result = larger->clone();
+    result->reserve(getSize() + other->getSize());
+    for (SetReader<T> reader(*smaller); reader.valid(); reader.advance()) {
+        if (!larger->containsElement(reader.current())) {
+            result->appendNew(reader.current());
+        }
     }
+    result->finishAppend();
+    return result;
+}
 
-    void removeElement(T element) override {
-        for (int i = 0; i < size; ++i) {
-            if (elements[i] == element) {
-                for (int j = i; j < size - 1; ++j) {
-                    elements[j] = elements[j + 1];
-                }
-                size--;
-                break;
+template <typename T>
+SetImplementation<T>* SetImplementation<T>::intersect(SetImplementation<T>* other) {
+    if (isOrdered() && other->isOrdered()) {
+        SetImplementation<T>* result = createEmpty();
+        result->reserve(std::min(getSize(), other->getSize()));
+        SetReader<T> first(*this), second(*other);
+        while (first.valid() && second.valid()) {
+            if (first.current() < second.current()) {
+                first.advance();
+            } else if (second.current() < first.current()) {
+                second.advance();
+            } else {
+                result->appendNew(first.current());
+                first.advance();
+                second.advance();
             }
         }
+        result->finishAppend();
+        return result;
+    }
+    const SetImplementation<T>* larger = probeTarget(this, other);
+    const SetImplementation<T>* smaller = larger == this ? other : this;
+    SetImplementation<T>* result = smaller->createEmpty();
+    for (SetReader<T> reader(*smaller); reader.valid(); reader.advance()) {
+        if (larger->containsElement(reader.current())) {
+            result->appendNew(reader.current());
+        }
     }
+    result->finishAppend();
+    return result;
+}
 
-    bool containsElement(T element) const override {
-        for (int i = 0; i < size; ++i) {
-            if (elements[i] == element) {
-                return true;
+// Элементы this, которых нет в other
+template <typename T>
+SetImplementation<T>* SetImplementation<T>::difference(SetImplementation<T>* other) {
+    SetImplementation<T>* result = createEmpty();
+    if (isOrdered() && other->isOrdered()) {
+        SetReader<T> first(*this), second(*other);
+        while (first.valid() && second.valid()) {
+            if (first.current() < second.current()) {
+                result->appendNew(first.current());
+                first.advance();
+            } else if (second.current() < first.current()) {
+                second.advance();
+            } else {
+                first.advance();
+                second.advance();
+            }
+        }
+        for (; first.valid(); first.advance()) {
+            result->appendNew(first.current());
+        }
+    } else {
+        for (SetReader<T> reader(*this); reader.valid(); reader.advance()) {
+            if (!other->containsElement(reader.current())) {
+                result->appendNew(reader.current());
             }
         }
-        return false;
     }
+    result->finishAppend();
+    return result;
+}
 
-    std::vector<T> getAsVector() override {
-        std::vector<T> result;
-        for (int i = 0; i < size; ++i) {
-            result.push_back(elements[i]);
-        }
-        return result;
+// Курсор по непрерывному диапазону элементов (для реализаций на векторах)
+template <typename T>
+class RangeCursor : public SetCursor<T> {
+private:
+    const T* position;
+    const T* end;
+
+public:
+    RangeCursor(const T* first, const T* last) : position(first), end(last) {}
+
+    size_t read(T* buffer, size_t capacity) override {
+        size_t count = std::min<size_t>(capacity, end - position);
+        std::copy(position, position + count, buffer);
+        position += count;
+        return count;
     }
+};
 
-    void fillFromVector(std::vector<T>& dataVector) override {
-        if (capacity < dataVector.size()) {
-            delete[] elements;
-            capacity = dataVector.size() * 2;
-            elements = new T[capacity];
+// Конкретная реализация для хранения множества в виде массива
+template <typename T>
+class ArraySet final : public SetImplementation<T> {
+private:
+    // Сортировка запросов окупается, только когда и пакет, и массив не меньше
+    // порога: просмотр массива векторизуется и до 128 элементов стоит 5-30 нс
+    // на запрос, а сортированный путь - 20-40 нс
+    static constexpr size_t sortedQueriesThreshold = 128;
+
+    std::vector<T> elements;
+
+public:
+    ArraySet() {
+        elements.reserve(10);
+    }
+
+    SetBackend getBackend() const override {
+        return SET_ARRAY;
+    }
+
+    void addElement(T element) override {
+        if (!containsElement(element)) {
+            elements.push_back(element);
         }
-        for (int i = 0; i < dataVector.size(); ++i) {
-            elements[i] = dataVector[i];
+    }
+
+    void removeElement(T element) override {
+        auto it = std::find(elements.begin(), elements.end(), element);
+        if (it != elements.end()) {
+            elements.erase(it);
         }
-        size = dataVector.size();
+    }
+
+    bool containsElement(T element) const override {
+        return std::find(elements.begin(), elements.end(), element) != elements.end();
+    }
+
+    std::vector<T> getAsVector() override {
+        return elements;
+    }
+
+    size_t memoryUsage() const override {
+        return elements.capacity() * sizeof(T);
+    }
+
+    // Элементы вектора считаются различными, содержимое переносится без копирования
+    void fillFromVector(std::vector<T>& dataVector) override {
+        elements = std::move(dataVector);
+    }
+
+    std::vector<T> takeAsVector() override {
+        return std::move(elements);
     }
 
     int getSize() const override {
-        return size;
+        return static_cast<int>(elements.size());
     }
 
-    SetImplementation<T>* unionSet(SetImplementation<T>* other) override {
-        ArraySet<T>* result = this;
-        for (int i = 0; i < other->getSize(); ++i) {
-            T element = other->getAsVector()[i];
-            if (!result->containsElement(element)) {
-                result->addElement(element);
+    std::unique_ptr<SetCursor<T>> cursor() const override {
+        return std::make_unique<RangeCursor<T>>(elements.data(), elements.data() + elements.size());
+    }
+
+    bool isOrdered() const override {
+        return false;
+    }
+
+    SetImplementation<T>* createEmpty() const override {
+        return new ArraySet<T>;
+    }
+
+    SetImplementation<T>* clone() const override {
+        return new ArraySet<T>(*this);
+    }
+
+    void reserve(size_t count) override {
+        elements.reserve(count);
+    }
+
+    void appendNew(T element) override {
+        elements.push_back(element);
+    }
+
+    // Пакет сортируется, и каждый элемент массива ищется в нём двоичным поиском
+    void addElements(std::span<const T> batch) override {
+        std::vector<T> sorted(batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+        std::vector<bool> present(sorted.size());
+        for (const T& element : elements) {
+            auto it = std::lower_bound(sorted.begin(), sorted.end(), element);
+            if (it != sorted.end() && *it == element) {
+                present[it - sorted.begin()] = true;
+            }
+        }
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            if (!present[i]) {
+                elements.push_back(sorted[i]);
             }
         }
-        return result;
     }
 
-    SetImplementation<T>* intersect(SetImplementation<T>* other) override {
-        ArraySet<T>* result = new ArraySet<T>;
-        for (int i = 0; i < size; ++i) {
-            T element = elements[i];
-            if (other->containsElement(element)) {
-                result->addElement(element);
+    void removeElements(std::span<const T> batch) override {
+        std::vector<T> sorted(batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+        std::erase_if(elements, [&sorted](const T& element) {
+            return std::binary_search(sorted.begin(), sorted.end(), element);
+        });
+    }
+
+    // Небольшой пакет проверяется поэлементным просмотром массива. У большого
+    // сортируются только запросы: массив проходится один раз, и каждый его
+    // элемент ищется двоичным поиском среди запросов
+    std::vector<bool> containsMany(std::span<const T> queries) const override {
+        std::vector<bool> result(queries.size());
+        if (queries.size() < sortedQueriesThreshold || elements.size() < sortedQueriesThreshold) {
+            for (size_t i = 0; i < queries.size(); ++i) {
+                result[i] = containsElement(queries[i]);
+            }
+            return result;
+        }
+        std::vector<T> sorted(queries.begin(), queries.end());
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+        std::vector<bool> present(sorted.size());
+        for (const T& element : elements) {
+            auto it = std::lower_bound(sorted.begin(), sorted.end(), element);
+            if (it != sorted.end() && *it == element) {
+                present[it - sorted.begin()] = true;
             }
         }
+        for (size_t i = 0; i < queries.size(); ++i) {
+            result[i] = present[std::lower_bound(sorted.begin(), sorted.end(), queries[i]) - sorted.begin()];
+        }
         return result;
     }
 };
 
 
-// Конкретная реализация для хранения множества в виде Heap-дерева
+// Конкретная реализация для хранения множества в виде Heap-дерева.
+// Узлы лежат в пуле множества и ссылаются друг на друга 32-битными индексами,
+// освобождённые узлы переиспользуются через список свободных. Вставка, удаление,
+// поиск и обход выполняются циклами, разрушение множества - освобождение пула
 template <typename T>
-class TreapSet : public SetImplementation<T> {
+class TreapSet final : public SetImplementation<T> {
 private:
+    using Index = std::uint32_t;
+    static constexpr Index none = 0xffffffffu;
+
     struct Node {
         T key;
         int priority;
-        Node* left;
-        Node* right;
-        
-        Node(T k, int p) : key(k), priority(p), left(nullptr), right(nullptr) {}
+        Index left;
+        Index right;
     };
 
-    Node* root;
+    std::vector<Node> nodes;
+    // Свободные узлы связаны через поле left
+    Index freeList = none;
+    Index root = none;
     std::mt19937 rng; // Генератор случайных чисел
     int size;
-    
-    // Вспомогательная функция для вставки элемента в дерево
-    Node* insertNode(Node* root, T key, int priority) {
-        if (root == nullptr) {
-            return new Node(key, priority);
+    // Правая ветвь дерева для серии appendNew, пустая вне такой серии
+    std::vector<Index> rightSpine;
+
+    class Cursor : public SetCursor<T> {
+    private:
+        const std::vector<Node>& nodes;
+        std::vector<Index> stack;
+
+        void pushLeftBranch(Index node) {
+            for (; node != none; node = nodes[node].left) {
+                stack.push_back(node);
+            }
         }
-        
-        if (key < root->key) {
-            root->left = insertNode(root->left, key, priority);
-            if (root->left->priority > root->priority) {
-                // Поворот вправо
-                Node* newRoot = root->left;
-                root->left = newRoot->right;
-                newRoot->right = root;
-                return newRoot;
+
+    public:
+        Cursor(const std::vector<Node>& nodes, Index root) : nodes(nodes) {
+            pushLeftBranch(root);
+        }
+
+        size_t read(T* buffer, size_t capacity) override {
+            size_t count = 0;
+            while (count < capacity && !stack.empty()) {
+                Index node = stack.back();
+                stack.pop_back();
+                buffer[count++] = nodes[node].key;
+                pushLeftBranch(nodes[node].right);
             }
+            return count;
+        }
+    };
+
+    // Подвешивание узла с ключом больше всех имеющихся к правой ветви spine дерева
+    // с корнем top: узлы ветви с меньшим приоритетом становятся его левым поддеревом
+    void attachToSpine(std::vector<Index>& spine, Index& top, Index node) {
+        Index lastPopped = none;
+        while (!spine.empty() && nodes[spine.back()].priority < nodes[node].priority) {
+            lastPopped = spine.back();
+            spine.pop_back();
+        }
+        nodes[node].left = lastPopped;
+        if (spine.empty()) {
+            top = node;
         } else {
-            root->right = insertNode(root->right, key, priority);
-            if (root->right->priority > root->priority) {
-                // Поворот влево
-                Node* newRoot = root->right;
-                root->right = newRoot->left;
-                newRoot->left = root;
-                return newRoot;
-            }
+            nodes[spine.back()].right = node;
         }
-        
-        return root;
+        spine.push_back(node);
     }
-    
-    // Вспомогательная функция для удаления элемента из дерева
-    Node* removeNode(Node* root, T key) {
-        if (root == nullptr) {
-            return root;
+
+    // Отдельное дерево в том же пуле из возрастающих ключей, за O(n)
+    Index buildSorted(const std::vector<T>& sorted) {
+        std::vector<Index> spine;
+        Index top = none;
+        for (const T& key : sorted) {
+            attachToSpine(spine, top, allocateNode(key, static_cast<int>(rng())));
         }
-        
-        if (key < root->key) {
-            root->left = removeNode(root->left, key);
-        } else if (key > root->key) {
-            root->right = removeNode(root->right, key);
+        return top;
+    }
+
+    static std::vector<T> sortedUnique(std::span<const T> batch) {
+        std::vector<T> sorted(batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+        return sorted;
+    }
+
+    Index allocateNode(T key, int priority) {
+        Index node;
+        if (freeList != none) {
+            node = freeList;
+            freeList = nodes[node].left;
+            nodes[node] = Node{key, priority, none, none};
         } else {
-            if (root->left == nullptr) {
-                Node* temp = root->right;
-                delete root;
-                return temp;
-            } else if (root->right == nullptr) {
-                Node* temp = root->left;
-                delete root;
-                return temp;
-            }
-            
-            // Выполняем поворот для удаления узла с двумя детьми
-            if (root->left->priority > root->right->priority) {
-                // Поворот вправо
-                Node* newRoot = root->left;
-                root->left = newRoot->right;
-                newRoot->right = root;
-                root = newRoot;
+            node = static_cast<Index>(nodes.size());
+            nodes.push_back(Node{key, priority, none, none});
+        }
+        return node;
+    }
+
+    void releaseNode(Index node) {
+        nodes[node].left = freeList;
+        freeList = node;
+    }
+
+    // Место (ссылка родителя или root), где находится или должен быть ключ
+    Index* findLink(T key) {
+        Index* link = &root;
+        while (*link != none) {
+            Node& node = nodes[*link];
+            if (key < node.key) {
+                link = &node.left;
+            } else if (node.key < key) {
+                link = &node.right;
             } else {
-                // Поворот влево
-                Node* newRoot = root->right;
-                root->right = newRoot->left;
-                newRoot->left = root;
-                root = newRoot;
+                break;
             }
-            
-            // Рекурсивно удаляем узел
-            root = removeNode(root, key);
         }
-        
-        return root;
+        return link;
     }
-    
-    // Вспомогательная функция для проверки наличия элемента в дереве
-    bool containsNode(Node* root, T key) const {
-        if (root == nullptr) {
-            return false;
+
+    // Спуск по пути поиска до первого узла с меньшим приоритетом: его поддерево
+    // делится по ключу на левое и правое поддеревья нового узла
+    void insertNode(T key, int priority) {
+        Index node = allocateNode(key, priority);
+        Index* link = &root;
+        while (*link != none && nodes[*link].priority >= priority) {
+            link = key < nodes[*link].key ? &nodes[*link].left : &nodes[*link].right;
         }
-        if (key < root->key) {
-            return containsNode(root->left, key);
-        } else if (key > root->key) {
-            return containsNode(root->right, key);
-        } else {
-            return true;
+        Index rest = *link;
+        *link = node;
+        Index* lessHook = &nodes[node].left;
+        Index* greaterHook = &nodes[node].right;
+        while (rest != none) {
+            if (nodes[rest].key < key) {
+                *lessHook = rest;
+                lessHook = &nodes[rest].right;
+                rest = nodes[rest].right;
+            } else {
+                *greaterHook = rest;
+                greaterHook = &nodes[rest].left;
+                rest = nodes[rest].left;
+            }
         }
+        *lessHook = none;
+        *greaterHook = none;
     }
-    
-    // Вспомогательная функция для обхода дерева и добавления элементов в std::vector
-    void inorderTraversal(Node* node, std::vector<T>& result) {
-        if (node != nullptr) {
-            inorderTraversal(node->left, result);
-            result.push_back(node->key);
-            inorderTraversal(node->right, result);
+
+    // Узел заменяется слиянием его поддеревьев
+    void removeNode(Index* link) {
+        Index removed = *link;
+        *link = join(nodes, nodes[removed].left, nodes[removed].right);
+        releaseNode(removed);
+    }
+
+    // Число потоков для операций над большими деревьями и размер, начиная с которого они используются
+    static inline int parallelism = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    static constexpr int parallelThreshold = 1 << 16;
+    // Меньшие пакеты вставляются и удаляются поэлементно: сборка отдельного дерева
+    // и объединение обгоняют одиночные вставки только с пакетов в несколько тысяч
+    static constexpr size_t batchThreshold = 4096;
+
+    // Глубина рекурсии, до которой подзадачи раздаются потокам: 2^depth >= parallelism
+    static int forkDepthFor(int elements) {
+        int depth = 0;
+        if (elements >= parallelThreshold) {
+            while ((1 << depth) < parallelism) {
+                ++depth;
+            }
         }
+        return depth;
     }
-    
+
+    // Две независимые подзадачи; при fork первая выполняется в отдельном потоке
+    template <typename First, typename Second>
+    static void forkJoin(bool fork, First first, Second second) {
+        if (!fork) {
+            first();
+            second();
+            return;
+        }
+        std::thread worker(first);
+        second();
+        worker.join();
+    }
+
+    // Разделение дерева на ключи меньше key и больше key. Узел с ключом key,
+    // если он есть, отцепляется и возвращается
+    static Index split(std::vector<Node>& nodes, Index node, T key, Index& less, Index& greater) {
+        Index* lessHook = &less;
+        Index* greaterHook = &greater;
+        Index equal = none;
+        while (node != none) {
+            if (nodes[node].key < key) {
+                *lessHook = node;
+                lessHook = &nodes[node].right;
+                node = nodes[node].right;
+            } else if (key < nodes[node].key) {
+                *greaterHook = node;
+                greaterHook = &nodes[node].left;
+                node = nodes[node].left;
+            } else {
+                equal = node;
+                *lessHook = nodes[node].left;
+                *greaterHook = nodes[node].right;
+                nodes[node].left = nodes[node].right = none;
+                return equal;
+            }
+        }
+        *lessHook = none;
+        *greaterHook = none;
+        return equal;
+    }
+
+    // Слияние деревьев, в которых все ключи left меньше всех ключей right
+    static Index join(std::vector<Node>& nodes, Index left, Index right) {
+        Index result = none;
+        Index* hook = &result;
+        while (left != none && right != none) {
+            if (nodes[left].priority > nodes[right].priority) {
+                *hook = left;
+                hook = &nodes[left].right;
+                left = nodes[left].right;
+            } else {
+                *hook = right;
+                hook = &nodes[right].left;
+                right = nodes[right].left;
+            }
+        }
+        *hook = left != none ? left : right;
+        return result;
+    }
+
+    // Все узлы поддерева попадают в released
+    static void collectTree(const std::vector<Node>& nodes, Index node, std::vector<Index>& released) {
+        size_t first = released.size();
+        if (node != none) {
+            released.push_back(node);
+        }
+        for (size_t i = first; i < released.size(); ++i) {
+            const Node& current = nodes[released[i]];
+            if (current.left != none) {
+                released.push_back(current.left);
+            }
+            if (current.right != none) {
+                released.push_back(current.right);
+            }
+        }
+    }
+
+    // Операции над деревьями ниже работают в общем пуле и забирают оба
+    // дерева-аргумента. Корень с большим приоритетом делит другое дерево по своему
+    // ключу, и половины обрабатываются независимо, поэтому на верхних forkDepth
+    // уровнях они уходят в разные потоки. Пул при этом не растёт, а выброшенные
+    // узлы каждая подзадача собирает в свой released
+    static Index uniteNodes(std::vector<Node>& nodes, Index a, Index b, int forkDepth, std::vector<Index>& released) {
+        if (a == none) {
+            return b;
+        }
+        if (b == none) {
+            return a;
+        }
+        if (nodes[a].priority < nodes[b].priority) {
+            std::swap(a, b);
+        }
+        Index less, greater;
+        Index equal = split(nodes, b, nodes[a].key, less, greater);
+        if (equal != none) {
+            released.push_back(equal);
+        }
+        Index left = nodes[a].left;
+        Index right = nodes[a].right;
+        Index unitedLeft, unitedRight;
+        std::vector<Index> rightReleased;
+        forkJoin(forkDepth > 0,
+                 [&] {unitedLeft = uniteNodes(nodes, left, less, forkDepth - 1, released);},
+                 [&] {unitedRight = uniteNodes(nodes, right, greater, forkDepth - 1, rightReleased);});
+        released.insert(released.end(), rightReleased.begin(), rightReleased.end());
+        nodes[a].left = unitedLeft;
+        nodes[a].right = unitedRight;
+        return a;
+    }
+
+    static Index intersectNodes(std::vector<Node>& nodes, Index a, Index b, int forkDepth, std::vector<Index>& released) {
+        if (a == none || b == none) {
+            collectTree(nodes, a, released);
+            collectTree(nodes, b, released);
+            return none;
+        }
+        if (nodes[a].priority < nodes[b].priority) {
+            std::swap(a, b);
+        }
+        Index less, greater;
+        Index equal = split(nodes, b, nodes[a].key, less, greater);
+        Index aLeft = nodes[a].left;
+        Index aRight = nodes[a].right;
+        Index left, right;
+        std::vector<Index> rightReleased;
+        forkJoin(forkDepth > 0,
+                 [&] {left = intersectNodes(nodes, aLeft, less, forkDepth - 1, released);},
+                 [&] {right = intersectNodes(nodes, aRight, greater, forkDepth - 1, rightReleased);});
+        released.insert(released.end(), rightReleased.begin(), rightReleased.end());
+        if (equal == none) {
+            released.push_back(a);
+            return join(nodes, left, right);
+        }
+        released.push_back(equal);
+        nodes[a].left = left;
+        nodes[a].right = right;
+        return a;
+    }
+
+    // Ключи a, которых нет в b
+    static Index subtractNodes(std::vector<Node>& nodes, Index a, Index b, int forkDepth, std::vector<Index>& released) {
+        if (a == none || b == none) {
+            collectTree(nodes, b, released);
+            return a;
+        }
+        Index less, greater;
+        Index equal = split(nodes, b, nodes[a].key, less, greater);
+        Index aLeft = nodes[a].left;
+        Index aRight = nodes[a].right;
+        Index left, right;
+        std::vector<Index> rightReleased;
+        forkJoin(forkDepth > 0,
+                 [&] {left = subtractNodes(nodes, aLeft, less, forkDepth - 1, released);},
+                 [&] {right = subtractNodes(nodes, aRight, greater, forkDepth - 1, rightReleased);});
+        released.insert(released.end(), rightReleased.begin(), rightReleased.end());
+        if (equal != none) {
+            released.push_back(equal);
+            released.push_back(a);
+            return join(nodes, left, right);
+        }
+        nodes[a].left = left;
+        nodes[a].right = right;
+        return a;
+    }
+
+    // Пул копируется целиком, узлы второго дерева дописываются со сдвигом индексов.
+    // Операция не меняет аргументов и работает с этой копией
+    template <typename Operation>
+    TreapSet<T>* combine(const TreapSet<T>* other, Operation operation) const {
+        TreapSet<T>* result = new TreapSet<T>(*this);
+        Index offset = static_cast<Index>(result->nodes.size());
+        result->nodes.reserve(nodes.size() + other->nodes.size());
+        for (Node node : other->nodes) {
+            node.left = node.left == none ? none : node.left + offset;
+            node.right = node.right == none ? none : node.right + offset;
+            result->nodes.push_back(node);
+        }
+        // Свободные узлы второго пула дописываются к списку свободных
+        for (Index node = other->freeList; node != none; node = other->nodes[node].left) {
+            result->releaseNode(node + offset);
+        }
+        Index otherRoot = other->root == none ? none : other->root + offset;
+        std::vector<Index> released;
+        result->root = operation(result->nodes, result->root, otherRoot, forkDepthFor(size + other->size), released);
+        for (Index node : released) {
+            result->releaseNode(node);
+        }
+        // Каждый узел обоих деревьев либо остался в результате, либо выброшен
+        result->size = size + other->size - static_cast<int>(released.size());
+        return result;
+    }
+
 public:
-    TreapSet() : root(nullptr), rng(std::random_device()()) {size=0;}
+    TreapSet() : rng(std::random_device()()) {size=0;}
+    TreapSet(const TreapSet&) = default;
+    TreapSet(TreapSet&&) = default;
+    TreapSet& operator=(const TreapSet&) = delete;
+
+    SetBackend getBackend() const override {
+        return SET_TREAP;
+    }
     
     void addElement(T element) override {
-        std::cout<<"i am in treapset add element\n";
-        int priority = rng();
-        root = insertNode(root, element, priority);
+        if (*findLink(element) != none) {
+            return;
+        }
+        rightSpine.clear();
+        insertNode(element, static_cast<int>(rng()));
         size+=1;
     }
     
     void removeElement(T element) override {
-        root = removeNode(root, element);
+        Index* link = findLink(element);
+        if (*link == none) {
+            return;
+        }
+        rightSpine.clear();
+        removeNode(link);
         size-=1;
     }
     
     bool containsElement(T element) const override {
-        return containsNode(root, element);
+        Index node = root;
+        while (node != none) {
+            if (element < nodes[node].key) {
+                node = nodes[node].left;
+            } else if (nodes[node].key < element) {
+                node = nodes[node].right;
+            } else {
+                return true;
+            }
+        }
+        return false;
     }
     
-    // Метод для заполнения дерева из std::vector
+    // Метод для заполнения дерева из std::vector. В пустое дерево упорядоченные
+    // данные собираются за O(n) серией appendNew, остальные сначала сортируются
     void fillFromVector(std::vector<T>& vec) override{
-        std::cout<<"trying to fill from vector\n";
-        for (auto element : vec) {
-            addElement(element);
+        if (root != none) {
+            for (auto element : vec) {
+                addElement(element);
+            }
+            return;
+        }
+        if (!std::is_sorted(vec.begin(), vec.end())) {
+            std::sort(vec.begin(), vec.end());
+        }
+        vec.erase(std::unique(vec.begin(), vec.end()), vec.end());
+        nodes.reserve(vec.size());
+        for (auto element : vec) {
+            appendNew(element);
+        }
+        finishAppend();
+    }
+
+    static void setParallelism(int threads) {
+        parallelism = std::max(1, threads);
+    }
+    
+    // Метод для получения содержимого дерева в виде std::vector
+    std::vector<T> getAsVector() override{
+        std::vector<T> result(size);
+        Cursor cursor(nodes, root);
+        cursor.read(result.data(), result.size());
+        return result;
+    }
+
+    std::vector<T> takeAsVector() override{
+        std::vector<T> result = getAsVector();
+        nodes.clear();
+        nodes.shrink_to_fit();
+        freeList = none;
+        root = none;
+        rightSpine.clear();
+        size = 0;
+        return result;
+    }
+
+    int getSize() const override
+    {
+        return size;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(Node);
+    }
+
+    std::unique_ptr<SetCursor<T>> cursor() const override
+    {
+        return std::make_unique<Cursor>(nodes, root);
+    }
+
+    bool isOrdered() const override
+    {
+        return true;
+    }
+
+    SetImplementation<T>* createEmpty() const override
+    {
+        return new TreapSet<T>;
+    }
+
+    SetImplementation<T>* clone() const override
+    {
+        return new TreapSet<T>(*this);
+    }
+
+    void reserve(size_t count) override
+    {
+        nodes.reserve(count);
+    }
+
+    // Два дерева объединяются через split/join за O(m log(n/m + 1))
+    SetImplementation<T>* unionSet(SetImplementation<T>* other) override
+    {
+        if (other->getBackend() != SET_TREAP) {
+            return SetImplementation<T>::unionSet(other);
+        }
+        return combine(static_cast<TreapSet<T>*>(other), uniteNodes);
+    }
+
+    SetImplementation<T>* intersect(SetImplementation<T>* other) override
+    {
+        if (other->getBackend() != SET_TREAP) {
+            return SetImplementation<T>::intersect(other);
+        }
+        return combine(static_cast<TreapSet<T>*>(other), intersectNodes);
+    }
+
+    SetImplementation<T>* difference(SetImplementation<T>* other) override
+    {
+        if (other->getBackend() != SET_TREAP) {
+            return SetImplementation<T>::difference(other);
+        }
+        return combine(static_cast<TreapSet<T>*>(other), subtractNodes);
+    }
+
+    // Элемент больше всех имеющихся подвешивается к правой ветви. Каждый узел
+    // попадает в ветвь и уходит из неё один раз, так что серия стоит O(n)
+    void appendNew(T element) override
+    {
+        if (rightSpine.empty()) {
+            for (Index node = root; node != none; node = nodes[node].right) {
+                rightSpine.push_back(node);
+            }
+        }
+        if (!rightSpine.empty() && !(nodes[rightSpine.back()].key < element)) {
+            rightSpine.clear();
+            insertNode(element, static_cast<int>(rng()));
+            size+=1;
+            return;
+        }
+        attachToSpine(rightSpine, root, allocateNode(element, static_cast<int>(rng())));
+        size+=1;
+    }
+
+    void finishAppend() override
+    {
+        rightSpine.clear();
+        rightSpine.shrink_to_fit();
+    }
+
+    // Пакет собирается в отдельное дерево того же пула и объединяется с основным
+    // через split/join за O(k log(n/k + 1))
+    void addElements(std::span<const T> batch) override
+    {
+        if (batch.size() < batchThreshold) {
+            SetImplementation<T>::addElements(batch);
+            return;
+        }
+        std::vector<T> sorted = sortedUnique(batch);
+        rightSpine.clear();
+        Index batchRoot = buildSorted(sorted);
+        std::vector<Index> released;
+        root = uniteNodes(nodes, root, batchRoot, forkDepthFor(static_cast<int>(sorted.size())), released);
+        for (Index node : released) {
+            releaseNode(node);
+        }
+        size += static_cast<int>(sorted.size() - released.size());
+    }
+
+    // Выброшены все узлы пакета и совпавшие с ними узлы дерева
+    void removeElements(std::span<const T> batch) override
+    {
+        if (batch.size() < batchThreshold) {
+            SetImplementation<T>::removeElements(batch);
+            return;
+        }
+        std::vector<T> sorted = sortedUnique(batch);
+        rightSpine.clear();
+        Index batchRoot = buildSorted(sorted);
+        std::vector<Index> released;
+        root = subtractNodes(nodes, root, batchRoot, forkDepthFor(static_cast<int>(sorted.size())), released);
+        for (Index node : released) {
+            releaseNode(node);
+        }
+        size -= static_cast<int>(released.size() - sorted.size());
+    }
+
+    // Поиск с пальцем: запросы обходятся по возрастанию, а в стеке хранятся узлы,
+    // где спуск уходил влево. Следующий поиск начинается не от корня, а от левого
+    // сына ближайшего такого узла с ключом больше запроса
+    std::vector<bool> containsMany(std::span<const T> queries) const override
+    {
+        std::vector<size_t> order(queries.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&queries](size_t a, size_t b) {return queries[a] < queries[b];});
+        std::vector<bool> result(queries.size());
+        std::vector<Index> leftTurns;
+        for (size_t i : order) {
+            const T& query = queries[i];
+            bool found = false;
+            while (!leftTurns.empty() && !(query < nodes[leftTurns.back()].key)) {
+                if (!(nodes[leftTurns.back()].key < query)) {
+                    found = true;
+                    break;
+                }
+                leftTurns.pop_back();
+            }
+            Index node = found ? none : leftTurns.empty() ? root : nodes[leftTurns.back()].left;
+            while (node != none) {
+                if (query < nodes[node].key) {
+                    leftTurns.push_back(node);
+                    node = nodes[node].left;
+                } else if (nodes[node].key < query) {
+                    node = nodes[node].right;
+                } else {
+                    found = true;
+                    break;
+                }
+            }
+            result[i] = found;
+        }
+        return result;
+    }
+};
+
+// Конкретная реализация для хранения множества в виде отсортированного массива
+template <typename T>
+class SortedArraySet final : public SetImplementation<T> {
+private:
+    std::vector<T> elements;
+
+    // Окно, до которого бинарный поиск сужает диапазон перед линейным досмотром
+    static constexpr size_t linearWindow = 16;
+    // Пакет проходит слиянием, если элементов массива на запрос меньше mergeRatio.
+    // Замеры на массивах 10^3-10^7: слияние с удвоением шага не медленнее
+    // поэлементного поиска, пока на запрос приходится до ~2*10^5 элементов
+    static constexpr size_t mergeRatio = size_t(1) << 18;
+
+    // Проверка наличия key среди count элементов подряд. Для 32-битных целых
+    // сравниваются сразу 16 элементов четырьмя SSE2-сравнениями
+    static bool containsInWindow(const T* first, size_t count, T key) {
+#if defined(__SSE2__)
+        if constexpr (std::is_integral_v<T> && sizeof(T) == 4) {
+            if (count == linearWindow) {
+                __m128i needle = _mm_set1_epi32(static_cast<int>(key));
+                const __m128i* block = reinterpret_cast<const __m128i*>(first);
+                __m128i equal = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block), needle),
+                                 _mm_cmpeq_epi32(_mm_loadu_si128(block + 1), needle)),
+                    _mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block + 2), needle),
+                                 _mm_cmpeq_epi32(_mm_loadu_si128(block + 3), needle)));
+                return _mm_movemask_epi8(equal) != 0;
+            }
+        }
+#endif
+        bool found = false;
+        for (size_t i = 0; i < count; ++i) {
+            found |= first[i] == key;
+        }
+        return found;
+    }
+
+    // Слияние отсортированного пакета без повторов с текущими элементами
+    void mergeSorted(const std::vector<T>& batch) {
+        std::vector<T> merged;
+        merged.reserve(elements.size() + batch.size());
+        std::set_union(elements.begin(), elements.end(), batch.begin(), batch.end(), std::back_inserter(merged));
+        elements = std::move(merged);
+    }
+
+public:
+    SetBackend getBackend() const override {
+        return SET_SORTED_ARRAY;
+    }
+
+    void addElement(T element) override {
+        auto it = std::lower_bound(elements.begin(), elements.end(), element);
+        if (it == elements.end() || *it != element) {
+            elements.insert(it, element);
+        }
+    }
+
+    void removeElement(T element) override {
+        auto it = std::lower_bound(elements.begin(), elements.end(), element);
+        if (it != elements.end() && *it == element) {
+            elements.erase(it);
+        }
+    }
+
+    // Бинарный поиск без ветвлений: сравнение превращается в условное
+    // присваивание. Когда искомая позиция сужена до окна [base, base + count]
+    // из не более чем linearWindow элементов, окно досматривается линейно
+    bool containsElement(T element) const override {
+        const T* base = elements.data();
+        const T* end = base + elements.size();
+        size_t count = elements.size();
+        while (count >= linearWindow) {
+            size_t half = count / 2;
+            base = base[half] < element ? base + half : base;
+            count -= half;
+        }
+        return containsInWindow(base, std::min<size_t>(linearWindow, end - base), element);
+    }
+
+    // Пакетное добавление: пакет сортируется и сливается с массивом за один проход
+    void addElements(std::span<const T> batch) override {
+        std::vector<T> sorted(batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+        mergeSorted(sorted);
+    }
+
+    void removeElements(std::span<const T> batch) override {
+        std::vector<T> sorted(batch.begin(), batch.end());
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<T> remaining;
+        remaining.reserve(elements.size());
+        std::set_difference(elements.begin(), elements.end(), sorted.begin(), sorted.end(),
+                            std::back_inserter(remaining));
+        elements = std::move(remaining);
+    }
+
+    // Небольшой пакет ищется поэлементно, большой - сортируется и проходится
+    // по массиву слева направо. От позиции предыдущего запроса шаг удваивается,
+    // пока не перескочит запрос, и найденный промежуток досматривается lower_bound
+    std::vector<bool> containsMany(std::span<const T> queries) const override {
+        std::vector<bool> result(queries.size());
+        if (queries.size() * mergeRatio < elements.size()) {
+            for (size_t i = 0; i < queries.size(); ++i) {
+                result[i] = containsElement(queries[i]);
+            }
+            return result;
+        }
+        std::vector<size_t> order(queries.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&queries](size_t a, size_t b) {return queries[a] < queries[b];});
+        auto position = elements.begin();
+        for (size_t i : order) {
+            const T& query = queries[i];
+            ptrdiff_t step = 1;
+            while (step < elements.end() - position && position[step] < query) {
+                position += step;
+                step *= 2;
+            }
+            position = std::lower_bound(position, position + std::min(step, elements.end() - position), query);
+            result[i] = position != elements.end() && !(query < *position);
+        }
+        return result;
+    }
+
+    int getSize() const override {
+        return static_cast<int>(elements.size());
+    }
+
+    std::vector<T> getAsVector() override {
+        return elements;
+    }
+
+    size_t memoryUsage() const override {
+        return elements.capacity() * sizeof(T);
+    }
+
+    void fillFromVector(std::vector<T>& dataVector) override {
+        elements = std::move(dataVector);
+        if (!std::is_sorted(elements.begin(), elements.end())) {
+            std::sort(elements.begin(), elements.end());
+        }
+        elements.erase(std::unique(elements.begin(), elements.end()), elements.end());
+    }
+
+    std::vector<T> takeAsVector() override {
+        return std::move(elements);
+    }
+
+    std::unique_ptr<SetCursor<T>> cursor() const override {
+        return std::make_unique<RangeCursor<T>>(elements.data(), elements.data() + elements.size());
+    }
+
+    bool isOrdered() const override {
+        return true;
+    }
+
+    SetImplementation<T>* createEmpty() const override {
+        return new SortedArraySet<T>;
+    }
+
+    SetImplementation<T>* clone() const override {
+        return new SortedArraySet<T>(*this);
+    }
+
+    void reserve(size_t count) override {
+        elements.reserve(count);
+    }
+
+    void appendNew(T element) override {
+        elements.push_back(element);
+    }
+
+    // Дописанные не по порядку элементы досортировываются и вливаются в начало массива
+    void finishAppend() override {
+        auto unsorted = std::is_sorted_until(elements.begin(), elements.end());
+        if (unsorted != elements.end()) {
+            std::sort(unsorted, elements.end());
+            std::inplace_merge(elements.begin(), unsorted, elements.end());
+        }
+    }
+
+    // Два отсортированных массива сливаются напрямую, без курсоров
+    SetImplementation<T>* unionSet(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_SORTED_ARRAY) {
+            return SetImplementation<T>::unionSet(other);
+        }
+        const std::vector<T>& otherElements = static_cast<SortedArraySet<T>*>(other)->elements;
+        SortedArraySet<T>* result = new SortedArraySet<T>;
+        result->elements.reserve(elements.size() + otherElements.size());
+        std::set_union(elements.begin(), elements.end(), otherElements.begin(), otherElements.end(),
+                       std::back_inserter(result->elements));
+        return result;
+    }
+
+    SetImplementation<T>* intersect(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_SORTED_ARRAY) {
+            return SetImplementation<T>::intersect(other);
+        }
+        const std::vector<T>& otherElements = static_cast<SortedArraySet<T>*>(other)->elements;
+        SortedArraySet<T>* result = new SortedArraySet<T>;
+        std::set_intersection(elements.begin(), elements.end(), otherElements.begin(), otherElements.end(),
+                              std::back_inserter(result->elements));
+        return result;
+    }
+
+    SetImplementation<T>* difference(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_SORTED_ARRAY) {
+            return SetImplementation<T>::difference(other);
+        }
+        const std::vector<T>& otherElements = static_cast<SortedArraySet<T>*>(other)->elements;
+        SortedArraySet<T>* result = new SortedArraySet<T>;
+        std::set_difference(elements.begin(), elements.end(), otherElements.begin(), otherElements.end(),
+                            std::back_inserter(result->elements));
+        return result;
+    }
+};
+
+// Конкретная реализация для хранения множества в виде хеш-таблицы с открытой
+// адресацией по схеме Robin Hood: при вставке элемент, ушедший от своей ячейки
+// дальше, вытесняет более "богатый". Удаление сдвигает следующие элементы
+// назад, поэтому надгробия не нужны и поиск останавливается на первой пустой ячейке
+template <typename T>
+class HashSet final : public SetImplementation<T> {
+private:
+    std::vector<T> keys;
+    // 0 - ячейка пуста, иначе расстояние от домашней ячейки плюс один
+    std::vector<std::uint8_t> distances;
+    size_t mask = 0;
+    int size = 0;
+
+    static constexpr size_t minCapacity = 16;
+    static constexpr std::uint8_t maxDistance = 255;
+
+    class Cursor : public SetCursor<T> {
+    private:
+        const HashSet<T>& set;
+        size_t index = 0;
+
+    public:
+        explicit Cursor(const HashSet<T>& set) : set(set) {}
+
+        size_t read(T* buffer, size_t capacity) override {
+            size_t count = 0;
+            for (; count < capacity && index < set.keys.size(); ++index) {
+                if (set.distances[index] != 0) {
+                    buffer[count++] = set.keys[index];
+                }
+            }
+            return count;
+        }
+    };
+
+    // std::hash для целых - тождественная функция, поэтому биты перемешиваются
+    static size_t hashOf(const T& element) {
+        std::uint64_t h = std::hash<T>()(element);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<T> oldKeys = std::move(keys);
+        std::vector<std::uint8_t> oldDistances = std::move(distances);
+        keys.assign(capacity, T());
+        distances.assign(capacity, 0);
+        mask = capacity - 1;
+        size = 0;
+        for (size_t i = 0; i < oldKeys.size(); ++i) {
+            if (oldDistances[i] != 0) {
+                insertNew(oldKeys[i]);
+            }
+        }
+    }
+
+    // Вставка элемента, которого заведомо нет в таблице
+    void insertNew(T element) {
+        size_t index = hashOf(element) & mask;
+        std::uint8_t distance = 1;
+        for (;;) {
+            if (distances[index] == 0) {
+                keys[index] = element;
+                distances[index] = distance;
+                ++size;
+                return;
+            }
+            if (distances[index] < distance) {
+                std::swap(keys[index], element);
+                std::swap(distances[index], distance);
+            }
+            index = (index + 1) & mask;
+            if (++distance == maxDistance) {
+                // Слишком длинная цепочка: расширяем таблицу и вставляем заново
+                rehash(keys.size() * 2);
+                insertNew(element);
+                return;
+            }
+        }
+    }
+
+    // На сколько элементов пакета вперёд запрашиваются ячейки таблицы
+    static constexpr size_t prefetchDistance = 8;
+
+    void prefetch(const T& element) const {
+        size_t index = hashOf(element) & mask;
+        __builtin_prefetch(distances.data() + index);
+        __builtin_prefetch(keys.data() + index);
+    }
+
+    size_t findIndex(const T& element) const {
+        if (keys.empty()) {
+            return keys.size();
+        }
+        size_t index = hashOf(element) & mask;
+        for (std::uint8_t distance = 1; distances[index] >= distance; ++distance) {
+            if (keys[index] == element) {
+                return index;
+            }
+            index = (index + 1) & mask;
+        }
+        return keys.size();
+    }
+
+public:
+    SetBackend getBackend() const override {
+        return SET_HASH;
+    }
+
+    // Подготовка таблицы под count элементов при заполнении не выше 7/8
+    void reserve(size_t count) override {
+        size_t capacity = minCapacity;
+        while (capacity * 7 / 8 < count) {
+            capacity *= 2;
+        }
+        if (capacity > keys.size()) {
+            rehash(capacity);
+        }
+    }
+
+    void addElement(T element) override {
+        if (findIndex(element) != keys.size()) {
+            return;
+        }
+        reserve(size + 1);
+        insertNew(element);
+    }
+
+    void removeElement(T element) override {
+        size_t index = findIndex(element);
+        if (index == keys.size()) {
+            return;
+        }
+        size_t next = (index + 1) & mask;
+        while (distances[next] > 1) {
+            keys[index] = keys[next];
+            distances[index] = distances[next] - 1;
+            index = next;
+            next = (next + 1) & mask;
+        }
+        distances[index] = 0;
+        --size;
+    }
+
+    bool containsElement(T element) const override {
+        return findIndex(element) != keys.size();
+    }
+
+    int getSize() const override {
+        return size;
+    }
+
+    std::vector<T> getAsVector() override {
+        std::vector<T> result;
+        result.reserve(size);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (distances[i] != 0) {
+                result.push_back(keys[i]);
+            }
+        }
+        return result;
+    }
+
+    void fillFromVector(std::vector<T>& dataVector) override {
+        keys.clear();
+        distances.clear();
+        size = 0;
+        reserve(dataVector.size());
+        for (const T& element : dataVector) {
+            addElement(element);
+        }
+    }
+
+    std::vector<T> takeAsVector() override {
+        std::vector<T> result = getAsVector();
+        keys.clear();
+        distances.clear();
+        mask = 0;
+        size = 0;
+        return result;
+    }
+
+    size_t memoryUsage() const override {
+        return keys.capacity() * sizeof(T) + distances.capacity();
+    }
+
+    std::unique_ptr<SetCursor<T>> cursor() const override {
+        return std::make_unique<Cursor>(*this);
+    }
+
+    bool isOrdered() const override {
+        return false;
+    }
+
+    SetImplementation<T>* createEmpty() const override {
+        return new HashSet<T>;
+    }
+
+    SetImplementation<T>* clone() const override {
+        return new HashSet<T>(*this);
+    }
+
+    void appendNew(T element) override {
+        reserve(size + 1);
+        insertNew(element);
+    }
+
+    // Пакетные операции запрашивают ячейки на prefetchDistance элементов вперёд,
+    // так что промахи кэша соседних элементов пакета перекрываются
+    void addElements(std::span<const T> batch) override {
+        reserve(size + batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (i + prefetchDistance < batch.size()) {
+                prefetch(batch[i + prefetchDistance]);
+            }
+            if (findIndex(batch[i]) == keys.size()) {
+                insertNew(batch[i]);
+            }
+        }
+    }
+
+    void removeElements(std::span<const T> batch) override {
+        if (keys.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (i + prefetchDistance < batch.size()) {
+                prefetch(batch[i + prefetchDistance]);
+            }
+            removeElement(batch[i]);
+        }
+    }
+
+    std::vector<bool> containsMany(std::span<const T> queries) const override {
+        std::vector<bool> result(queries.size());
+        if (keys.empty()) {
+            return result;
+        }
+        for (size_t i = 0; i < queries.size(); ++i) {
+            if (i + prefetchDistance < queries.size()) {
+                prefetch(queries[i + prefetchDistance]);
+            }
+            result[i] = findIndex(queries[i]) != keys.size();
+        }
+        return result;
+    }
+};
+
+// Конкретная реализация для множеств целых в виде сжатого битового массива
+// (по схеме Roaring). Ключ делится на старшую часть, выбирающую кусок из 65536
+// значений, и младшие 16 бит. Каждый кусок хранится в том контейнере, который
+// для него компактнее: отсортированный массив (до 4096 значений), битовая карта
+// на 1024 слова или список интервалов (только после optimize())
+template <typename T>
+class BitmapSet final : public SetImplementation<T> {
+    static_assert(std::is_integral_v<T>, "BitmapSet stores integral keys only");
+
+private:
+    enum ChunkType : std::uint8_t {CHUNK_ARRAY, CHUNK_BITMAP, CHUNK_RUNS};
+
+    static constexpr size_t arrayLimit = 4096;
+    static constexpr size_t bitmapWords = 1024;
+    // С какой длины серия элементов одного куска-массива вливается слиянием,
+    // а не поэлементными вставками со сдвигом. На кусках из 100-3000 значений
+    // слияние выигрывает с серий в 32-64 элемента
+    static constexpr size_t mergeRunThreshold = 64;
+
+    struct Run {
+        std::uint16_t start;
+        std::uint16_t lengthMinusOne;
+    };
+
+    struct Chunk {
+        std::uint64_t high;
+        ChunkType type = CHUNK_ARRAY;
+        std::uint32_t cardinality = 0;
+        std::vector<std::uint16_t> values;
+        std::vector<std::uint64_t> words;
+        std::vector<Run> runs;
+
+        bool contains(std::uint16_t low) const {
+            if (type == CHUNK_BITMAP) {
+                return (words[low >> 6] >> (low & 63)) & 1;
+            }
+            if (type == CHUNK_ARRAY) {
+                return std::binary_search(values.begin(), values.end(), low);
+            }
+            auto it = std::upper_bound(runs.begin(), runs.end(), low,
+                                       [](std::uint16_t value, const Run& run) {return value < run.start;});
+            if (it == runs.begin()) {
+                return false;
+            }
+            --it;
+            return low - it->start <= it->lengthMinusOne;
+        }
+
+        // Изменяемые операции работают с массивом или битовой картой
+        void toStandard() {
+            if (type != CHUNK_RUNS) {
+                return;
+            }
+            std::vector<Run> oldRuns = std::move(runs);
+            runs.clear();
+            if (cardinality > arrayLimit) {
+                type = CHUNK_BITMAP;
+                words.assign(bitmapWords, 0);
+                for (const Run& run : oldRuns) {
+                    for (std::uint32_t v = run.start; v <= std::uint32_t(run.start) + run.lengthMinusOne; ++v) {
+                        words[v >> 6] |= std::uint64_t(1) << (v & 63);
+                    }
+                }
+            } else {
+                type = CHUNK_ARRAY;
+                values.clear();
+                values.reserve(cardinality);
+                for (const Run& run : oldRuns) {
+                    for (std::uint32_t v = run.start; v <= std::uint32_t(run.start) + run.lengthMinusOne; ++v) {
+                        values.push_back(static_cast<std::uint16_t>(v));
+                    }
+                }
+            }
+        }
+
+        void arrayToBitmap() {
+            words.assign(bitmapWords, 0);
+            for (std::uint16_t v : values) {
+                words[v >> 6] |= std::uint64_t(1) << (v & 63);
+            }
+            values.clear();
+            values.shrink_to_fit();
+            type = CHUNK_BITMAP;
+        }
+
+        void bitmapToArray() {
+            values.clear();
+            values.reserve(cardinality);
+            forEach([&](std::uint16_t v) {values.push_back(v);});
+            words.clear();
+            words.shrink_to_fit();
+            type = CHUNK_ARRAY;
+        }
+
+        // Выбор контейнера по кардинальности после групповых операций
+        void normalize() {
+            if (type == CHUNK_BITMAP && cardinality <= arrayLimit) {
+                bitmapToArray();
+            } else if (type == CHUNK_ARRAY && cardinality > arrayLimit) {
+                arrayToBitmap();
+            }
+        }
+
+        bool add(std::uint16_t low) {
+            toStandard();
+            if (type == CHUNK_BITMAP) {
+                std::uint64_t& word = words[low >> 6];
+                std::uint64_t bit = std::uint64_t(1) << (low & 63);
+                if (word & bit) {
+                    return false;
+                }
+                word |= bit;
+            } else {
+                auto it = std::lower_bound(values.begin(), values.end(), low);
+                if (it != values.end() && *it == low) {
+                    return false;
+                }
+                values.insert(it, low);
+            }
+            ++cardinality;
+            normalize();
+            return true;
+        }
+
+        bool remove(std::uint16_t low) {
+            toStandard();
+            if (type == CHUNK_BITMAP) {
+                std::uint64_t& word = words[low >> 6];
+                std::uint64_t bit = std::uint64_t(1) << (low & 63);
+                if (!(word & bit)) {
+                    return false;
+                }
+                word &= ~bit;
+            } else {
+                auto it = std::lower_bound(values.begin(), values.end(), low);
+                if (it == values.end() || *it != low) {
+                    return false;
+                }
+                values.erase(it);
+            }
+            --cardinality;
+            normalize();
+            return true;
+        }
+
+        // Пакетные изменения: младшие части ключей отсортированы и различны
+        void addSorted(const std::vector<std::uint16_t>& lows) {
+            toStandard();
+            if (type == CHUNK_BITMAP) {
+                for (std::uint16_t v : lows) {
+                    std::uint64_t& word = words[v >> 6];
+                    cardinality += !((word >> (v & 63)) & 1);
+                    word |= std::uint64_t(1) << (v & 63);
+                }
+            } else {
+                std::vector<std::uint16_t> merged;
+                merged.reserve(values.size() + lows.size());
+                std::set_union(values.begin(), values.end(), lows.begin(), lows.end(), std::back_inserter(merged));
+                values = std::move(merged);
+                cardinality = static_cast<std::uint32_t>(values.size());
+            }
+            normalize();
+        }
+
+        void removeSorted(const std::vector<std::uint16_t>& lows) {
+            toStandard();
+            if (type == CHUNK_BITMAP) {
+                for (std::uint16_t v : lows) {
+                    std::uint64_t& word = words[v >> 6];
+                    cardinality -= (word >> (v & 63)) & 1;
+                    word &= ~(std::uint64_t(1) << (v & 63));
+                }
+            } else {
+                std::vector<std::uint16_t> remaining;
+                remaining.reserve(values.size());
+                std::set_difference(values.begin(), values.end(), lows.begin(), lows.end(), std::back_inserter(remaining));
+                values = std::move(remaining);
+                cardinality = static_cast<std::uint32_t>(values.size());
+            }
+            normalize();
+        }
+
+        template <typename Visitor>
+        void forEach(Visitor visit) const {
+            if (type == CHUNK_ARRAY) {
+                for (std::uint16_t v : values) {
+                    visit(v);
+                }
+            } else if (type == CHUNK_BITMAP) {
+                for (size_t w = 0; w < bitmapWords; ++w) {
+                    for (std::uint64_t word = words[w]; word != 0; word &= word - 1) {
+                        visit(static_cast<std::uint16_t>(w * 64 + std::countr_zero(word)));
+                    }
+                }
+            } else {
+                for (const Run& run : runs) {
+                    for (std::uint32_t v = run.start; v <= std::uint32_t(run.start) + run.lengthMinusOne; ++v) {
+                        visit(static_cast<std::uint16_t>(v));
+                    }
+                }
+            }
+        }
+
+        // Перевод в список интервалов, если он меньше текущего контейнера
+        void optimize() {
+            if (type == CHUNK_RUNS) {
+                return;
+            }
+            std::vector<Run> candidate;
+            forEach([&](std::uint16_t v) {
+                if (!candidate.empty() && std::uint32_t(candidate.back().start) + candidate.back().lengthMinusOne + 1 == v) {
+                    candidate.back().lengthMinusOne++;
+                } else {
+                    candidate.push_back({v, 0});
+                }
+            });
+            size_t currentBytes = type == CHUNK_ARRAY ? values.size() * sizeof(std::uint16_t) : bitmapWords * sizeof(std::uint64_t);
+            if (candidate.size() * sizeof(Run) < currentBytes) {
+                runs = std::move(candidate);
+                values.clear();
+                values.shrink_to_fit();
+                words.clear();
+                words.shrink_to_fit();
+                type = CHUNK_RUNS;
+            }
+        }
+
+        size_t memoryUsage() const {
+            return sizeof(Chunk) + values.capacity() * sizeof(std::uint16_t) +
+                   words.capacity() * sizeof(std::uint64_t) + runs.capacity() * sizeof(Run);
+        }
+    };
+
+    std::vector<Chunk> chunks;
+    int size = 0;
+
+    // Позиция обхода внутри куска: индекс значения, следующего слова или интервала
+    class Cursor : public SetCursor<T> {
+    private:
+        const std::vector<Chunk>& chunks;
+        size_t chunkIndex = 0;
+        size_t position = 0;
+        std::uint64_t word = 0;
+        std::uint32_t runOffset = 0;
+
+    public:
+        explicit Cursor(const std::vector<Chunk>& chunks) : chunks(chunks) {}
+
+        size_t read(T* buffer, size_t capacity) override {
+            size_t count = 0;
+            while (count < capacity && chunkIndex < chunks.size()) {
+                const Chunk& chunk = chunks[chunkIndex];
+                std::uint64_t base = chunk.high << 16;
+                bool finished;
+                if (chunk.type == CHUNK_ARRAY) {
+                    while (count < capacity && position < chunk.values.size()) {
+                        buffer[count++] = fromKey(base | chunk.values[position++]);
+                    }
+                    finished = position == chunk.values.size();
+                } else if (chunk.type == CHUNK_BITMAP) {
+                    while (count < capacity && (word != 0 || position < bitmapWords)) {
+                        if (word == 0) {
+                            word = chunk.words[position++];
+                            continue;
+                        }
+                        buffer[count++] = fromKey(base | ((position - 1) * 64 + std::countr_zero(word)));
+                        word &= word - 1;
+                    }
+                    finished = word == 0 && position == bitmapWords;
+                } else {
+                    while (count < capacity && position < chunk.runs.size()) {
+                        const Run& run = chunk.runs[position];
+                        buffer[count++] = fromKey(base | (run.start + runOffset));
+                        if (runOffset++ == run.lengthMinusOne) {
+                            runOffset = 0;
+                            ++position;
+                        }
+                    }
+                    finished = position == chunk.runs.size();
+                }
+                if (finished) {
+                    ++chunkIndex;
+                    position = 0;
+                    word = 0;
+                }
+            }
+            return count;
+        }
+    };
+
+    // Знаковые ключи сдвигаются так, чтобы порядок беззнаковых совпадал с исходным
+    static std::uint64_t toKey(T element) {
+        using Unsigned = std::make_unsigned_t<T>;
+        Unsigned value = static_cast<Unsigned>(element);
+        if constexpr (std::is_signed_v<T>) {
+            value ^= Unsigned(1) << (sizeof(T) * 8 - 1);
+        }
+        return static_cast<std::uint64_t>(value);
+    }
+    static T fromKey(std::uint64_t key) {
+        using Unsigned = std::make_unsigned_t<T>;
+        Unsigned value = static_cast<Unsigned>(key);
+        if constexpr (std::is_signed_v<T>) {
+            value ^= Unsigned(1) << (sizeof(T) * 8 - 1);
+        }
+        return static_cast<T>(value);
+    }
+
+    typename std::vector<Chunk>::iterator findChunk(std::uint64_t high) {
+        return std::lower_bound(chunks.begin(), chunks.end(), high,
+                                [](const Chunk& chunk, std::uint64_t value) {return chunk.high < value;});
+    }
+    typename std::vector<Chunk>::const_iterator findChunk(std::uint64_t high) const {
+        return std::lower_bound(chunks.begin(), chunks.end(), high,
+                                [](const Chunk& chunk, std::uint64_t value) {return chunk.high < value;});
+    }
+
+    // Пакет проходится в исходном порядке без копии: подряд идущие элементы
+    // с одной старшей частью ключа меняют один раз найденный кусок. В кусок-массив
+    // серия от mergeRunThreshold элементов вливается слиянием, остальные
+    // элементы добавляются и удаляются по одному
+    template <bool adding>
+    void updateBatch(std::span<const T> batch) {
+        std::vector<std::uint16_t> lows;
+        auto it = chunks.end();
+        for (size_t i = 0; i < batch.size();) {
+            std::uint64_t high = toKey(batch[i]) >> 16;
+            size_t last = i + 1;
+            while (last < batch.size() && toKey(batch[last]) >> 16 == high) {
+                ++last;
+            }
+            if (it == chunks.end() || it->high != high) {
+                it = findChunk(high);
+                if (it == chunks.end() || it->high != high) {
+                    if (!adding) {
+                        i = last;
+                        continue;
+                    }
+                    it = chunks.insert(it, Chunk());
+                    it->high = high;
+                }
+            }
+            size -= it->cardinality;
+            if (last - i >= mergeRunThreshold && it->type != CHUNK_BITMAP) {
+                lows.clear();
+                for (; i < last; ++i) {
+                    lows.push_back(static_cast<std::uint16_t>(toKey(batch[i])));
+                }
+                std::sort(lows.begin(), lows.end());
+                lows.erase(std::unique(lows.begin(), lows.end()), lows.end());
+                if constexpr (adding) {
+                    it->addSorted(lows);
+                } else {
+                    it->removeSorted(lows);
+                }
+            } else {
+                for (; i < last; ++i) {
+                    std::uint16_t low = static_cast<std::uint16_t>(toKey(batch[i]));
+                    if constexpr (adding) {
+                        it->add(low);
+                    } else {
+                        it->remove(low);
+                    }
+                }
+            }
+            size += it->cardinality;
+            if (it->cardinality == 0) {
+                chunks.erase(it);
+                it = chunks.end();
+            }
+        }
+    }
+
+    // Пословные операции над битовыми картами, по два слова за SSE2-инструкцию.
+    // Возвращают число единичных битов результата
+    static std::uint32_t orWords(const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* out) {
+#if defined(__SSE2__)
+        for (size_t i = 0; i < bitmapWords; i += 2) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_or_si128(x, y));
+        }
+#else
+        for (size_t i = 0; i < bitmapWords; ++i) {
+            out[i] = a[i] | b[i];
+        }
+#endif
+        return countBits(out);
+    }
+    static std::uint32_t andWords(const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* out) {
+#if defined(__SSE2__)
+        for (size_t i = 0; i < bitmapWords; i += 2) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(x, y));
+        }
+#else
+        for (size_t i = 0; i < bitmapWords; ++i) {
+            out[i] = a[i] & b[i];
+        }
+#endif
+        return countBits(out);
+    }
+    static std::uint32_t countBits(const std::uint64_t* words) {
+        std::uint32_t count = 0;
+        for (size_t i = 0; i < bitmapWords; ++i) {
+            count += std::popcount(words[i]);
+        }
+        return count;
+    }
+
+    static Chunk unionChunks(Chunk a, Chunk b) {
+        a.toStandard();
+        b.toStandard();
+        Chunk result;
+        result.high = a.high;
+        if (a.type == CHUNK_BITMAP && b.type == CHUNK_BITMAP) {
+            result.type = CHUNK_BITMAP;
+            result.words.resize(bitmapWords);
+            result.cardinality = orWords(a.words.data(), b.words.data(), result.words.data());
+        } else if (a.type == CHUNK_BITMAP || b.type == CHUNK_BITMAP) {
+            Chunk& bitmap = a.type == CHUNK_BITMAP ? a : b;
+            Chunk& array = a.type == CHUNK_BITMAP ? b : a;
+            result = std::move(bitmap);
+            for (std::uint16_t v : array.values) {
+                std::uint64_t& word = result.words[v >> 6];
+                result.cardinality += !((word >> (v & 63)) & 1);
+                word |= std::uint64_t(1) << (v & 63);
+            }
+        } else {
+            result.values.reserve(a.values.size() + b.values.size());
+            std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+                           std::back_inserter(result.values));
+            result.cardinality = static_cast<std::uint32_t>(result.values.size());
+        }
+        result.normalize();
+        return result;
+    }
+
+    static std::uint32_t andNotWords(const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* out) {
+#if defined(__SSE2__)
+        for (size_t i = 0; i < bitmapWords; i += 2) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_andnot_si128(y, x));
+        }
+#else
+        for (size_t i = 0; i < bitmapWords; ++i) {
+            out[i] = a[i] & ~b[i];
+        }
+#endif
+        return countBits(out);
+    }
+
+    static Chunk differenceChunks(Chunk a, Chunk b) {
+        a.toStandard();
+        b.toStandard();
+        Chunk result;
+        result.high = a.high;
+        if (a.type == CHUNK_BITMAP && b.type == CHUNK_BITMAP) {
+            result.type = CHUNK_BITMAP;
+            result.words.resize(bitmapWords);
+            result.cardinality = andNotWords(a.words.data(), b.words.data(), result.words.data());
+        } else if (a.type == CHUNK_BITMAP) {
+            result = std::move(a);
+            for (std::uint16_t v : b.values) {
+                std::uint64_t& word = result.words[v >> 6];
+                result.cardinality -= (word >> (v & 63)) & 1;
+                word &= ~(std::uint64_t(1) << (v & 63));
+            }
+        } else {
+            for (std::uint16_t v : a.values) {
+                if (!b.contains(v)) {
+                    result.values.push_back(v);
+                }
+            }
+            result.cardinality = static_cast<std::uint32_t>(result.values.size());
+        }
+        result.normalize();
+        return result;
+    }
+
+    static Chunk intersectChunks(Chunk a, Chunk b) {
+        a.toStandard();
+        b.toStandard();
+        Chunk result;
+        result.high = a.high;
+        if (a.type == CHUNK_BITMAP && b.type == CHUNK_BITMAP) {
+            result.type = CHUNK_BITMAP;
+            result.words.resize(bitmapWords);
+            result.cardinality = andWords(a.words.data(), b.words.data(), result.words.data());
+        } else if (a.type == CHUNK_BITMAP || b.type == CHUNK_BITMAP) {
+            const Chunk& bitmap = a.type == CHUNK_BITMAP ? a : b;
+            const Chunk& array = a.type == CHUNK_BITMAP ? b : a;
+            for (std::uint16_t v : array.values) {
+                if (bitmap.contains(v)) {
+                    result.values.push_back(v);
+                }
+            }
+            result.cardinality = static_cast<std::uint32_t>(result.values.size());
+        } else {
+            std::set_intersection(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+                                  std::back_inserter(result.values));
+            result.cardinality = static_cast<std::uint32_t>(result.values.size());
+        }
+        result.normalize();
+        return result;
+    }
+
+public:
+    SetBackend getBackend() const override {
+        return SET_BITMAP;
+    }
+
+    void addElement(T element) override {
+        std::uint64_t key = toKey(element);
+        auto it = findChunk(key >> 16);
+        if (it == chunks.end() || it->high != key >> 16) {
+            it = chunks.insert(it, Chunk());
+            it->high = key >> 16;
+        }
+        size += it->add(static_cast<std::uint16_t>(key));
+    }
+
+    void removeElement(T element) override {
+        std::uint64_t key = toKey(element);
+        auto it = findChunk(key >> 16);
+        if (it == chunks.end() || it->high != key >> 16) {
+            return;
+        }
+        size -= it->remove(static_cast<std::uint16_t>(key));
+        if (it->cardinality == 0) {
+            chunks.erase(it);
+        }
+    }
+
+    bool containsElement(T element) const override {
+        std::uint64_t key = toKey(element);
+        auto it = findChunk(key >> 16);
+        return it != chunks.end() && it->high == key >> 16 && it->contains(static_cast<std::uint16_t>(key));
+    }
+
+    int getSize() const override {
+        return size;
+    }
+
+    std::vector<T> getAsVector() override {
+        std::vector<T> result;
+        result.reserve(size);
+        for (const Chunk& chunk : chunks) {
+            std::uint64_t base = chunk.high << 16;
+            chunk.forEach([&](std::uint16_t low) {result.push_back(fromKey(base | low));});
+        }
+        return result;
+    }
+
+    // Данные сортируются и раскладываются по кускам за один проход
+    void fillFromVector(std::vector<T>& dataVector) override {
+        std::vector<std::uint64_t> keys(dataVector.size());
+        for (size_t i = 0; i < dataVector.size(); ++i) {
+            keys[i] = toKey(dataVector[i]);
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        chunks.clear();
+        for (size_t i = 0; i < keys.size();) {
+            Chunk chunk;
+            chunk.high = keys[i] >> 16;
+            for (; i < keys.size() && keys[i] >> 16 == chunk.high; ++i) {
+                chunk.values.push_back(static_cast<std::uint16_t>(keys[i]));
+            }
+            chunk.cardinality = static_cast<std::uint32_t>(chunk.values.size());
+            chunk.normalize();
+            chunks.push_back(std::move(chunk));
+        }
+        size = static_cast<int>(keys.size());
+        optimize();
+    }
+
+    std::vector<T> takeAsVector() override {
+        std::vector<T> result = getAsVector();
+        chunks.clear();
+        size = 0;
+        return result;
+    }
+
+    void optimize() {
+        for (Chunk& chunk : chunks) {
+            chunk.optimize();
+        }
+    }
+
+    std::unique_ptr<SetCursor<T>> cursor() const override {
+        return std::make_unique<Cursor>(chunks);
+    }
+
+    bool isOrdered() const override {
+        return true;
+    }
+
+    SetImplementation<T>* createEmpty() const override {
+        return new BitmapSet<T>;
+    }
+
+    SetImplementation<T>* clone() const override {
+        return new BitmapSet<T>(*this);
+    }
+
+    void addElements(std::span<const T> batch) override {
+        updateBatch<true>(batch);
+    }
+
+    void removeElements(std::span<const T> batch) override {
+        updateBatch<false>(batch);
+    }
+
+    std::vector<bool> containsMany(std::span<const T> queries) const override {
+        std::vector<bool> result(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            result[i] = BitmapSet<T>::containsElement(queries[i]);
+        }
+        return result;
+    }
+
+    // Возрастающие элементы дописываются в конец последнего куска
+    void appendNew(T element) override {
+        std::uint64_t key = toKey(element);
+        std::uint16_t low = static_cast<std::uint16_t>(key);
+        if (chunks.empty() || chunks.back().high < key >> 16) {
+            chunks.emplace_back();
+            chunks.back().high = key >> 16;
+        }
+        Chunk& last = chunks.back();
+        if (last.high == key >> 16 && last.type == CHUNK_ARRAY && (last.values.empty() || last.values.back() < low)) {
+            last.values.push_back(low);
+            ++last.cardinality;
+            last.normalize();
+            ++size;
+        } else {
+            addElement(element);
+        }
+    }
+
+    size_t memoryUsage() const override {
+        size_t bytes = chunks.capacity() * sizeof(Chunk);
+        for (const Chunk& chunk : chunks) {
+            bytes += chunk.memoryUsage() - sizeof(Chunk);
+        }
+        return bytes;
+    }
+
+    // С другим BitmapSet куски сливаются по старшей части ключа, совпавшие
+    // битовые карты объединяются пословно
+    SetImplementation<T>* unionSet(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_BITMAP) {
+            return SetImplementation<T>::unionSet(other);
+        }
+        BitmapSet<T>* result = new BitmapSet<T>;
+        const std::vector<Chunk>& otherChunks = static_cast<BitmapSet<T>*>(other)->chunks;
+        size_t i = 0, j = 0;
+        while (i < chunks.size() || j < otherChunks.size()) {
+            if (j == otherChunks.size() || (i < chunks.size() && chunks[i].high < otherChunks[j].high)) {
+                result->chunks.push_back(chunks[i++]);
+            } else if (i == chunks.size() || otherChunks[j].high < chunks[i].high) {
+                result->chunks.push_back(otherChunks[j++]);
+            } else {
+                result->chunks.push_back(unionChunks(chunks[i++], otherChunks[j++]));
+            }
+            result->size += result->chunks.back().cardinality;
+        }
+        return result;
+    }
+
+    SetImplementation<T>* intersect(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_BITMAP) {
+            return SetImplementation<T>::intersect(other);
+        }
+        BitmapSet<T>* result = new BitmapSet<T>;
+        const std::vector<Chunk>& otherChunks = static_cast<BitmapSet<T>*>(other)->chunks;
+        size_t i = 0, j = 0;
+        while (i < chunks.size() && j < otherChunks.size()) {
+            if (chunks[i].high < otherChunks[j].high) {
+                ++i;
+            } else if (otherChunks[j].high < chunks[i].high) {
+                ++j;
+            } else {
+                Chunk chunk = intersectChunks(chunks[i++], otherChunks[j++]);
+                if (chunk.cardinality != 0) {
+                    result->size += chunk.cardinality;
+                    result->chunks.push_back(std::move(chunk));
+                }
+            }
+        }
+        return result;
+    }
+
+    SetImplementation<T>* difference(SetImplementation<T>* other) override {
+        if (other->getBackend() != SET_BITMAP) {
+            return SetImplementation<T>::difference(other);
+        }
+        const std::vector<Chunk>& otherChunks = static_cast<BitmapSet<T>*>(other)->chunks;
+        BitmapSet<T>* result = new BitmapSet<T>;
+        size_t j = 0;
+        for (const Chunk& chunk : chunks) {
+            while (j < otherChunks.size() && otherChunks[j].high < chunk.high) {
+                ++j;
+            }
+            Chunk remaining = j < otherChunks.size() && otherChunks[j].high == chunk.high
+                ? differenceChunks(chunk, otherChunks[j]) : chunk;
+            if (remaining.cardinality != 0) {
+                result->size += remaining.cardinality;
+                result->chunks.push_back(std::move(remaining));
+            }
+        }
+        return result;
+    }
+};
+
+// Персистентное декартово дерево. Узлы неизменяемы и разделяются между версиями
+// через shared_ptr: изменение копирует только путь от корня (O(log n) новых узлов),
+// а копия множества - это копия указателя на корень за O(1). Копию можно читать
+// из другого потока, пока исходное множество меняется: общие узлы никто не
+// меняет, а счётчики ссылок атомарны
+template <typename T>
+class PersistentTreapSet final : public SetImplementation<T> {
+private:
+    struct Node;
+    using Link = std::shared_ptr<const Node>;
+
+    struct Node {
+        T key;
+        std::uint64_t priority;
+        Link left;
+        Link right;
+    };
+
+    Link root;
+    int size = 0;
+    // Ключи серии appendNew, дерево из них строится в finishAppend
+    std::vector<T> pending;
+
+    // Приоритет - перемешанный хеш ключа: форма дерева зависит только от
+    // содержимого, и версиям не нужен общий генератор случайных чисел
+    static std::uint64_t priorityOf(const T& key) {
+        std::uint64_t x = std::hash<T>{}(key) + 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static Link makeNode(const T& key, std::uint64_t priority, Link left, Link right) {
+        return std::make_shared<const Node>(Node{key, priority, std::move(left), std::move(right)});
+    }
+
+    // Ключи меньше и больше key. Копируется только путь поиска, равный узел выпадает
+    static std::pair<Link, Link> split(const Link& node, const T& key) {
+        if (!node) {
+            return {};
+        }
+        if (node->key < key) {
+            auto [less, greater] = split(node->right, key);
+            return {makeNode(node->key, node->priority, node->left, std::move(less)), std::move(greater)};
+        }
+        if (key < node->key) {
+            auto [less, greater] = split(node->left, key);
+            return {std::move(less), makeNode(node->key, node->priority, std::move(greater), node->right)};
+        }
+        return {node->left, node->right};
+    }
+
+    // Все ключи less меньше ключей greater. Копируются правая ветвь less
+    // и левая ветвь greater до места стыка
+    static Link join(const Link& less, const Link& greater) {
+        if (!less) {
+            return greater;
+        }
+        if (!greater) {
+            return less;
+        }
+        if (less->priority > greater->priority) {
+            return makeNode(less->key, less->priority, less->left, join(less->right, greater));
+        }
+        return makeNode(greater->key, greater->priority, join(less, greater->left), greater->right);
+    }
+
+    // Вставка ключа, которого нет в дереве
+    static Link insert(const Link& node, const T& key, std::uint64_t priority) {
+        if (!node || priority > node->priority) {
+            auto [less, greater] = split(node, key);
+            return makeNode(key, priority, std::move(less), std::move(greater));
+        }
+        if (key < node->key) {
+            return makeNode(node->key, node->priority, insert(node->left, key, priority), node->right);
+        }
+        return makeNode(node->key, node->priority, node->left, insert(node->right, key, priority));
+    }
+
+    // Удаление ключа, который есть в дереве
+    static Link erase(const Link& node, const T& key) {
+        if (key < node->key) {
+            return makeNode(node->key, node->priority, erase(node->left, key), node->right);
+        }
+        if (node->key < key) {
+            return makeNode(node->key, node->priority, node->left, erase(node->right, key));
+        }
+        return join(node->left, node->right);
+    }
+
+    // Дерево из возрастающих различных ключей за O(n). Пока дерево не
+    // опубликовано, его узлы можно менять, правая ветвь хранится в стеке
+    static Link buildSorted(const std::vector<T>& sorted) {
+        std::vector<std::shared_ptr<Node>> spine;
+        for (const T& key : sorted) {
+            auto node = std::make_shared<Node>(Node{key, priorityOf(key), nullptr, nullptr});
+            std::shared_ptr<Node> last;
+            while (!spine.empty() && spine.back()->priority < node->priority) {
+                last = std::move(spine.back());
+                spine.pop_back();
+            }
+            node->left = std::move(last);
+            if (!spine.empty()) {
+                spine.back()->right = node;
+            }
+            spine.push_back(std::move(node));
+        }
+        return spine.empty() ? nullptr : Link(spine.front());
+    }
+
+    // Обход по возрастанию. Курсор держит корень своей версии, так что она
+    // доступна до конца обхода, даже если множество тем временем изменилось
+    class Cursor : public SetCursor<T> {
+    private:
+        Link version;
+        std::vector<const Node*> path;
+
+        void descendLeft(const Node* node) {
+            for (; node != nullptr; node = node->left.get()) {
+                path.push_back(node);
+            }
+        }
+
+    public:
+        explicit Cursor(Link version) : version(std::move(version)) {
+            descendLeft(this->version.get());
+        }
+
+        size_t read(T* buffer, size_t capacity) override {
+            size_t count = 0;
+            while (count < capacity && !path.empty()) {
+                const Node* node = path.back();
+                path.pop_back();
+                buffer[count++] = node->key;
+                descendLeft(node->right.get());
+            }
+            return count;
+        }
+    };
+
+    static void collectNodes(const Node* node, std::unordered_set<const Node*>& seen) {
+        while (node != nullptr && seen.insert(node).second) {
+            collectNodes(node->left.get(), seen);
+            node = node->right.get();
+        }
+    }
+
+public:
+    // Узел вместе со счётчиками make_shared (указатель на таблицу и два счётчика)
+    static constexpr size_t nodeBytes = sizeof(Node) + 16;
+
+    PersistentTreapSet() = default;
+    PersistentTreapSet(const PersistentTreapSet&) = default;
+    PersistentTreapSet(PersistentTreapSet&&) = default;
+    PersistentTreapSet& operator=(const PersistentTreapSet&) = default;
+
+    // Версия, которая не меняется при дальнейших изменениях этого множества
+    PersistentTreapSet snapshot() const {
+        return *this;
+    }
+
+    // Память под узлы нескольких версий: общие узлы считаются один раз
+    static size_t sharedMemoryUsage(std::span<const PersistentTreapSet* const> versions) {
+        std::unordered_set<const Node*> seen;
+        for (const PersistentTreapSet* version : versions) {
+            collectNodes(version->root.get(), seen);
+        }
+        return seen.size() * nodeBytes;
+    }
+
+    SetBackend getBackend() const override {
+        return SET_PERSISTENT_TREAP;
+    }
+
+    void addElement(T element) override {
+        if (!containsElement(element)) {
+            root = insert(root, element, priorityOf(element));
+            size++;
+        }
+    }
+
+    void removeElement(T element) override {
+        if (containsElement(element)) {
+            root = erase(root, element);
+            size--;
+        }
+    }
+
+    bool containsElement(T element) const override {
+        const Node* node = root.get();
+        while (node != nullptr) {
+            if (element < node->key) {
+                node = node->left.get();
+            } else if (node->key < element) {
+                node = node->right.get();
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int getSize() const override {
+        return size;
+    }
+
+    std::vector<T> getAsVector() override {
+        std::vector<T> result(size);
+        Cursor(root).read(result.data(), result.size());
+        return result;
+    }
+
+    // В пустое дерево данные собираются за O(n), иначе добавляются по одному
+    void fillFromVector(std::vector<T>& dataVector) override {
+        if (root) {
+            for (const T& element : dataVector) {
+                addElement(element);
+            }
+            return;
+        }
+        if (!std::is_sorted(dataVector.begin(), dataVector.end())) {
+            std::sort(dataVector.begin(), dataVector.end());
+        }
+        dataVector.erase(std::unique(dataVector.begin(), dataVector.end()), dataVector.end());
+        root = buildSorted(dataVector);
+        size = static_cast<int>(dataVector.size());
+    }
+
+    std::vector<T> takeAsVector() override {
+        std::vector<T> result = getAsVector();
+        root.reset();
+        size = 0;
+        return result;
+    }
+
+    // Узлы, общие с другими версиями, тоже входят в сумму
+    size_t memoryUsage() const override {
+        return size * nodeBytes;
+    }
+
+    std::unique_ptr<SetCursor<T>> cursor() const override {
+        return std::make_unique<Cursor>(root);
+    }
+
+    bool isOrdered() const override {
+        return true;
+    }
+
+    SetImplementation<T>* createEmpty() const override {
+        return new PersistentTreapSet<T>;
+    }
+
+    // Копия разделяет все узлы, поэтому стоит O(1)
+    SetImplementation<T>* clone() const override {
+        return new PersistentTreapSet<T>(*this);
+    }
+
+    void appendNew(T element) override {
+        pending.push_back(element);
+    }
+
+    void finishAppend() override {
+        if (!root) {
+            size += static_cast<int>(pending.size());
+            root = buildSorted(pending);
+        } else {
+            for (const T& element : pending) {
+                root = insert(root, element, priorityOf(element));
+                size++;
+            }
+        }
+        pending.clear();
+        pending.shrink_to_fit();
+    }
+};
+
+// Счётчики операций над множеством. При каждом пересмотре реализации они
+// уменьшаются вдвое, так что недавние операции весят больше старых
+struct SetOperationMix {
+    double inserts = 0;
+    double removes = 0;
+    double lookups = 0;
+    double scans = 0;
+
+    double total() const {
+        return inserts + removes + lookups + scans;
+    }
+    void decay(double factor) {
+        inserts *= factor;
+        removes *= factor;
+        lookups *= factor;
+        scans *= factor;
+    }
+};
+
+// Постоянные модели стоимости в наносекундах. Значения по умолчанию - оценки,
+// профиль настройки (SetTuning) заменяет их измеренными на этой машине.
+// arrayPerElement = 0 означает "вывести из crossoverSize"
+struct SetCostConstants {
+    int crossoverSize = 32;
+    double arrayPerElement = 0;
+    double arrayScanPerElement = 0.5;
+    double arrayMovePerElement = 0.1;
+    double sortedPerLevel = 2;
+    double hashLookup = 15;
+    double hashInsert = 10;
+    double hashScanPerElement = 1.5;
+    double bitmapLookup = 12;
+    double bitmapInsert = 25;
+    double bitmapScanPerElement = 1;
+    double treapPerLevel = 8;
+    double treapAllocation = 30;
+    double treapScanPerElement = 4;
+};
+
+// Профили настройки по типам элементов. Профиль пишет runSetTuning, а программа
+// загружает его при старте; без профиля действуют значения по умолчанию.
+// Формат текстовый: строка "[тип]", затем строки "имя значение"
+class SetTuning {
+public:
+    // Имя типа в профиле: int32, uint64, float64 и т.п.
+    template <typename T>
+    static std::string typeName() {
+        std::string kind = std::is_floating_point_v<T> ? "float" :
+                           std::is_integral_v<T> ? (std::is_signed_v<T> ? "int" : "uint") : "key";
+        return kind + std::to_string(sizeof(T) * 8);
+    }
+
+    template <typename T>
+    static SetCostConstants constantsFor() {
+        auto it = profiles.find(typeName<T>());
+        return it != profiles.end() ? it->second : SetCostConstants();
+    }
+
+    static void setConstants(const std::string& type, const SetCostConstants& constants) {
+        profiles[type] = constants;
+    }
+
+    static void save(std::ostream& out) {
+        for (const auto& [type, constants] : profiles) {
+            out << "[" << type << "]\n";
+            out << "crossoverSize " << constants.crossoverSize << "\n";
+            for (const auto& [name, field] : fields) {
+                out << name << " " << constants.*field << "\n";
+            }
+        }
+    }
+
+    // Неизвестные имена пропускаются, так что старый профиль читается новой программой
+    static void load(std::istream& in) {
+        std::string line;
+        SetCostConstants* current = nullptr;
+        while (std::getline(in, line)) {
+            if (line.size() > 2 && line.front() == '[' && line.back() == ']') {
+                current = &profiles[line.substr(1, line.size() - 2)];
+                continue;
+            }
+            std::istringstream words(line);
+            std::string name;
+            double value;
+            if (current == nullptr || !(words >> name >> value)) {
+                continue;
+            }
+            if (name == "crossoverSize") {
+                current->crossoverSize = static_cast<int>(value);
+            }
+            for (const auto& [fieldName, field] : fields) {
+                if (name == fieldName) {
+                    current->*field = value;
+                }
+            }
+        }
+    }
+
+    // Постоянные, подобранные по разностям замеров, могут выйти нулевыми или
+    // неправдоподобными из-за шума. Значение, отличающееся от оценки по умолчанию
+    // больше чем в fitTolerance раз, заменяется этой оценкой. У arrayPerElement
+    // оценки нет (0 - вывести из порога), ему достаточно быть положительным
+    static SetCostConstants plausible(const SetCostConstants& fitted) {
+        const SetCostConstants defaults;
+        SetCostConstants result = fitted;
+        for (const auto& [name, field] : fields) {
+            double value = fitted.*field;
+            double reference = defaults.*field;
+            bool accepted = std::isfinite(value) && value > 0 &&
+                            (reference == 0 || (value > reference / fitTolerance && value < reference * fitTolerance));
+            if (!accepted) {
+                std::cout << "  " << name << " " << value << " rejected, default " << reference << " kept\n";
+                result.*field = reference;
+            }
+        }
+        return result;
+    }
+
+    static bool loadFile(const char* path) {
+        std::ifstream file(path);
+        if (!file) {
+            return false;
+        }
+        load(file);
+        return true;
+    }
+
+private:
+    static constexpr double fitTolerance = 20;
+
+    static inline std::map<std::string, SetCostConstants> profiles;
+
+    static constexpr std::pair<const char*, double SetCostConstants::*> fields[] = {
+        {"arrayPerElement", &SetCostConstants::arrayPerElement},
+        {"arrayScanPerElement", &SetCostConstants::arrayScanPerElement},
+        {"arrayMovePerElement", &SetCostConstants::arrayMovePerElement},
+        {"sortedPerLevel", &SetCostConstants::sortedPerLevel},
+        {"hashLookup", &SetCostConstants::hashLookup},
+        {"hashInsert", &SetCostConstants::hashInsert},
+        {"hashScanPerElement", &SetCostConstants::hashScanPerElement},
+        {"bitmapLookup", &SetCostConstants::bitmapLookup},
+        {"bitmapInsert", &SetCostConstants::bitmapInsert},
+        {"bitmapScanPerElement", &SetCostConstants::bitmapScanPerElement},
+        {"treapPerLevel", &SetCostConstants::treapPerLevel},
+        {"treapAllocation", &SetCostConstants::treapAllocation},
+        {"treapScanPerElement", &SetCostConstants::treapScanPerElement},
+    };
+};
+
+// Модель стоимости операций. Если стоимость просмотра элемента массива не задана,
+// она подбирается так, чтобы при одних только поисках массив и дерево
+// сравнивались ровно на размере crossoverSize
+class SetCostModel {
+public:
+    explicit SetCostModel(const SetCostConstants& measured) : constants(measured) {
+        if (constants.arrayPerElement <= 0) {
+            double size = std::max(constants.crossoverSize, 2);
+            constants.arrayPerElement = 2.0 * constants.treapPerLevel * std::log2(size + 1) / size;
+        }
+    }
+    // Явно заданный порог важнее измеренной стоимости просмотра массива
+    SetCostModel(int crossoverSize, SetCostConstants constants) : SetCostModel(withCrossover(constants, crossoverSize)) {}
+
+    // Средняя стоимость одной операции при данной смеси операций
+    double operationCost(SetBackend backend, const SetOperationMix& mix, double size) const {
+        if (mix.total() == 0) {
+            return 0;
+        }
+        double insert, remove, lookup, scan;
+        if (backend == SET_ARRAY) {
+            lookup = constants.arrayPerElement * size / 2;
+            insert = constants.arrayPerElement * size;
+            remove = constants.arrayPerElement * size;
+            scan = constants.arrayScanPerElement * size;
+        } else if (backend == SET_BITMAP) {
+            lookup = constants.bitmapLookup;
+            insert = constants.bitmapInsert;
+            remove = constants.bitmapInsert;
+            scan = constants.bitmapScanPerElement * size;
+        } else if (backend == SET_HASH) {
+            lookup = constants.hashLookup;
+            insert = constants.hashLookup + constants.hashInsert;
+            remove = constants.hashLookup + constants.hashInsert;
+            scan = constants.hashScanPerElement * size;
+        } else if (backend == SET_SORTED_ARRAY) {
+            lookup = constants.sortedPerLevel * std::log2(size + 1);
+            insert = lookup + constants.arrayMovePerElement * size / 2;
+            remove = insert;
+            scan = constants.arrayScanPerElement * size;
+        } else {
+            double depth = std::log2(size + 1);
+            lookup = constants.treapPerLevel * depth;
+            insert = 2 * constants.treapPerLevel * depth + constants.treapAllocation;
+            remove = 2 * constants.treapPerLevel * depth + constants.treapAllocation;
+            scan = constants.treapScanPerElement * size;
+        }
+        return (mix.inserts * insert + mix.removes * remove + mix.lookups * lookup + mix.scans * scan) / mix.total();
+    }
+
+    // Перенос: просмотр исходной реализации и построение новой из полученного вектора
+    double conversionCost(SetBackend source, SetBackend target, double size) const {
+        double build;
+        if (target == SET_ARRAY) {
+            build = constants.treapAllocation;
+        } else if (target == SET_HASH) {
+            build = constants.hashInsert;
+        } else if (target == SET_BITMAP) {
+            build = constants.sortedPerLevel * std::log2(size + 1);
+        } else if (target == SET_SORTED_ARRAY) {
+            build = constants.treapAllocation + constants.sortedPerLevel * std::log2(size + 1);
+        } else {
+            build = constants.treapPerLevel * std::log2(size + 1) + constants.treapAllocation;
+        }
+        return (scanCost(source) + build) * size;
+    }
+
+    // Стоимость просмотра одного элемента при выгрузке реализации в вектор
+    double scanCost(SetBackend backend) const {
+        if (backend == SET_ARRAY || backend == SET_SORTED_ARRAY) {
+            return constants.arrayScanPerElement;
+        }
+        if (backend == SET_HASH) {
+            return constants.hashScanPerElement;
+        }
+        if (backend == SET_BITMAP) {
+            return constants.bitmapScanPerElement;
+        }
+        return constants.treapScanPerElement;
+    }
+
+private:
+    SetCostConstants constants;
+
+    static SetCostConstants withCrossover(SetCostConstants constants, int crossoverSize) {
+        constants.crossoverSize = crossoverSize;
+        constants.arrayPerElement = 0;
+        return constants;
+    }
+};
+
+// Выбор реализации по смеси операций, общий для Set и StaticSet
+template <typename T>
+class SetBackendAdvisor {
+public:
+    // Явный порог с оценками стоимости по умолчанию: загруженный профиль
+    // не меняет поведения множеств, созданных с заданным порогом
+    explicit SetBackendAdvisor(int crossoverSize) : costModel(crossoverSize, SetCostConstants{}) {}
+    // Порог и стоимости берутся из загруженного профиля
+    SetBackendAdvisor() : costModel(SetTuning::constantsFor<T>()) {}
+
+    SetOperationMix mix;
+
+    // Поиск только учитывается: пересмотр выполнят изменяющие операции
+    void countLookups(int operations) {
+        mix.lookups += operations;
+        operationsSinceReview += operations;
+    }
+
+    // Пересмотр раз в max(8, size/2) операций, так что в среднем он стоит O(1)
+    bool countOperations(int operations, double size) {
+        operationsSinceReview += operations;
+        return operationsSinceReview >= std::max(8.0, size / 2);
+    }
+
+    // Реализация меняется, только если по модели она дешевле на hysteresisBand
+    // и выигрыш за ближайшие операции окупает перенос данных с тем же запасом.
+    // Из прошедших этот порог берётся наибольший чистый выигрыш (за вычетом
+    // переноса). Возвращает current, если менять не стоит
+    SetBackend choose(SetBackend current, double size) {
+        double lookahead = std::max<double>(operationsSinceReview, size);
+        operationsSinceReview = 0;
+        // Персистентное дерево выбирается только явно: его выигрыш - дешёвые
+        // копии, а копий модель не учитывает. Поэтому оно не выбирается
+        // и не заменяется другой реализацией
+        if (current == SET_PERSISTENT_TREAP) {
+            mix.decay(0.5);
+            return current;
+        }
+        SetBackend result = current;
+        double bestNetSaving = 0;
+        double currentCost = costModel.operationCost(current, mix, size);
+        for (SetBackend candidate : {SET_ARRAY, SET_TREAP, SET_SORTED_ARRAY, SET_HASH, SET_BITMAP}) {
+            if (candidate == current || (candidate == SET_BITMAP && !std::is_integral_v<T>)) {
+                continue;
+            }
+            double candidateCost = costModel.operationCost(candidate, mix, size);
+            double saving = (currentCost - candidateCost) * lookahead;
+            double conversionCost = costModel.conversionCost(current, candidate, size);
+            if (candidateCost < currentCost * (1 - hysteresisBand) &&
+                saving > conversionCost * (1 + hysteresisBand) &&
+                saving - conversionCost > bestNetSaving) {
+                result = candidate;
+                bestNetSaving = saving - conversionCost;
+            }
+        }
+        mix.decay(0.5);
+        return result;
+    }
+
+private:
+    SetCostModel costModel;
+    int operationsSinceReview = 0;
+
+    // Доля выигрыша, без которой реализация не меняется: при размере около порога
+    // стоимости почти равны, и множество не перестраивается туда-обратно
+    static constexpr double hysteresisBand = 0.25;
+};
+
+// Абстракция
+template <typename T>
+class Set {
+protected:
+    // Реализация меняется только в изменяющих операциях. Поиск лишь учитывается
+    // в смеси операций, но и это запись, поэтому одновременный поиск из
+    // нескольких потоков без внешней синхронизации не допускается
+    std::unique_ptr<SetImplementation<T>> implementation;
+    const int sizeToChangeImplementation;
+    mutable SetBackendAdvisor<T> advisor;
+    int conversions = 0;
+
+public:
+    static std::unique_ptr<SetImplementation<T>> createImplementation(SetBackend backend) {
+        if (backend == SET_ARRAY) {
+            return std::make_unique<ArraySet<T>>();
+        }
+        if (backend == SET_SORTED_ARRAY) {
+            return std::make_unique<SortedArraySet<T>>();
+        }
+        if (backend == SET_HASH) {
+            return std::make_unique<HashSet<T>>();
+        }
+        if (backend == SET_PERSISTENT_TREAP) {
+            return std::make_unique<PersistentTreapSet<T>>();
+        }
+        if constexpr (std::is_integral_v<T>) {
+            if (backend == SET_BITMAP) {
+                return std::make_unique<BitmapSet<T>>();
+            }
+        }
+        return std::make_unique<TreapSet<T>>();
+    }
+
+protected:
+    // Данные забираются из старой реализации и один раз переносятся в новую
+    void changeImplementation(SetBackend backend) {
+        std::unique_ptr<SetImplementation<T>> newImplementation = createImplementation(backend);
+        std::vector<T> data = implementation->takeAsVector();
+        newImplementation->fillFromVector(data);
+        implementation = std::move(newImplementation);
+        conversions++;
+    }
+
+    void reviewImplementation(int operations = 1) {
+        double size = implementation->getSize();
+        if (advisor.countOperations(operations, size)) {
+            SetBackend current = implementation->getBackend();
+            SetBackend next = advisor.choose(current, size);
+            if (next != current) {
+                changeImplementation(next);
+            }
+        }
+    }
+
+public:
+    // Set становится владельцем переданной реализации
+    Set(SetImplementation<T>* impl, int sizeToChangeImplementation) : implementation(impl), sizeToChangeImplementation(sizeToChangeImplementation), advisor(sizeToChangeImplementation) {}
+    Set(std::unique_ptr<SetImplementation<T>> impl, int sizeToChangeImplementation) : implementation(std::move(impl)), sizeToChangeImplementation(sizeToChangeImplementation), advisor(sizeToChangeImplementation) {}
+    // Порог и модель стоимости из профиля настройки для типа T
+    explicit Set(SetImplementation<T>* impl) : implementation(impl), sizeToChangeImplementation(SetTuning::constantsFor<T>().crossoverSize), advisor() {}
+    virtual ~Set() {}
+    Set(Set&&) = default;
+
+    virtual void addElement(T element) {
+        implementation->addElement(element);
+        advisor.mix.inserts++;
+        reviewImplementation();
+    }
+    virtual void removeElement(T element) {
+        implementation->removeElement(element);
+        advisor.mix.removes++;
+        reviewImplementation();
+    }
+    virtual bool containsElement(T element) const {
+        advisor.countLookups(1);
+        return implementation->containsElement(element);
+    }
+
+    // Пакет - один вызов реализации и одна проверка смены реализации. Реализация
+    // сама переходит на поэлементные операции, если пакет мал для её алгоритма
+    void addElements(std::span<const T> batch) {
+        implementation->addElements(batch);
+        advisor.mix.inserts += batch.size();
+        reviewImplementation(static_cast<int>(batch.size()));
+    }
+    void removeElements(std::span<const T> batch) {
+        implementation->removeElements(batch);
+        advisor.mix.removes += batch.size();
+        reviewImplementation(static_cast<int>(batch.size()));
+    }
+    std::vector<bool> containsMany(std::span<const T> queries) const {
+        advisor.countLookups(static_cast<int>(queries.size()));
+        return implementation->containsMany(queries);
+    }
+
+    SetBackend getBackend() const {
+        return implementation->getBackend();
+    }
+    int getSize() const {
+        return implementation->getSize();
+    }
+    int getConversionsCount() const {
+        return conversions;
+    }
+
+    Set unionSet(Set<T>* other)
+    {
+        advisor.mix.scans++;
+        return Set<T>(implementation->unionSet(other->implementation.get()), sizeToChangeImplementation);
+    }
+
+    Set intersectSet(Set* other)
+    {
+        advisor.mix.scans++;
+        return Set<T>(implementation->intersect(other->implementation.get()), sizeToChangeImplementation);
+    }
+
+    Set differenceSet(Set* other)
+    {
+        advisor.mix.scans++;
+        return Set<T>(implementation->difference(other->implementation.get()), sizeToChangeImplementation);
+    }
+};
+
+// Мост со статической диспетчеризацией: реализации хранятся в std::variant,
+// операция выбирается std::visit по индексу варианта, а методы final-классов
+// внутри вызываются невиртуально и встраиваются. Порядок альтернатив совпадает
+// с SetBackend, поэтому индекс варианта и есть вид реализации
+template <typename T>
+class StaticSet {
+public:
+    using Backends = std::conditional_t<std::is_integral_v<T>,
+        std::variant<ArraySet<T>, TreapSet<T>, SortedArraySet<T>, HashSet<T>, BitmapSet<T>>,
+        std::variant<ArraySet<T>, TreapSet<T>, SortedArraySet<T>, HashSet<T>>>;
+
+private:
+    // Как и в Set, реализация меняется только в изменяющих операциях,
+    // а поиск пишет в статистику и не допускает одновременных читателей
+    Backends implementation;
+    const int sizeToChangeImplementation;
+    mutable SetBackendAdvisor<T> advisor;
+    int conversions = 0;
+
+    // Альтернатива выбирается по значению SetBackend во время выполнения. Если
+    // передан source, содержимое переносится из него, иначе реализация пустая
+    template <size_t Index = 0>
+    static void emplaceBackend(Backends& backends, SetBackend backend, SetImplementation<T>* source) {
+        if constexpr (Index < std::variant_size_v<Backends>) {
+            if (static_cast<size_t>(backend) != Index) {
+                emplaceBackend<Index + 1>(backends, backend, source);
+                return;
+            }
+            using Implementation = std::variant_alternative_t<Index, Backends>;
+            if (source != nullptr) {
+                backends.template emplace<Index>(std::move(static_cast<Implementation&>(*source)));
+            } else {
+                backends.template emplace<Index>();
+            }
+        } else {
+            throw std::invalid_argument("StaticSet has no such backend");
+        }
+    }
+
+    // Операции над множествами возвращают новую реализацию через указатель
+    StaticSet(SetImplementation<T>* result, int sizeToChangeImplementation) : sizeToChangeImplementation(sizeToChangeImplementation), advisor(sizeToChangeImplementation) {
+        std::unique_ptr<SetImplementation<T>> owner(result);
+        emplaceBackend(implementation, result->getBackend(), result);
+    }
+
+    void changeImplementation(SetBackend backend) {
+        std::vector<T> data = std::visit([](auto& current) {return current.takeAsVector();}, implementation);
+        emplaceBackend(implementation, backend, nullptr);
+        std::visit([&data](auto& next) {next.fillFromVector(data);}, implementation);
+        conversions++;
+    }
+
+    void reviewImplementation(int operations = 1) {
+        double size = getSize();
+        if (advisor.countOperations(operations, size)) {
+            SetBackend current = getBackend();
+            SetBackend next = advisor.choose(current, size);
+            if (next != current) {
+                changeImplementation(next);
+            }
+        }
+    }
+
+public:
+    StaticSet(SetBackend backend, int sizeToChangeImplementation) : sizeToChangeImplementation(sizeToChangeImplementation), advisor(sizeToChangeImplementation) {
+        emplaceBackend(implementation, backend, nullptr);
+    }
+    explicit StaticSet(SetBackend backend) : sizeToChangeImplementation(SetTuning::constantsFor<T>().crossoverSize), advisor() {
+        emplaceBackend(implementation, backend, nullptr);
+    }
+    StaticSet(StaticSet&&) = default;
+
+    void addElement(T element) {
+        std::visit([element](auto& set) {set.addElement(element);}, implementation);
+        advisor.mix.inserts++;
+        reviewImplementation();
+    }
+    void removeElement(T element) {
+        std::visit([element](auto& set) {set.removeElement(element);}, implementation);
+        advisor.mix.removes++;
+        reviewImplementation();
+    }
+    bool containsElement(T element) const {
+        advisor.countLookups(1);
+        return std::visit([element](const auto& set) {return set.containsElement(element);}, implementation);
+    }
+
+    void addElements(std::span<const T> batch) {
+        std::visit([batch](auto& set) {set.addElements(batch);}, implementation);
+        advisor.mix.inserts += batch.size();
+        reviewImplementation(static_cast<int>(batch.size()));
+    }
+    void removeElements(std::span<const T> batch) {
+        std::visit([batch](auto& set) {set.removeElements(batch);}, implementation);
+        advisor.mix.removes += batch.size();
+        reviewImplementation(static_cast<int>(batch.size()));
+    }
+    std::vector<bool> containsMany(std::span<const T> queries) const {
+        advisor.countLookups(static_cast<int>(queries.size()));
+        return std::visit([queries](const auto& set) {return set.containsMany(queries);}, implementation);
+    }
+
+    SetBackend getBackend() const {
+        return static_cast<SetBackend>(implementation.index());
+    }
+    int getSize() const {
+        return std::visit([](const auto& set) {return set.getSize();}, implementation);
+    }
+    int getConversionsCount() const {
+        return conversions;
+    }
+
+    StaticSet unionSet(StaticSet* other)
+    {
+        advisor.mix.scans++;
+        return StaticSet(std::visit([](auto& first, auto& second) {return first.unionSet(&second);},
+                                    implementation, other->implementation), sizeToChangeImplementation);
+    }
+
+    StaticSet intersectSet(StaticSet* other)
+    {
+        advisor.mix.scans++;
+        return StaticSet(std::visit([](auto& first, auto& second) {return first.intersect(&second);},
+                                    implementation, other->implementation), sizeToChangeImplementation);
+    }
+
+    StaticSet differenceSet(StaticSet* other)
+    {
+        advisor.mix.scans++;
+        return StaticSet(std::visit([](auto& first, auto& second) {return first.difference(&second);},
+                                    implementation, other->implementation), sizeToChangeImplementation);
+    }
+};
+
+// Прежнее правило смены реализации: ровно на пороге размера, без учёта операций.
+// Оставлено для сравнения в benchmarkThresholdOscillation
+template <typename T>
+class ExactThresholdSet : public Set<T> {
+public:
+    using Set<T>::Set;
+
+    void addElement(T element) override {
+        this->implementation->addElement(element);
+        if (this->implementation->getSize() == this->sizeToChangeImplementation) {
+            this->changeImplementation(SET_TREAP);
+        }
+    }
+    void removeElement(T element) override {
+        this->implementation->removeElement(element);
+        if (this->implementation->getSize() == this->sizeToChangeImplementation - 1) {
+            this->changeImplementation(SET_ARRAY);
+        }
+    }
+    bool containsElement(T element) const override {
+        return this->implementation->containsElement(element);
+    }
+};
+
+// Номера потоков-читателей для слотов эпох. Поток получает свободный номер
+// при первом чтении и возвращает его при завершении
+class ReaderRegistry {
+public:
+    static constexpr int maxReaders = 128;
+
+    static int currentReader() {
+        thread_local Handle handle;
+        return handle.id;
+    }
+
+private:
+    struct Handle {
+        int id;
+        Handle() : id(acquire()) {}
+        ~Handle() {
+            release(id);
+        }
+    };
+
+    static inline std::mutex mutex;
+    static inline std::array<bool, maxReaders> taken{};
+
+    static int acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int id = 0; id < maxReaders; ++id) {
+            if (!taken[id]) {
+                taken[id] = true;
+                return id;
+            }
+        }
+        throw std::runtime_error("too many concurrent reader threads");
+    }
+    static void release(int id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        taken[id] = false;
+    }
+};
+
+// Множество для частого чтения из многих потоков при редких изменениях.
+// Читатели работают с неизменяемым снимком, опубликованным через атомарный
+// указатель, и не ждут ни писателей, ни друг друга. Писатель под мьютексом
+// копирует снимок (clone), меняет копию и подменяет указатель. Старый снимок
+// освобождается по эпохам: читатель отмечает в своём слоте эпоху, в которую
+// начал чтение, а снимок, снятый в эпоху e, удаляется, когда все активные
+// читатели начали позже e. Все атомарные операции - seq_cst
+template <typename T>
+class SnapshotSet {
+private:
+    struct alignas(64) ReaderSlot {
+        std::atomic<std::uint64_t> epoch{0};
+    };
+
+    std::atomic<const SetImplementation<T>*> current;
+    std::atomic<std::uint64_t> globalEpoch{1};
+    mutable std::array<ReaderSlot, ReaderRegistry::maxReaders> readers;
+    std::mutex writerMutex;
+    std::vector<std::pair<std::uint64_t, const SetImplementation<T>*>> retired;
+
+    template <typename Read>
+    auto read(Read reader) const {
+        ReaderSlot& slot = readers[ReaderRegistry::currentReader()];
+        slot.epoch.store(globalEpoch.load());
+        auto result = reader(*current.load());
+        slot.epoch.store(0);
+        return result;
+    }
+
+    void reclaim() {
+        std::uint64_t oldest = UINT64_MAX;
+        for (const ReaderSlot& slot : readers) {
+            std::uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) {
+                oldest = std::min(oldest, epoch);
+            }
+        }
+        auto kept = std::remove_if(retired.begin(), retired.end(), [oldest](const auto& snapshot) {
+            if (snapshot.first < oldest) {
+                delete snapshot.second;
+                return true;
+            }
+            return false;
+        });
+        retired.erase(kept, retired.end());
+    }
+
+public:
+    // SnapshotSet становится владельцем переданной реализации
+    explicit SnapshotSet(SetImplementation<T>* initial = new SortedArraySet<T>) : current(initial) {}
+    SnapshotSet(const SnapshotSet&) = delete;
+    SnapshotSet& operator=(const SnapshotSet&) = delete;
+    ~SnapshotSet() {
+        delete current.load();
+        for (const auto& snapshot : retired) {
+            delete snapshot.second;
+        }
+    }
+
+    // Несколько изменений одной копией снимка
+    template <typename Update>
+    void modify(Update update) {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        SetImplementation<T>* next = current.load()->clone();
+        update(*next);
+        const SetImplementation<T>* previous = current.exchange(next);
+        retired.push_back({globalEpoch.fetch_add(1), previous});
+        reclaim();
+    }
+
+    void addElement(T element) {
+        if (!containsElement(element)) {
+            modify([element](SetImplementation<T>& set) {set.addElement(element);});
+        }
+    }
+    void removeElement(T element) {
+        if (containsElement(element)) {
+            modify([element](SetImplementation<T>& set) {set.removeElement(element);});
+        }
+    }
+    bool containsElement(T element) const {
+        return read([element](const SetImplementation<T>& set) {return set.containsElement(element);});
+    }
+    int getSize() const {
+        return read([](const SetImplementation<T>& set) {return set.getSize();});
+    }
+};
+
+// Множество для частых изменений: хеш-таблица разбита на полосы со своими
+// блокировками. Поиски в одной полосе идут параллельно, запись блокирует только
+// свою полосу
+template <typename T>
+class StripedHashSet {
+private:
+    static constexpr int stripeBits = 6;
+
+    struct alignas(64) Stripe {
+        std::shared_mutex mutex;
+        HashSet<T> elements;
+    };
+
+    mutable std::array<Stripe, 1 << stripeBits> stripes;
+    std::atomic<int> size{0};
+
+    // Полоса выбирается по старшим битам мультипликативного хеша, а внутри
+    // полосы HashSet использует младшие биты своего
+    Stripe& stripeOf(T element) const {
+        std::uint64_t h = std::hash<T>()(element) * 0x9e3779b97f4a7c15ULL;
+        return stripes[h >> (64 - stripeBits)];
+    }
+
+public:
+    void addElement(T element) {
+        Stripe& stripe = stripeOf(element);
+        std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+        if (!stripe.elements.containsElement(element)) {
+            stripe.elements.addElement(element);
+            size++;
+        }
+    }
+    void removeElement(T element) {
+        Stripe& stripe = stripeOf(element);
+        std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+        if (stripe.elements.containsElement(element)) {
+            stripe.elements.removeElement(element);
+            size--;
+        }
+    }
+    bool containsElement(T element) const {
+        Stripe& stripe = stripeOf(element);
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+        return stripe.elements.containsElement(element);
+    }
+    int getSize() const {
+        return size.load();
+    }
+};
+
+// Прежняя реализация дерева: отдельный new на каждый узел, рекурсивные вставка,
+// поиск и освобождение. Оставлена для сравнения в benchmarkTreapPool
+template <typename T>
+class PointerTreapSet {
+private:
+    struct Node {
+        T key;
+        int priority;
+        Node* left;
+        Node* right;
+
+        Node(T k, int p) : key(k), priority(p), left(nullptr), right(nullptr) {}
+    };
+
+    Node* root = nullptr;
+    std::mt19937 rng;
+    int size = 0;
+
+    Node* insertNode(Node* root, T key, int priority) {
+        if (root == nullptr) {
+            return new Node(key, priority);
+        }
+        if (key < root->key) {
+            root->left = insertNode(root->left, key, priority);
+            if (root->left->priority > root->priority) {
+                Node* newRoot = root->left;
+                root->left = newRoot->right;
+                newRoot->right = root;
+                return newRoot;
+            }
+        } else {
+            root->right = insertNode(root->right, key, priority);
+            if (root->right->priority > root->priority) {
+                Node* newRoot = root->right;
+                root->right = newRoot->left;
+                newRoot->left = root;
+                return newRoot;
+            }
+        }
+        return root;
+    }
+
+    bool containsNode(Node* root, T key) const {
+        if (root == nullptr) {
+            return false;
+        }
+        if (key < root->key) {
+            return containsNode(root->left, key);
+        } else if (key > root->key) {
+            return containsNode(root->right, key);
+        }
+        return true;
+    }
+
+    void destroyNode(Node* node) {
+        if (node != nullptr) {
+            destroyNode(node->left);
+            destroyNode(node->right);
+            delete node;
         }
-        size=vec.size();
     }
-    
-    // Метод для получения содержимого дерева в виде std::vector
-    std::vector<T> getAsVector() override{
-        std::vector<T> result;
-        inorderTraversal(root, result);
-        return result;
+
+public:
+    PointerTreapSet() : rng(std::random_device()()) {}
+    PointerTreapSet(const PointerTreapSet&) = delete;
+    PointerTreapSet& operator=(const PointerTreapSet&) = delete;
+    ~PointerTreapSet() {
+        destroyNode(root);
     }
 
-    int getSize() const override
-    {
-        return size;
+    void addElement(T element) {
+        if (!containsNode(root, element)) {
+            root = insertNode(root, element, rng());
+            size++;
+        }
     }
 
-    SetImplementation<T>* unionSet(SetImplementation<T>* other) override
-    {
-        SetImplementation<T>* result = new TreapSet<T>;
-        std::vector<T> data = this->getAsVector();
-        std::cout<<"here";
-        result->fillFromVector(data);
-        for(auto elementFromOther: other->getAsVector())
-        {
-            if(!other->containsElement(elementFromOther))
-                result->addElement(elementFromOther);
+    bool containsElement(T element) const {
+        return containsNode(root, element);
+    }
+
+    static constexpr size_t nodeSize = sizeof(Node);
+};
+
+const char* backendName(SetBackend backend) {
+    switch (backend) {
+        case SET_ARRAY: return "array";
+        case SET_TREAP: return "treap";
+        case SET_SORTED_ARRAY: return "sorted array";
+        case SET_HASH: return "hash";
+        case SET_BITMAP: return "bitmap";
+        case SET_PERSISTENT_TREAP: return "persistent treap";
+    }
+    return "unknown";
+}
+
+// Рабочая нагрузка, колеблющаяся около порога: добавить и удалить один и тот же
+// элемент, между ними несколько поисков
+template <typename SetType>
+void runThresholdOscillation(const char* title, int threshold, int rounds) {
+    SetType set(new ArraySet<int>, threshold);
+    for (int i = 0; i < threshold - 1; ++i) {
+        set.addElement(i);
+    }
+    auto start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int round = 0; round < rounds; ++round) {
+        set.addElement(threshold);
+        found += set.containsElement(round % threshold);
+        set.removeElement(threshold);
+        found += set.containsElement(round % threshold);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << title << ": " << set.getConversionsCount() << " conversions, "
+              << elapsed.count() << " ms, backend " << backendName(set.getBackend())
+              << " (" << found << " hits)\n";
+}
+
+void benchmarkThresholdOscillation(int threshold, int rounds) {
+    std::cout << "\noscillating around size " << threshold << ", " << rounds << " rounds\n";
+    runThresholdOscillation<ExactThresholdSet<int>>("exact threshold", threshold, rounds);
+    runThresholdOscillation<Set<int>>("adaptive", threshold, rounds);
+}
+
+// Время поиска (половина запросов - попадания) в множествах целых разного размера
+// Сумма попаданий накапливается снаружи, чтобы компилятор не выбросил поиски
+long long lookupHits = 0;
+
+template <typename Implementation>
+double measureLookups(const std::vector<int>& data, const std::vector<int>& queries) {
+    Implementation set;
+    std::vector<int> copy = data;
+    set.fillFromVector(copy);
+    auto start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int query : queries) {
+        found += set.containsElement(query);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    return elapsed.count() / queries.size();
+}
+
+void benchmarkSortedLookups() {
+    std::cout << "\nlookup, ns/query: size | array | treap | sorted array\n";
+    std::mt19937 rng(1);
+    for (int size : {16, 100, 1000, 10000, 100000}) {
+        std::vector<int> data(size);
+        for (int i = 0; i < size; ++i) {
+            data[i] = 2 * i;
         }
-        return result;
-    };
-    SetImplementation<T>* intersect(SetImplementation<T>* other) override
-    {
-        SetImplementation<T>* result = new TreapSet<T>;
-        for(auto element: this->getAsVector())
-        {
-            if(other->containsElement(element))
-                result->addElement(element);
+        std::shuffle(data.begin(), data.end(), rng);
+        // Линейный поиск по большому массиву слишком медленный для миллиона запросов
+        size_t queriesCount = size > 1000 ? 20000 : 1000000;
+        std::vector<int> queries(queriesCount);
+        std::uniform_int_distribution<int> value(0, 2 * size);
+        for (int& query : queries) {
+            query = value(rng);
         }
-        return result;
-    };
-};
+        std::cout << size << " | " << measureLookups<ArraySet<int>>(data, queries)
+                  << " | " << measureLookups<TreapSet<int>>(data, queries)
+                  << " | " << measureLookups<SortedArraySet<int>>(data, queries) << "\n";
+    }
+    std::cout << "(" << lookupHits << " hits)\n";
+}
 
-// Абстракция
-template <typename T>
-class Set {
-protected:
-    SetImplementation<T>* implementation;
-    const int sizeToChangeImplementation;
-    void changeImplementation() 
-    {
-        std::cout<<"I am about to change implementation\n";
-        if (auto vectorImplementation = dynamic_cast<ArraySet<T>*>(implementation))
-        {
-            std::cout<<"now impl will be changed to treap\n";
-            SetImplementation<T>* treapSet = new TreapSet<T>;
-            std::vector<T> dataFromVector = vectorImplementation->getAsVector();
-            treapSet->fillFromVector(dataFromVector);
-            implementation=treapSet;
-            std::cout<<"impl changed to treap\n";
-        }
-        else if (auto treapImplementation = dynamic_cast<TreapSet<T>*>(implementation))
-        {
-            std::cout<<"now impl will be changed to vector\n";
-            SetImplementation<T>* ArraySet = new ArraySet<T>;
-            auto dataFromVector = treapImplementation->getAsVector();
-            ArraySet->fillFromVector(dataFromVector);
-            implementation=ArraySet;
+// Вставка и поиск на больших множествах: хеш-таблица против дерева и std::unordered_set
+template <typename Container>
+void measureHashWorkload(const char* title, const std::vector<int>& data, const std::vector<int>& queries) {
+    Container set;
+    auto start = std::chrono::steady_clock::now();
+    for (int element : data) {
+        if constexpr (std::is_base_of_v<SetImplementation<int>, Container>) {
+            set.addElement(element);
+        } else {
+            set.insert(element);
+        }
+    }
+    std::chrono::duration<double, std::nano> insertTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int query : queries) {
+        if constexpr (std::is_base_of_v<SetImplementation<int>, Container>) {
+            found += set.containsElement(query);
+        } else {
+            found += set.count(query);
+        }
+    }
+    std::chrono::duration<double, std::nano> lookupTime = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    std::cout << title << ": insert " << insertTime.count() / data.size() << " ns, lookup "
+              << lookupTime.count() / queries.size() << " ns\n";
+}
+
+void benchmarkHashSet(int size) {
+    std::cout << "\n" << size << " random keys, 1M lookups (half hits)\n";
+    std::mt19937 rng(2);
+    std::vector<int> data(size);
+    for (int& element : data) {
+        element = static_cast<int>(rng() & 0x7ffffffe);
+    }
+    std::vector<int> queries(1000000);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        queries[i] = i % 2 ? data[rng() % size] : static_cast<int>(rng() | 1);
+    }
+    measureHashWorkload<HashSet<int>>("hash (Robin Hood)", data, queries);
+    measureHashWorkload<TreapSet<int>>("treap", data, queries);
+    measureHashWorkload<std::unordered_set<int>>("std::unordered_set", data, queries);
+}
+
+// Объединение и пересечение плотных множеств целых: по 90% чисел из [0, range)
+template <typename Implementation>
+void measureSetAlgebra(const char* title, const std::vector<int>& first, const std::vector<int>& second) {
+    Implementation a, b;
+    std::vector<int> copy = first;
+    a.fillFromVector(copy);
+    copy = second;
+    b.fillFromVector(copy);
+    size_t memory = 0;
+    if constexpr (requires { a.memoryUsage(); }) {
+        memory = a.memoryUsage();
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<SetImplementation<int>> united(a.unionSet(&b));
+    std::chrono::duration<double> unionTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    std::unique_ptr<SetImplementation<int>> common(a.intersect(&b));
+    std::chrono::duration<double> intersectTime = std::chrono::steady_clock::now() - start;
+    double elements = double(first.size() + second.size());
+    std::cout << title << ": union " << elements / unionTime.count() / 1e6 << " M elements/sec, intersect "
+              << elements / intersectTime.count() / 1e6 << " M elements/sec";
+    if (memory != 0) {
+        std::cout << ", " << double(memory) / first.size() << " bytes/element";
+    }
+    std::cout << " (" << united->getSize() << ", " << common->getSize() << ")\n";
+}
+
+void benchmarkBitmapSet(int range) {
+    std::cout << "\ndense sets, 90% of [0, " << range << ")\n";
+    std::mt19937 rng(4);
+    std::bernoulli_distribution keep(0.9);
+    std::vector<int> first, second;
+    for (int i = 0; i < range; ++i) {
+        if (keep(rng)) {
+            first.push_back(i);
         }
+        if (keep(rng)) {
+            second.push_back(i);
+        }
+    }
+    std::shuffle(first.begin(), first.end(), rng);
+    std::shuffle(second.begin(), second.end(), rng);
+    measureSetAlgebra<BitmapSet<int>>("bitmap", first, second);
+    measureSetAlgebra<SortedArraySet<int>>("sorted array", first, second);
+    measureSetAlgebra<HashSet<int>>("hash", first, second);
+    measureSetAlgebra<TreapSet<int>>("treap", first, second);
+
+    BitmapSet<int> runs;
+    std::vector<int> range100k(100000);
+    for (int i = 0; i < 100000; ++i) {
+        range100k[i] = 1000000 + i;
+    }
+    runs.fillFromVector(range100k);
+    std::cout << "contiguous 100000 integers in bitmap: " << runs.memoryUsage() << " bytes\n";
+}
+
+// Объединение, пересечение и разность случайных множеств одного размера,
+// перекрывающихся наполовину. Скорость - элементы обоих операндов в секунду
+template <typename First, typename Second>
+void measureMergeAlgebra(const char* title, const std::vector<int>& firstData, const std::vector<int>& secondData) {
+    First first;
+    Second second;
+    std::vector<int> copy = firstData;
+    first.fillFromVector(copy);
+    copy = secondData;
+    second.fillFromVector(copy);
+    double elements = double(firstData.size() + secondData.size());
+    std::cout << title << ":";
+    long long sizes = 0;
+    for (int operation = 0; operation < 3; ++operation) {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<SetImplementation<int>> result(
+            operation == 0 ? first.unionSet(&second) : operation == 1 ? first.intersect(&second) : first.difference(&second));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        sizes += result->getSize();
+        std::cout << " " << elements / elapsed.count() / 1e6;
+    }
+    std::cout << " (" << sizes << ")\n";
+}
+
+void benchmarkMergeAlgebra() {
+    std::cout << "\nunion | intersect | difference, M elements/sec\n";
+    std::mt19937 rng(5);
+    for (int size : {10000, 100000, 1000000, 10000000}) {
+        std::vector<int> firstData(size), secondData(size);
+        for (int i = 0; i < size; ++i) {
+            firstData[i] = 2 * i;
+            secondData[i] = 2 * i + (i % 2) * (2 * size - 1);
+        }
+        std::shuffle(firstData.begin(), firstData.end(), rng);
+        std::shuffle(secondData.begin(), secondData.end(), rng);
+        std::cout << size << " elements\n";
+        measureMergeAlgebra<SortedArraySet<int>, SortedArraySet<int>>("  sorted array", firstData, secondData);
+        measureMergeAlgebra<BitmapSet<int>, BitmapSet<int>>("  bitmap", firstData, secondData);
+        measureMergeAlgebra<SortedArraySet<int>, BitmapSet<int>>("  sorted array x bitmap", firstData, secondData);
+        measureMergeAlgebra<HashSet<int>, HashSet<int>>("  hash", firstData, secondData);
+        measureMergeAlgebra<SortedArraySet<int>, HashSet<int>>("  sorted array x hash", firstData, secondData);
+        // Деревья на 10M измеряются отдельно в benchmarkTreapParallel
+        if (size <= 1000000) {
+            measureMergeAlgebra<TreapSet<int>, TreapSet<int>>("  treap", firstData, secondData);
+        }
+    }
+}
+
+// Сборка двух деревьев и операции над ними при разном числе потоков
+void benchmarkTreapParallel(int size) {
+    std::cout << "\ntreap, " << size << " elements per operand (" << std::thread::hardware_concurrency()
+              << " hardware threads)\n";
+    std::vector<int> firstData(size), secondData(size);
+    for (int i = 0; i < size; ++i) {
+        firstData[i] = 2 * i;
+        secondData[i] = 3 * i;
+    }
+    TreapSet<int> first, second;
+    auto start = std::chrono::steady_clock::now();
+    first.fillFromVector(firstData);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    second.fillFromVector(secondData);
+    std::cout << "build from sorted data: " << elapsed.count() * 1000 << " ms\n";
+
+    std::vector<int> shuffled(1000000);
+    for (int i = 0; i < 1000000; ++i) {
+        shuffled[i] = i;
+    }
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(6));
+    TreapSet<int> inserted;
+    start = std::chrono::steady_clock::now();
+    for (int element : shuffled) {
+        inserted.addElement(element);
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "1M single inserts for comparison: " << elapsed.count() * 1000 << " ms\n";
+
+    std::cout << "threads | union | intersect | difference, ms\n";
+    for (int threads : {1, 2, 4, 8, 16}) {
+        TreapSet<int>::setParallelism(threads);
+        std::cout << threads;
+        long long sizes = 0;
+        for (int operation = 0; operation < 3; ++operation) {
+            start = std::chrono::steady_clock::now();
+            std::unique_ptr<SetImplementation<int>> result(
+                operation == 0 ? first.unionSet(&second) : operation == 1 ? first.intersect(&second) : first.difference(&second));
+            elapsed = std::chrono::steady_clock::now() - start;
+            sizes += result->getSize();
+            std::cout << " | " << elapsed.count() * 1000;
+        }
+        std::cout << " (" << sizes << ")\n";
+    }
+    TreapSet<int>::setParallelism(static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Вставка, поиск и разрушение дерева: пул с индексами против узлов через new
+template <typename Treap>
+void measureTreapPool(const char* title, const std::vector<int>& data, const std::vector<int>& queries) {
+    auto start = std::chrono::steady_clock::now();
+    auto treap = std::make_unique<Treap>();
+    for (int element : data) {
+        treap->addElement(element);
     }
+    std::chrono::duration<double, std::nano> insertTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int query : queries) {
+        found += treap->containsElement(query);
+    }
+    std::chrono::duration<double, std::nano> lookupTime = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    size_t bytesPerElement;
+    if constexpr (requires { treap->memoryUsage(); }) {
+        bytesPerElement = treap->memoryUsage() / data.size();
+    } else {
+        // Узел плюс служебное слово malloc с выравниванием до 16 байт
+        bytesPerElement = (Treap::nodeSize + sizeof(size_t) + 15) / 16 * 16;
+    }
+    start = std::chrono::steady_clock::now();
+    treap.reset();
+    std::chrono::duration<double, std::milli> teardownTime = std::chrono::steady_clock::now() - start;
+    std::cout << title << ": insert " << insertTime.count() / data.size() << " ns, lookup "
+              << lookupTime.count() / queries.size() << " ns, " << bytesPerElement << " bytes/element, teardown "
+              << teardownTime.count() << " ms\n";
+}
+
+void benchmarkTreapPool(int size) {
+    std::cout << "\ntreap node storage, " << size << " random keys, 1M lookups\n";
+    std::mt19937 rng(7);
+    std::vector<int> data(size);
+    for (int& element : data) {
+        element = static_cast<int>(rng() & 0x7fffffff);
+    }
+    std::vector<int> queries(1000000);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        queries[i] = i % 2 ? data[rng() % size] : static_cast<int>(rng() & 0x7fffffff);
+    }
+    measureTreapPool<PointerTreapSet<int>>("new per node", data, queries);
+    measureTreapPool<TreapSet<int>>("index pool", data, queries);
+}
+
+// Обычное множество под одним мьютексом - для сравнения с конкурентными
+template <typename T>
+class MutexSet {
+private:
+    mutable std::mutex mutex;
+    SortedArraySet<T> elements;
 
 public:
-    Set(SetImplementation<T>* impl, int sizeToChangeImplementation) : implementation(impl), sizeToChangeImplementation(sizeToChangeImplementation){}
-    virtual void addElement(T element) {
-        implementation->addElement(element);
-        if(implementation->getSize()==sizeToChangeImplementation)
-            changeImplementation();
+    void addElement(T element) {
+        std::lock_guard<std::mutex> lock(mutex);
+        elements.addElement(element);
     }
-    virtual void removeElement(T element) {
-        implementation->removeElement(element);
-        if(implementation->getSize()==sizeToChangeImplementation-1)
-            changeImplementation();
+    void removeElement(T element) {
+        std::lock_guard<std::mutex> lock(mutex);
+        elements.removeElement(element);
     }
-    virtual bool containsElement(T element) const {
-        return implementation->containsElement(element);
+    bool containsElement(T element) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return elements.containsElement(element);
     }
+    int getSize() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return elements.getSize();
+    }
+};
 
-    Set unionSet(Set<T>* other)
-    {
-        Set<T>* result = new Set<T>(implementation->unionSet(other->implementation), sizeToChangeImplementation);
-        return *result;
+// Проверка под нагрузкой: писатели добавляют и удаляют каждый свои ключи,
+// читатели проверяют, что постоянные ключи всегда видны, а никогда не
+// добавлявшиеся - никогда. Собирается и с -fsanitize=thread
+template <typename ConcurrentSet>
+void stressConcurrentSet(const char* title, int writersCount, int readersCount, int rounds) {
+    const int permanentCount = 1000;
+    ConcurrentSet set;
+    for (int i = 0; i < permanentCount; ++i) {
+        set.addElement(2 * i);
+    }
+    std::atomic<bool> writing{true};
+    std::atomic<long long> errors{0};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writersCount; ++w) {
+        threads.emplace_back([&set, w, rounds] {
+            int base = 1000000 * (w + 1);
+            for (int round = 0; round < rounds; ++round) {
+                set.addElement(base + 2 * (round % 100));
+                if (round >= 50) {
+                    set.removeElement(base + 2 * ((round - 50) % 100));
+                }
+            }
+            for (int i = 0; i < 100; ++i) {
+                set.removeElement(base + 2 * i);
+            }
+        });
     }
+    for (int r = 0; r < readersCount; ++r) {
+        threads.emplace_back([&set, &writing, &errors, r] {
+            std::mt19937 rng(r);
+            do {
+                for (int i = 0; i < 1000; ++i) {
+                    int key = static_cast<int>(rng() % permanentCount);
+                    if (!set.containsElement(2 * key) || set.containsElement(2 * key + 1)) {
+                        errors++;
+                    }
+                }
+            } while (writing.load());
+        });
+    }
+    for (int w = 0; w < writersCount; ++w) {
+        threads[w].join();
+    }
+    writing.store(false);
+    for (size_t t = writersCount; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    std::cout << title << ": " << errors.load() << " errors, final size " << set.getSize()
+              << " (expected " << permanentCount << ")\n";
+}
 
-    Set intersectSet(Set* other)
-    {
-        Set<T>* result = new Set<T>(implementation->intersect(other->implementation), sizeToChangeImplementation);
-        return *result;
+// Поиски в секунду у readersCount потоков, пока писатель раз в 20 мс меняет множество
+template <typename ConcurrentSet>
+double measureConcurrentReads(int readersCount, int size) {
+    ConcurrentSet set;
+    if constexpr (std::is_same_v<ConcurrentSet, SnapshotSet<int>>) {
+        // Поэлементно каждое добавление копировало бы весь снимок
+        set.modify([size](SetImplementation<int>& elements) {
+            for (int i = 0; i < size; ++i) {
+                elements.addElement(2 * i);
+            }
+        });
+    } else {
+        for (int i = 0; i < size; ++i) {
+            set.addElement(2 * i);
+        }
+    }
+    std::atomic<bool> running{true};
+    std::atomic<long long> lookups{0}, hits{0};
+    std::vector<std::thread> threads;
+    threads.emplace_back([&set, &running, size] {
+        for (int round = 0; running.load(); ++round) {
+            set.addElement(2 * size + 2 * round);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < readersCount; ++r) {
+        threads.emplace_back([&set, &running, &lookups, &hits, r, size] {
+            std::mt19937 rng(r);
+            long long count = 0, found = 0;
+            while (running.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 256; ++i) {
+                    found += set.containsElement(static_cast<int>(rng() % (2 * size)));
+                }
+                count += 256;
+            }
+            lookups += count;
+            hits += found;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    running.store(false);
+    for (std::thread& thread : threads) {
+        thread.join();
     }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    lookupHits += hits.load();
+    return lookups.load() / elapsed.count();
+}
+
+void benchmarkConcurrentSets() {
+    std::cout << "\nconcurrent stress, 4 writers and 4 readers\n";
+    stressConcurrentSet<SnapshotSet<int>>("snapshot", 4, 4, 2000);
+    stressConcurrentSet<StripedHashSet<int>>("striped hash", 4, 4, 20000);
+    stressConcurrentSet<MutexSet<int>>("mutex", 4, 4, 20000);
+
+    std::cout << "\nreaders | snapshot | striped hash | mutex, M lookups/sec (100000 elements, "
+              << std::thread::hardware_concurrency() << " hardware threads)\n";
+    for (int readers : {1, 2, 4, 8, 16, 32}) {
+        std::cout << readers << " | " << measureConcurrentReads<SnapshotSet<int>>(readers, 100000) / 1e6
+                  << " | " << measureConcurrentReads<StripedHashSet<int>>(readers, 100000) / 1e6
+                  << " | " << measureConcurrentReads<MutexSet<int>>(readers, 100000) / 1e6 << "\n";
+    }
+}
+
+// Время на элемент: поиски пакетами по batch против поэлементных вызовов
+// (batch = 0) в множестве из size элементов
+template <typename Implementation>
+double measureBatchLookups(int size, const std::vector<int>& queries, int batch) {
+    Implementation set;
+    std::vector<int> data(size);
+    for (int i = 0; i < size; ++i) {
+        data[i] = 2 * i;
+    }
+    set.fillFromVector(data);
+    SetImplementation<int>& implementation = set;
+    long long found = 0;
+    auto start = std::chrono::steady_clock::now();
+    if (batch == 0) {
+        for (int query : queries) {
+            found += implementation.containsElement(query);
+        }
+    } else {
+        std::span<const int> all(queries);
+        for (size_t first = 0; first < queries.size(); first += batch) {
+            std::vector<bool> result = implementation.containsMany(all.subspan(first, std::min<size_t>(batch, queries.size() - first)));
+            found += std::count(result.begin(), result.end(), true);
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    return elapsed.count() / queries.size();
+}
+
+// То же для вставки новых элементов в множество из size элементов
+template <typename Implementation>
+double measureBatchInserts(int size, const std::vector<int>& inserts, int batch) {
+    Implementation set;
+    std::vector<int> data(size);
+    for (int i = 0; i < size; ++i) {
+        data[i] = 2 * i;
+    }
+    set.fillFromVector(data);
+    SetImplementation<int>& implementation = set;
+    auto start = std::chrono::steady_clock::now();
+    if (batch == 0) {
+        for (int element : inserts) {
+            implementation.addElement(element);
+        }
+    } else {
+        std::span<const int> all(inserts);
+        for (size_t first = 0; first < inserts.size(); first += batch) {
+            implementation.addElements(all.subspan(first, std::min<size_t>(batch, inserts.size() - first)));
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    lookupHits += implementation.getSize();
+    return elapsed.count() / inserts.size();
+}
+
+void benchmarkBatchOperations() {
+    const int size = 1000000;
+    std::mt19937 rng(8);
+    std::vector<int> queries(200000);
+    for (int& query : queries) {
+        query = static_cast<int>(rng() % (2 * size));
+    }
+    std::cout << "\nbatched lookups in " << size << " elements, ns/query (batch 0 = single calls)\n"
+              << "batch | sorted array | hash | treap | bitmap\n";
+    for (int batch : {0, 1, 10, 100, 1000, 10000, 100000}) {
+        std::cout << batch << " | " << measureBatchLookups<SortedArraySet<int>>(size, queries, batch)
+                  << " | " << measureBatchLookups<HashSet<int>>(size, queries, batch)
+                  << " | " << measureBatchLookups<TreapSet<int>>(size, queries, batch)
+                  << " | " << measureBatchLookups<BitmapSet<int>>(size, queries, batch) << "\n";
+    }
+
+    // Нечётные ключи - новые элементы. Поэлементная вставка в отсортированный
+    // массив сдвигает его на каждый элемент, поэтому для него малые пакеты пропущены
+    const int insertSize = 100000;
+    std::vector<int> inserts(100000);
+    for (int& element : inserts) {
+        element = static_cast<int>(rng() % (2 * insertSize)) | 1;
+    }
+    std::cout << "\nbatched inserts into " << insertSize << " elements, ns/element\n"
+              << "batch | sorted array | hash | treap | bitmap\n";
+    for (int batch : {0, 1, 10, 100, 1000, 10000, 100000}) {
+        std::cout << batch << " | ";
+        if (batch == 0 || batch >= 100) {
+            std::cout << measureBatchInserts<SortedArraySet<int>>(insertSize, inserts, batch);
+        } else {
+            std::cout << "-";
+        }
+        std::cout << " | " << measureBatchInserts<HashSet<int>>(insertSize, inserts, batch)
+                  << " | " << measureBatchInserts<TreapSet<int>>(insertSize, inserts, batch)
+                  << " | " << measureBatchInserts<BitmapSet<int>>(insertSize, inserts, batch) << "\n";
+    }
+}
+
+// Одинаковая нагрузка через виртуальный Set и StaticSet на variant
+template <typename SetType>
+void measureBridge(const char* title, SetType& set, int size, const std::vector<int>& queries) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < size; ++i) {
+        set.addElement(2 * i);
+    }
+    std::chrono::duration<double, std::nano> insertTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int query : queries) {
+        found += set.containsElement(query);
+    }
+    std::chrono::duration<double, std::nano> lookupTime = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    std::cout << "  " << title << ": insert " << insertTime.count() / size << " ns, lookup "
+              << lookupTime.count() / queries.size() << " ns, backend " << backendName(set.getBackend()) << "\n";
+}
+
+void benchmarkStaticDispatch() {
+    std::cout << "\nvirtual Set vs StaticSet (variant)\n";
+    std::mt19937 rng(9);
+    for (int size : {8, 64, 1000, 100000}) {
+        std::vector<int> queries(2000000);
+        for (int& query : queries) {
+            query = static_cast<int>(rng() % (2 * size));
+        }
+        std::cout << size << " elements\n";
+        Set<int> dynamicSet(new ArraySet<int>, 64);
+        measureBridge("virtual", dynamicSet, size, queries);
+        StaticSet<int> staticSet(SET_ARRAY, 64);
+        measureBridge("variant", staticSet, size, queries);
+    }
+
+    // Только вызов реализации, без учёта операций в мосте. Вид реализации
+    // известен лишь во время выполнения, чтобы компилятор не угадал его
+    std::vector<int> data(64), queries(2000000);
+    for (int i = 0; i < 64; ++i) {
+        data[i] = 2 * i;
+    }
+    for (int& query : queries) {
+        query = static_cast<int>(rng() % 128);
+    }
+    bool sorted = rng() % 2 == 0;
+    std::unique_ptr<SetImplementation<int>> pointer;
+    StaticSet<int>::Backends variant;
+    if (sorted) {
+        pointer = std::make_unique<SortedArraySet<int>>();
+        variant.emplace<SortedArraySet<int>>();
+    } else {
+        pointer = std::make_unique<HashSet<int>>();
+        variant.emplace<HashSet<int>>();
+    }
+    std::vector<int> copy = data;
+    pointer->fillFromVector(copy);
+    std::visit([&data](auto& set) {set.fillFromVector(data);}, variant);
+    auto start = std::chrono::steady_clock::now();
+    long long found = 0;
+    for (int query : queries) {
+        found += pointer->containsElement(query);
+    }
+    std::chrono::duration<double, std::nano> virtualTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int query : queries) {
+        found += std::visit([query](const auto& set) {return set.containsElement(query);}, variant);
+    }
+    std::chrono::duration<double, std::nano> visitTime = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+    std::cout << "raw lookup in 64 elements (" << backendName(pointer->getBackend()) << "): virtual "
+              << virtualTime.count() / queries.size()
+              << " ns, std::visit " << visitTime.count() / queries.size() << " ns\n";
+}
+
+// Изменение снимка в SnapshotSet: копия реализации плюс одно добавление
+template <typename Implementation>
+double measureSnapshotUpdates(const std::vector<int>& data, int updates) {
+    SnapshotSet<int> set(new Implementation);
+    set.modify([&data](SetImplementation<int>& elements) {
+        std::vector<int> copy = data;
+        elements.fillFromVector(copy);
+    });
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < updates; ++i) {
+        set.addElement(-1 - i);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / updates;
+}
+
+void benchmarkPersistentTreap(int size) {
+    std::cout << "\npersistent treap, " << size << " elements\n";
+    std::mt19937 rng(46);
+    std::vector<int> data(size);
+    for (int& value : data) {
+        value = static_cast<int>(rng() % (4u * size));
+    }
+    std::vector<int> copy = data;
+    PersistentTreapSet<int> persistent;
+    persistent.fillFromVector(copy);
+    copy = data;
+    TreapSet<int> treap;
+    treap.fillFromVector(copy);
+
+    // Снимок против полной копии
+    const int snapshotsCount = 1000;
+    std::vector<PersistentTreapSet<int>> snapshots;
+    snapshots.reserve(snapshotsCount);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < snapshotsCount; ++i) {
+        snapshots.push_back(persistent.snapshot());
+    }
+    std::chrono::duration<double, std::nano> snapshotTime = std::chrono::steady_clock::now() - start;
+    snapshots.clear();
+    start = std::chrono::steady_clock::now();
+    std::unique_ptr<SetImplementation<int>> treapCopy(treap.clone());
+    std::chrono::duration<double, std::nano> copyTime = std::chrono::steady_clock::now() - start;
+    std::cout << "snapshot " << snapshotTime.count() / snapshotsCount << " ns, TreapSet copy "
+              << copyTime.count() / 1e6 << " ms\n";
+
+    // Версии после каждой серии изменений. Новые узлы на изменение сравниваются
+    // с глубиной дерева, память всех версий - с полными копиями
+    const int versionsCount = 20, updatesPerVersion = 1000;
+    std::vector<PersistentTreapSet<int>> versions;
+    versions.push_back(persistent.snapshot());
+    auto persistentTime = std::chrono::steady_clock::duration::zero();
+    auto treapTime = persistentTime;
+    for (int v = 0; v < versionsCount; ++v) {
+        std::vector<int> keys(updatesPerVersion);
+        for (int& key : keys) {
+            key = static_cast<int>(rng() % (4u * size));
+        }
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < updatesPerVersion; ++i) {
+            persistent.addElement(keys[i]);
+            persistent.removeElement(keys[updatesPerVersion - 1 - i]);
+        }
+        persistentTime += std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < updatesPerVersion; ++i) {
+            treap.addElement(keys[i]);
+            treap.removeElement(keys[updatesPerVersion - 1 - i]);
+        }
+        treapTime += std::chrono::steady_clock::now() - start;
+        versions.push_back(persistent.snapshot());
+    }
+    std::vector<const PersistentTreapSet<int>*> pointers;
+    for (const PersistentTreapSet<int>& version : versions) {
+        pointers.push_back(&version);
+    }
+    size_t shared = PersistentTreapSet<int>::sharedMemoryUsage(pointers);
+    size_t single = PersistentTreapSet<int>::sharedMemoryUsage(std::span(pointers).first(1));
+    double updates = 2.0 * versionsCount * updatesPerVersion;
+    std::cout << "update: persistent " << std::chrono::duration<double, std::nano>(persistentTime).count() / updates
+              << " ns, TreapSet " << std::chrono::duration<double, std::nano>(treapTime).count() / updates << " ns\n";
+    std::cout << versions.size() << " versions: " << shared / 1048576.0 << " MB shared, "
+              << versions.size() * single / 1048576.0 << " MB as full copies, "
+              << (shared - single) / PersistentTreapSet<int>::nodeBytes / updates << " new nodes per update (log2 n = "
+              << std::log2(size) << ")\n";
+
+    // Читатели проверяют свою версию, пока писатель меняет текущую
+    const int readersCount = 4;
+    std::vector<long long> expected(readersCount);
+    std::vector<PersistentTreapSet<int>> readerVersions;
+    for (int r = 0; r < readersCount; ++r) {
+        for (int key : persistent.getAsVector()) {
+            expected[r] += key;
+        }
+        readerVersions.push_back(persistent.snapshot());
+        persistent.addElement(-1 - r);
+    }
+    std::atomic<bool> running{true};
+    std::atomic<int> mismatches{0};
+    std::atomic<long long> lookups{0}, hits{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < readersCount; ++r) {
+        readers.emplace_back([&, r] {
+            const PersistentTreapSet<int>& version = readerVersions[r];
+            std::mt19937 readerRng(r);
+            long long count = 0, found = 0;
+            while (running.load(std::memory_order_relaxed)) {
+                long long sum = 0;
+                for (SetReader<int> reader(version); reader.valid(); reader.advance()) {
+                    sum += reader.current();
+                }
+                mismatches += sum != expected[r] || version.containsElement(-1 - r);
+                for (int i = 0; i < 100000; ++i) {
+                    found += version.containsElement(static_cast<int>(readerRng() % (4u * size)));
+                }
+                count += 100000;
+            }
+            lookups += count;
+            hits += found;
+        });
+    }
+    int writes = 0;
+    start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500)) {
+        int key = static_cast<int>(rng() % (4u * size));
+        persistent.addElement(key);
+        persistent.removeElement(key ^ 1);
+        writes += 2;
+    }
+    running.store(false);
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    lookupHits += hits.load();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << readersCount << " readers on old versions: " << lookups.load() / elapsed.count() / 1e6
+              << " M lookups/sec, writer " << writes / elapsed.count() / 1e6 << " M updates/sec, "
+              << mismatches.load() << " changed versions\n";
+
+    std::cout << "SnapshotSet update: sorted array " << measureSnapshotUpdates<SortedArraySet<int>>(data, 100) / 1000
+              << " us, persistent treap " << measureSnapshotUpdates<PersistentTreapSet<int>>(data, 100000) / 1000 << " us\n";
+}
+
+// Распределения ключей для замеров настройки
+enum KeyDistribution {KEYS_UNIFORM, KEYS_DENSE, KEYS_CLUSTERED};
+
+const char* distributionName(KeyDistribution distribution) {
+    switch (distribution) {
+        case KEYS_UNIFORM: return "uniform";
+        case KEYS_DENSE: return "dense";
+        case KEYS_CLUSTERED: return "clustered";
+    }
+    return "unknown";
+}
+
+// Смесь операций: доля поисков в процентах, остальное - обновления
+// (добавление нового элемента и удаление старого, размер не меняется)
+struct TuningMix {
+    const char* name;
+    int lookupPercent;
+};
+
+constexpr TuningMix tuningMixes[] = {{"lookup", 100}, {"read-mostly", 90}, {"balanced", 50}, {"update", 0}};
+
+struct TuningMeasurement {
+    SetBackend backend;
+    KeyDistribution distribution;
+    const char* mix;
+    int size;
+    double meanNs;
+    // 99-й перцентиль среднего времени операции по пачкам из tuningBatch операций:
+    // часы на каждую операцию стоили бы дороже самого поиска
+    double p99Ns;
+    double opsPerSecond;
+    double bytesPerElement;
+    double scanNsPerElement;
 };
 
-int main() {
-    ArraySet<int> arraySet;
-    Set<int> set1(&arraySet, 4);
+constexpr int tuningBatch = 64;
+
+// count различных ключей в случайном порядке. Первые size станут элементами
+// множества, остальные - запас для добавлений и промахов поиска
+template <typename T>
+std::vector<T> tuningKeys(KeyDistribution distribution, int count, std::mt19937_64& rng) {
+    std::vector<T> keys;
+    keys.reserve(count);
+    if (distribution == KEYS_DENSE) {
+        for (int i = 0; i < count; ++i) {
+            keys.push_back(static_cast<T>(i));
+        }
+    } else {
+        std::unordered_set<long long> seen;
+        while (static_cast<int>(keys.size()) < count) {
+            long long base = static_cast<long long>(rng() % 2000000000);
+            int run = distribution == KEYS_CLUSTERED ? 64 : 1;
+            for (int i = 0; i < run && static_cast<int>(keys.size()) < count; ++i) {
+                if (seen.insert(base + i).second) {
+                    keys.push_back(static_cast<T>(base + i));
+                }
+            }
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+template <typename T>
+TuningMeasurement measureTuning(SetBackend backend, const std::vector<T>& keys, int size, const TuningMix& mix,
+                                int operations, std::mt19937_64& rng) {
+    std::unique_ptr<SetImplementation<T>> set = Set<T>::createImplementation(backend);
+    std::vector<T> members(keys.begin(), keys.begin() + size);
+    std::vector<T> spare(keys.begin() + size, keys.end());
+    std::vector<T> data = members;
+    set->fillFromVector(data);
+    double bytesPerElement = double(set->memoryUsage()) / size;
+
+    // Случайные числа готовятся заранее, чтобы генератор не попал в замер
+    std::vector<uint64_t> plan(operations);
+    for (uint64_t& step : plan) {
+        step = rng();
+    }
+    std::vector<double> batchNs;
+    long long found = 0;
+    long long done = 0;
+    auto total = std::chrono::steady_clock::duration::zero();
+    for (int begin = 0; begin < operations; begin += tuningBatch) {
+        int end = std::min(operations, begin + tuningBatch);
+        int batchOperations = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = begin; i < end; ++i) {
+            uint64_t step = plan[i];
+            size_t member = (step >> 8) % size;
+            size_t candidate = (step >> 36) % spare.size();
+            if (static_cast<int>(step % 100) < mix.lookupPercent) {
+                found += set->containsElement((step & 128) ? members[member] : spare[candidate]);
+                batchOperations += 1;
+            } else {
+                set->addElement(spare[candidate]);
+                set->removeElement(members[member]);
+                std::swap(members[member], spare[candidate]);
+                batchOperations += 2;
+            }
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        total += elapsed;
+        done += batchOperations;
+        batchNs.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / batchOperations);
+    }
+    std::sort(batchNs.begin(), batchNs.end());
+
+    auto start = std::chrono::steady_clock::now();
+    for (SetReader<T> reader(*set); reader.valid(); reader.advance()) {
+        found += reader.current() == T();
+    }
+    std::chrono::duration<double, std::nano> scanTime = std::chrono::steady_clock::now() - start;
+    lookupHits += found;
+
+    double meanNs = std::chrono::duration<double, std::nano>(total).count() / done;
+    return {backend, KEYS_UNIFORM, mix.name, size, meanNs, batchNs[batchNs.size() * 99 / 100],
+            1e9 / meanNs, bytesPerElement, scanTime.count() / size};
+}
+
+// Замер повторяется tuningRepeats раз, берётся медиана по среднему времени и
+// отдельно по времени обхода: постоянные модели считаются разностями замеров,
+// и выброс одного прогона давал в них нули
+constexpr int tuningRepeats = 5;
+
+template <typename T>
+TuningMeasurement measureTuningMedian(SetBackend backend, const std::vector<T>& keys, int size, const TuningMix& mix,
+                                      int operations, std::mt19937_64& rng) {
+    std::vector<TuningMeasurement> runs;
+    std::vector<double> scanNs;
+    for (int i = 0; i < tuningRepeats; ++i) {
+        runs.push_back(measureTuning(backend, keys, size, mix, operations, rng));
+        scanNs.push_back(runs.back().scanNsPerElement);
+    }
+    std::sort(runs.begin(), runs.end(),
+              [](const TuningMeasurement& a, const TuningMeasurement& b) {return a.meanNs < b.meanNs;});
+    std::sort(scanNs.begin(), scanNs.end());
+    TuningMeasurement result = runs[tuningRepeats / 2];
+    result.scanNsPerElement = scanNs[tuningRepeats / 2];
+    return result;
+}
+
+// Перебор размеров, распределений ключей и смесей операций по всем реализациям.
+// Замеры пишутся в report строками CSV, рекомендуемые пороги - в std::cout.
+// Возвращает постоянные модели стоимости для T, подобранные по замерам
+template <typename T>
+SetCostConstants runSetTuning(std::ostream& report, int operations) {
+    // Массив с линейным поиском дальше этого размера заведомо проигрывает
+    constexpr int arrayLimit = 4096;
+    // Постоянные подбираются на размере, где измерены все реализации
+    constexpr int fitSize = arrayLimit;
+    const std::string type = SetTuning::typeName<T>();
+    std::vector<SetBackend> backends = {SET_ARRAY, SET_TREAP, SET_SORTED_ARRAY, SET_HASH, SET_PERSISTENT_TREAP};
+    if constexpr (std::is_integral_v<T>) {
+        backends.push_back(SET_BITMAP);
+    }
+    std::vector<int> sizes = {4, 8, 16, 32, 64, 128, 256, 512, 1024, arrayLimit, 1 << 16, 1 << 18};
+
+    std::mt19937_64 rng(45);
+    std::vector<TuningMeasurement> results;
+    std::cout << "\nset tuning, " << type << "\n";
+    for (KeyDistribution distribution : {KEYS_UNIFORM, KEYS_DENSE, KEYS_CLUSTERED}) {
+        for (int size : sizes) {
+            std::vector<T> keys = tuningKeys<T>(distribution, 2 * size, rng);
+            for (const TuningMix& mix : tuningMixes) {
+                for (SetBackend backend : backends) {
+                    if (backend == SET_ARRAY && size > arrayLimit) {
+                        continue;
+                    }
+                    TuningMeasurement result = measureTuningMedian(backend, keys, size, mix, operations, rng);
+                    result.distribution = distribution;
+                    results.push_back(result);
+                    report << type << "," << backendName(backend) << "," << distributionName(distribution) << ","
+                           << mix.name << "," << size << "," << result.meanNs << "," << result.p99Ns << ","
+                           << result.opsPerSecond << "," << result.bytesPerElement << "," << result.scanNsPerElement << "\n";
+                }
+            }
+        }
+
+        // Рекомендация: самая быстрая реализация на каждом размере, соседние
+        // размеры с одинаковым победителем сливаются в диапазон
+        for (const TuningMix& mix : tuningMixes) {
+            std::cout << "  " << distributionName(distribution) << ", " << mix.name << ":";
+            SetBackend previous = SET_ARRAY;
+            int rangeStart = 0;
+            for (size_t i = 0; i <= sizes.size(); ++i) {
+                SetBackend best = previous;
+                if (i < sizes.size()) {
+                    double bestNs = 0;
+                    for (const TuningMeasurement& result : results) {
+                        if (result.distribution == distribution && result.mix == mix.name && result.size == sizes[i] &&
+                            (bestNs == 0 || result.meanNs < bestNs)) {
+                            bestNs = result.meanNs;
+                            best = result.backend;
+                        }
+                    }
+                }
+                if (i > 0 && (i == sizes.size() || best != previous)) {
+                    std::cout << " " << backendName(previous) << " " << sizes[rangeStart] << ".." << sizes[i - 1] << ";";
+                    rangeStart = static_cast<int>(i);
+                }
+                previous = best;
+            }
+            std::cout << "\n";
+        }
+    }
+
+    auto find = [&results](SetBackend backend, const char* mix, int size,
+                           KeyDistribution distribution = KEYS_UNIFORM) -> const TuningMeasurement& {
+        for (const TuningMeasurement& result : results) {
+            if (result.backend == backend && result.distribution == distribution && result.mix == mix && result.size == size) {
+                return result;
+            }
+        }
+        throw std::logic_error("no tuning measurement");
+    };
+    double depth = std::log2(fitSize + 1);
+    SetCostConstants constants;
+    constants.arrayPerElement = find(SET_ARRAY, "lookup", fitSize).meanNs / (fitSize / 2);
+    constants.arrayScanPerElement = find(SET_ARRAY, "lookup", fitSize).scanNsPerElement;
+    constants.sortedPerLevel = find(SET_SORTED_ARRAY, "lookup", fitSize).meanNs / depth;
+    constants.arrayMovePerElement = std::max(0.0, (find(SET_SORTED_ARRAY, "update", fitSize).meanNs -
+                                                   constants.sortedPerLevel * depth) / (fitSize / 2));
+    constants.hashLookup = find(SET_HASH, "lookup", fitSize).meanNs;
+    constants.hashInsert = std::max(0.0, find(SET_HASH, "update", fitSize).meanNs - constants.hashLookup);
+    constants.hashScanPerElement = find(SET_HASH, "lookup", fitSize).scanNsPerElement;
+    constants.treapPerLevel = find(SET_TREAP, "lookup", fitSize).meanNs / depth;
+    constants.treapAllocation = std::max(0.0, find(SET_TREAP, "update", fitSize).meanNs - 2 * constants.treapPerLevel * depth);
+    constants.treapScanPerElement = find(SET_TREAP, "lookup", fitSize).scanNsPerElement;
+    // Разреженные ключи - худший случай битовой карты (кусок на элемент), её
+    // постоянные берутся по плотным ключам и на размере, где куски уже битовые
+    if constexpr (std::is_integral_v<T>) {
+        constexpr int bitmapFitSize = 1 << 16;
+        constants.bitmapLookup = find(SET_BITMAP, "lookup", bitmapFitSize, KEYS_DENSE).meanNs;
+        constants.bitmapInsert = find(SET_BITMAP, "update", bitmapFitSize, KEYS_DENSE).meanNs;
+        constants.bitmapScanPerElement = find(SET_BITMAP, "lookup", bitmapFitSize, KEYS_DENSE).scanNsPerElement;
+    }
+
+    // Порог: размер, начиная с которого при одних поисках массив больше не быстрее всех.
+    // Одиночный проигрыш на малом размере бывает шумом, поэтому порог - первый
+    // размер, где массив проигрывает и на нём, и на следующем. За arrayLimit массив
+    // не измеряется и считается проигравшим
+    std::vector<bool> beaten;
+    for (int size : sizes) {
+        bool lost = size > arrayLimit;
+        if (!lost) {
+            double arrayNs = find(SET_ARRAY, "lookup", size).meanNs;
+            for (SetBackend backend : backends) {
+                lost = lost || (backend != SET_ARRAY && find(backend, "lookup", size).meanNs < arrayNs);
+            }
+        }
+        beaten.push_back(lost);
+    }
+    constants.crossoverSize = sizes.back();
+    for (size_t i = 0; i + 1 < sizes.size(); ++i) {
+        if (beaten[i] && beaten[i + 1]) {
+            constants.crossoverSize = sizes[i];
+            break;
+        }
+    }
+    constants = SetTuning::plausible(constants);
+    std::cout << "  crossover " << constants.crossoverSize << ", array " << constants.arrayPerElement
+              << " ns/element, treap " << constants.treapPerLevel << " ns/level, hash " << constants.hashLookup << " ns\n";
+    return constants;
+}
+
+int main(int argc, char* argv[]) {
+    // С ключом --tune программа только делает замеры и пишет профиль. Без ключа
+    // профиль, если он есть, загружается до создания первого множества
+    const char* profilePath = "set_tuning.txt";
+    if (argc > 1 && std::string(argv[1]) == "--tune") {
+        std::ofstream report("set_benchmark.csv");
+        report << "type,backend,distribution,mix,size,mean_ns,p99_ns,ops_per_second,bytes_per_element,scan_ns_per_element\n";
+        SetTuning::setConstants(SetTuning::typeName<int>(), runSetTuning<int>(report, 20000));
+        SetTuning::setConstants(SetTuning::typeName<double>(), runSetTuning<double>(report, 20000));
+        std::ofstream profile(profilePath);
+        SetTuning::save(profile);
+        std::cout << "profile written to " << profilePath << ", measurements to set_benchmark.csv\n";
+        return 0;
+    }
+    if (SetTuning::loadFile(profilePath)) {
+        std::cout << "tuning profile loaded from " << profilePath << "\n";
+    }
+
+    Set<int> set1(new ArraySet<int>, 4);
 
     set1.addElement(5);
     set1.addElement(10);
@@ -377,8 +4415,7 @@ int main() {
     set1.addElement(228);
     set1.addElement(345);
     
-    ArraySet<int> ArraySet2;
-    Set<int> set2(&ArraySet2, 10);
+    Set<int> set2(new ArraySet<int>, 10);
     set2.addElement(345);
     set2.addElement(228);
     set2.addElement(985);
@@ -388,5 +4425,17 @@ int main() {
     std::cout<<"is 1230 in set1 union set2? "<<set12.containsElement(1230)<<"\n";
     std::cout<<"is 345 in set1 intersect set2? "<<set1_2.containsElement(345)<<"\n";
     std::cout<<"is 1230 in set1 intersect set2? "<<set1_2.containsElement(1230)<<"\n";
+
+    benchmarkThresholdOscillation(64, 200000);
+    benchmarkSortedLookups();
+    benchmarkHashSet(1000000);
+    benchmarkBitmapSet(1000000);
+    benchmarkMergeAlgebra();
+    benchmarkTreapParallel(10000000);
+    benchmarkTreapPool(1000000);
+    benchmarkConcurrentSets();
+    benchmarkBatchOperations();
+    benchmarkStaticDispatch();
+    benchmarkPersistentTreap(1000000);
     return 0;
 }
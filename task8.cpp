@@ -2,25 +2,440 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <vector>
+#include <cstdint>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <span>
+#include <stdexcept>
+#include <functional>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+
+class Expression;
+
+// Выражение, скомпилированное в плоский постфиксный код. Операнды кладутся
+// на стек, операция снимает два верхних значения и кладёт результат. Если
+// правый операнд - константа или переменная, операция берёт его прямо из
+// команды, как в регистровой форме, и команд становится почти вдвое меньше.
+// Узел, на который в выражении несколько ссылок (DAG из ExpressionFactory),
+// вычисляется один раз: его значение сохраняется в ячейку памяти (OP_STORE),
+// а остальные ссылки становятся её чтением (OP_LOAD). Набор выражений
+// компилируется в одну программу, и общие узлы разных выражений тоже
+// вычисляются один раз; значение каждого выражения пишет OP_RESULT.
+// Вычисление - один цикл по командам без рекурсии и без выделения памяти:
+// стек нужной глубины заводится при компиляции. Поэтому одну программу
+// нельзя вычислять из нескольких потоков одновременно, кроме evaluateBatch
+class ExpressionProgram {
+public:
+    enum OpCode : std::uint8_t {
+        OP_CONSTANT, OP_VARIABLE,
+        OP_ADD, OP_SUBTRACT, OP_MULTIPLY,
+        OP_ADD_CONSTANT, OP_SUBTRACT_CONSTANT, OP_MULTIPLY_CONSTANT,
+        OP_ADD_VARIABLE, OP_SUBTRACT_VARIABLE, OP_MULTIPLY_VARIABLE,
+        OP_LOAD, OP_STORE, OP_RESULT
+    };
+
+    struct Instruction {
+        OpCode op;
+        int operand;
+    };
+
+    static ExpressionProgram compile(const Expression& expression);
+    static ExpressionProgram compile(std::span<const Expression* const> expressions);
+
+    // Через эти методы узлы выражения выдают свой код
+    void emitConstant(int value) {
+        push({OP_CONSTANT, value});
+    }
+    // Операнд команды - номер ячейки переменной, который выдала фабрика
+    void emitVariable(const std::string& name, int slot) {
+        if (std::find(variables.begin(), variables.end(), std::make_pair(name, slot)) == variables.end()) {
+            variables.push_back({name, slot});
+            slotsCount = std::max(slotsCount, slot + 1);
+        }
+        push({OP_VARIABLE, slot});
+    }
+    // Составной узел вызывает reuse до своего кода и remember после него.
+    // reuse возвращает true, если код узла выдавать не нужно: при подсчёте
+    // ссылок узел уже встречался, а при выдаче кода его значение уже в памяти
+    bool reuse(const Expression* node) {
+        if (counting) {
+            return ++uses[node] > 1;
+        }
+        auto it = memoSlots.find(node);
+        if (it == memoSlots.end()) {
+            return false;
+        }
+        push({OP_LOAD, it->second});
+        return true;
+    }
+    void remember(const Expression* node) {
+        if (!counting && uses[node] > 1) {
+            memoSlots[node] = memoCount;
+            code.push_back({OP_STORE, memoCount++});
+        }
+    }
+    // op - OP_ADD, OP_SUBTRACT или OP_MULTIPLY. Правый операнд выдан последним,
+    // и если это лист, он сливается с операцией
+    void emitOperation(OpCode op) {
+        if (counting) {
+            return;
+        }
+        Instruction& last = code.back();
+        if (last.op == OP_CONSTANT) {
+            last.op = static_cast<OpCode>(op - OP_ADD + OP_ADD_CONSTANT);
+        } else if (last.op == OP_VARIABLE) {
+            last.op = static_cast<OpCode>(op - OP_ADD + OP_ADD_VARIABLE);
+        } else {
+            code.push_back({op, 0});
+        }
+        depth--;
+    }
+
+    // Переменные ищутся в контексте по одному разу за вычисление, а не на
+    // каждое вхождение в выражение
+    int evaluate(const std::map<std::string, int>& context) {
+        for (const auto& [name, slot] : variables) {
+            values[slot] = context.at(name);
+        }
+        run(values.data(), outputs.data());
+        return outputs[0];
+    }
+
+    // Контекст по ячейкам (ExpressionFactory::bind): значения читаются
+    // прямо из массива, строки не сравниваются вовсе
+    int evaluate(std::span<const int> slots) {
+        if (slots.size() < static_cast<size_t>(slotsCount)) {
+            throw std::out_of_range("context has fewer slots than the expression uses");
+        }
+        run(slots.data(), outputs.data());
+        return outputs[0];
+    }
+
+    // Значения всех выражений набора, в порядке компиляции
+    void evaluate(std::span<const int> slots, std::span<int> results) {
+        if (slots.size() < static_cast<size_t>(slotsCount) || results.size() < static_cast<size_t>(outputsCount)) {
+            throw std::out_of_range("context has fewer slots than the expression uses");
+        }
+        run(slots.data(), results.data());
+    }
+
+    // Пакетное вычисление по столбцам: columns[slot] - значения переменной
+    // с этой ячейкой во всех контекстах (для ячеек, которых нет в выражении,
+    // можно передать nullptr). results - столбцы значений выражений набора
+    // подряд, так что контекстов results.size() / outputsCount (остаток от деления - ошибка).
+    // Контексты идут блоками по blockSize,
+    // и каждая команда - цикл по целому блоку, который компилятор векторизует.
+    // Блоки делятся между threads потоками, у каждого свой стек блоков
+    void evaluateBatch(std::span<const int* const> columns, std::span<int> results, int threads = 1) const {
+        if (columns.size() < static_cast<size_t>(slotsCount)) {
+            throw std::out_of_range("fewer columns than the expression uses");
+        }
+        for (const auto& [name, slot] : variables) {
+            if (columns[slot] == nullptr) {
+                throw std::invalid_argument("no column for variable " + name);
+            }
+        }
+        if (results.size() % outputsCount != 0) {
+            throw std::out_of_range("results do not hold a whole number of contexts");
+        }
+        if (threads < 1) {
+            throw std::invalid_argument("at least one thread is required");
+        }
+        size_t contexts = results.size() / outputsCount;
+        size_t blocks = (contexts + blockSize - 1) / blockSize;
+        threads = static_cast<int>(std::min<size_t>(threads, std::max<size_t>(blocks, 1)));
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; t++) {
+            workers.emplace_back([this, columns, results, contexts, t, threads, blocks] {
+                evaluateBlocks(columns, results, contexts, blocks * t / threads * blockSize, blocks * (t + 1) / threads * blockSize);
+            });
+        }
+        evaluateBlocks(columns, results, contexts, 0, blocks / threads * blockSize);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return code.size();
+    }
+    int getOutputsCount() const {
+        return outputsCount;
+    }
+
+private:
+    std::vector<Instruction> code;
+    std::vector<std::pair<std::string, int>> variables;
+    std::vector<int> values;
+    int slotsCount = 0;
+    std::vector<int> stack;
+    int depth = 0;
+    int maxDepth = 0;
+    // Ссылки на составные узлы считаются первым проходом компиляции
+    bool counting = false;
+    std::map<const Expression*, int> uses;
+    std::map<const Expression*, int> memoSlots;
+    std::vector<int> memo;
+    int memoCount = 0;
+    std::vector<int> outputs;
+    int outputsCount = 0;
+
+    // Значение выражения снимается со стека в results[номер выражения]
+    void emitResult() {
+        code.push_back({OP_RESULT, outputsCount++});
+        depth--;
+    }
+
+    static constexpr size_t blockSize = 256;
+
+    // Циклы постоянной длины по блокам, которые не пересекаются, -
+    // компилятор развернёт их в векторные команды
+    template <typename Operation>
+    static void combineBlocks(int* __restrict target, const int* __restrict source, Operation operation) {
+        for (size_t i = 0; i < blockSize; i++) {
+            target[i] = operation(target[i], source[i]);
+        }
+    }
+
+    template <typename Operation>
+    static void combineConstant(int* __restrict target, int value, Operation operation) {
+        for (size_t i = 0; i < blockSize; i++) {
+            target[i] = operation(target[i], value);
+        }
+    }
+
+    // Значения переменной для блока: в полном блоке - прямо из столбца,
+    // в последнем неполном - копия, дополненная нулями
+    static const int* variableBlock(const int* column, size_t base, size_t lanes, int* scratch) {
+        if (lanes == blockSize) {
+            return column + base;
+        }
+        std::copy(column + base, column + base + lanes, scratch);
+        std::fill(scratch + lanes, scratch + blockSize, 0);
+        return scratch;
+    }
+
+    void evaluateBlocks(std::span<const int* const> columns, std::span<int> results, size_t contexts, size_t begin, size_t end) const {
+        end = std::min(end, contexts);
+        std::vector<int> stackBlocks(maxDepth * blockSize);
+        std::vector<int> memoBlocks(memoCount * blockSize);
+        std::vector<int> scratch(blockSize);
+        for (size_t base = begin; base < end; base += blockSize) {
+            size_t lanes = std::min(blockSize, end - base);
+            int* top = stackBlocks.data();
+            for (const Instruction& instruction : code) {
+                switch (instruction.op) {
+                    case OP_CONSTANT:
+                        std::fill(top, top + blockSize, instruction.operand);
+                        top += blockSize;
+                        break;
+                    case OP_VARIABLE: {
+                        const int* values = variableBlock(columns[instruction.operand], base, lanes, scratch.data());
+                        std::copy(values, values + blockSize, top);
+                        top += blockSize;
+                        break;
+                    }
+                    case OP_ADD:
+                        top -= blockSize;
+                        combineBlocks(top - blockSize, top, std::plus<int>());
+                        break;
+                    case OP_SUBTRACT:
+                        top -= blockSize;
+                        combineBlocks(top - blockSize, top, std::minus<int>());
+                        break;
+                    case OP_MULTIPLY:
+                        top -= blockSize;
+                        combineBlocks(top - blockSize, top, std::multiplies<int>());
+                        break;
+                    case OP_ADD_CONSTANT:
+                        combineConstant(top - blockSize, instruction.operand, std::plus<int>());
+                        break;
+                    case OP_SUBTRACT_CONSTANT:
+                        combineConstant(top - blockSize, instruction.operand, std::minus<int>());
+                        break;
+                    case OP_MULTIPLY_CONSTANT:
+                        combineConstant(top - blockSize, instruction.operand, std::multiplies<int>());
+                        break;
+                    case OP_ADD_VARIABLE:
+                        combineBlocks(top - blockSize, variableBlock(columns[instruction.operand], base, lanes, scratch.data()), std::plus<int>());
+                        break;
+                    case OP_SUBTRACT_VARIABLE:
+                        combineBlocks(top - blockSize, variableBlock(columns[instruction.operand], base, lanes, scratch.data()), std::minus<int>());
+                        break;
+                    case OP_MULTIPLY_VARIABLE:
+                        combineBlocks(top - blockSize, variableBlock(columns[instruction.operand], base, lanes, scratch.data()), std::multiplies<int>());
+                        break;
+                    case OP_LOAD:
+                        std::copy_n(memoBlocks.data() + instruction.operand * blockSize, blockSize, top);
+                        top += blockSize;
+                        break;
+                    case OP_STORE:
+                        std::copy_n(top - blockSize, blockSize, memoBlocks.data() + instruction.operand * blockSize);
+                        break;
+                    case OP_RESULT:
+                        top -= blockSize;
+                        std::copy_n(top, lanes, results.begin() + instruction.operand * contexts + base);
+                        break;
+                }
+            }
+        }
+    }
+
+    // При подсчёте ссылок код не нужен
+    void push(Instruction instruction) {
+        if (counting) {
+            return;
+        }
+        code.push_back(instruction);
+        maxDepth = std::max(maxDepth, ++depth);
+    }
+
+    // С GCC и Clang переход к следующей команде - computed goto: у каждой команды
+    // своя точка косвенного перехода, и предсказатель различает их. Иначе switch
+    void run(const int* variableValues, int* resultValues) {
+        int* top = stack.data();
+        int* memoValues = memo.data();
+        const Instruction* instruction = code.data();
+        const Instruction* end = instruction + code.size();
+#if defined(__GNUC__)
+        static void* const labels[] = {
+            &&constant, &&variable, &&add, &&subtract, &&multiply,
+            &&addConstant, &&subtractConstant, &&multiplyConstant,
+            &&addVariable, &&subtractVariable, &&multiplyVariable,
+            &&load, &&store, &&result
+        };
+#define DISPATCH() if (instruction == end) return; goto *labels[instruction->op]
+#define NEXT() ++instruction; DISPATCH()
+        DISPATCH();
+    constant:
+        *top++ = instruction->operand;
+        NEXT();
+    variable:
+        *top++ = variableValues[instruction->operand];
+        NEXT();
+    add:
+        --top;
+        top[-1] += *top;
+        NEXT();
+    subtract:
+        --top;
+        top[-1] -= *top;
+        NEXT();
+    multiply:
+        --top;
+        top[-1] *= *top;
+        NEXT();
+    addConstant:
+        top[-1] += instruction->operand;
+        NEXT();
+    subtractConstant:
+        top[-1] -= instruction->operand;
+        NEXT();
+    multiplyConstant:
+        top[-1] *= instruction->operand;
+        NEXT();
+    addVariable:
+        top[-1] += variableValues[instruction->operand];
+        NEXT();
+    subtractVariable:
+        top[-1] -= variableValues[instruction->operand];
+        NEXT();
+    multiplyVariable:
+        top[-1] *= variableValues[instruction->operand];
+        NEXT();
+    load:
+        *top++ = memoValues[instruction->operand];
+        NEXT();
+    store:
+        memoValues[instruction->operand] = top[-1];
+        NEXT();
+    result:
+        resultValues[instruction->operand] = *--top;
+        NEXT();
+#undef NEXT
+#undef DISPATCH
+#else
+        for (; instruction != end; ++instruction) {
+            switch (instruction->op) {
+                case OP_CONSTANT:
+                    *top++ = instruction->operand;
+                    break;
+                case OP_VARIABLE:
+                    *top++ = variableValues[instruction->operand];
+                    break;
+                case OP_ADD:
+                    --top;
+                    top[-1] += *top;
+                    break;
+                case OP_SUBTRACT:
+                    --top;
+                    top[-1] -= *top;
+                    break;
+                case OP_MULTIPLY:
+                    --top;
+                    top[-1] *= *top;
+                    break;
+                case OP_ADD_CONSTANT:
+                    top[-1] += instruction->operand;
+                    break;
+                case OP_SUBTRACT_CONSTANT:
+                    top[-1] -= instruction->operand;
+                    break;
+                case OP_MULTIPLY_CONSTANT:
+                    top[-1] *= instruction->operand;
+                    break;
+                case OP_ADD_VARIABLE:
+                    top[-1] += variableValues[instruction->operand];
+                    break;
+                case OP_SUBTRACT_VARIABLE:
+                    top[-1] -= variableValues[instruction->operand];
+                    break;
+                case OP_MULTIPLY_VARIABLE:
+                    top[-1] *= variableValues[instruction->operand];
+                    break;
+                case OP_LOAD:
+                    *top++ = memoValues[instruction->operand];
+                    break;
+                case OP_STORE:
+                    memoValues[instruction->operand] = top[-1];
+                    break;
+                case OP_RESULT:
+                    resultValues[instruction->operand] = *--top;
+                    break;
+            }
+        }
+#endif
+    }
+};
 
 // Базовый класс выражения
 class Expression {
 public:
     virtual void print() const = 0;
     virtual int calculate(const std::map<std::string, int>& context) const = 0;
+    // Значения переменных берутся по номерам ячеек, см. ExpressionFactory::bind
+    virtual int calculate(std::span<const int> slots) const = 0;
+    // Выдаёт в программу постфиксный код выражения
+    virtual void compile(ExpressionProgram& program) const = 0;
     virtual ~Expression() {};
 };
 
-// Класс для оператора сложения
+// Класс для оператора сложения. Узел владеет операндами через shared_ptr:
+// листья фабрики разделяются между выражениями, а узел, переданный сырым
+// указателем, переходит во владение нового узла
 class Addition : public Expression {
 private:
-    Expression* left;
-    Expression* right;
+    std::shared_ptr<Expression> left;
+    std::shared_ptr<Expression> right;
 
 public:
-    Addition(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(&*l), right(&*r) {}
-    Addition(Expression* l, std::shared_ptr<Expression> r) : left(l), right(&*r) {}
-    Addition(std::shared_ptr<Expression> l, Expression* r) : left(&*l), right(r) {}
+    Addition(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(std::move(l)), right(std::move(r)) {}
+    Addition(Expression* l, std::shared_ptr<Expression> r) : left(l), right(std::move(r)) {}
+    Addition(std::shared_ptr<Expression> l, Expression* r) : left(std::move(l)), right(r) {}
     Addition(Expression* l, Expression* r) : left(l), right(r) {}
 
     void print() const override {
@@ -35,22 +450,30 @@ public:
         return left->calculate(context) + right->calculate(context);
     }
 
-    ~Addition()
-    {
-        delete left;
-        delete right;
+    int calculate(std::span<const int> slots) const override {
+        return left->calculate(slots) + right->calculate(slots);
+    }
+
+    void compile(ExpressionProgram& program) const override {
+        if (program.reuse(this)) {
+            return;
+        }
+        left->compile(program);
+        right->compile(program);
+        program.emitOperation(ExpressionProgram::OP_ADD);
+        program.remember(this);
     }
 };
 
 class Subtraction : public Expression {
 private:
-    Expression* left;
-    Expression* right;
+    std::shared_ptr<Expression> left;
+    std::shared_ptr<Expression> right;
 
 public:
-    Subtraction(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(&*l), right(&*r) {}
-    Subtraction(Expression* l, std::shared_ptr<Expression> r) : left(l), right(&*r) {}
-    Subtraction(std::shared_ptr<Expression> l, Expression* r) : left(&*l), right(r) {}
+    Subtraction(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(std::move(l)), right(std::move(r)) {}
+    Subtraction(Expression* l, std::shared_ptr<Expression> r) : left(l), right(std::move(r)) {}
+    Subtraction(std::shared_ptr<Expression> l, Expression* r) : left(std::move(l)), right(r) {}
     Subtraction(Expression* l, Expression* r) : left(l), right(r) {}
 
     void print() const override {
@@ -65,22 +488,30 @@ public:
         return left->calculate(context) - right->calculate(context);
     }
 
-    ~Subtraction()
-    {
-        delete left;
-        delete right;
+    int calculate(std::span<const int> slots) const override {
+        return left->calculate(slots) - right->calculate(slots);
+    }
+
+    void compile(ExpressionProgram& program) const override {
+        if (program.reuse(this)) {
+            return;
+        }
+        left->compile(program);
+        right->compile(program);
+        program.emitOperation(ExpressionProgram::OP_SUBTRACT);
+        program.remember(this);
     }
 };
 
 class Multiplication : public Expression {
 private:
-    Expression* left;
-    Expression* right;
+    std::shared_ptr<Expression> left;
+    std::shared_ptr<Expression> right;
 
 public:
-    Multiplication(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(&*l), right(&*r) {}
-    Multiplication(Expression* l, std::shared_ptr<Expression> r) : left(l), right(&*r) {}
-    Multiplication(std::shared_ptr<Expression> l, Expression* r) : left(&*l), right(r) {}
+    Multiplication(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) : left(std::move(l)), right(std::move(r)) {}
+    Multiplication(Expression* l, std::shared_ptr<Expression> r) : left(l), right(std::move(r)) {}
+    Multiplication(std::shared_ptr<Expression> l, Expression* r) : left(std::move(l)), right(r) {}
     Multiplication(Expression* l, Expression* r) : left(l), right(r) {}
 
     void print() const override {
@@ -95,12 +526,19 @@ public:
         return left->calculate(context) * right->calculate(context);
     }
 
-    ~Multiplication()
-    {
-        delete left;
-        delete right;
+    int calculate(std::span<const int> slots) const override {
+        return left->calculate(slots) * right->calculate(slots);
     }
 
+    void compile(ExpressionProgram& program) const override {
+        if (program.reuse(this)) {
+            return;
+        }
+        left->compile(program);
+        right->compile(program);
+        program.emitOperation(ExpressionProgram::OP_MULTIPLY);
+        program.remember(this);
+    }
 };
 
 // Класс для константы
@@ -118,15 +556,25 @@ public:
     int calculate(const std::map<std::string, int>& context) const override {
         return value;
     }
+
+    int calculate(std::span<const int>) const override {
+        return value;
+    }
+
+    void compile(ExpressionProgram& program) const override {
+        program.emitConstant(value);
+    }
 };
 
 // Класс для переменной
 class Variable : public Expression {
 private:
     std::string name;
+    int slot;
 
 public:
-    Variable(const std::string& n) : name(n) {}
+    // Номер ячейки выдаёт ExpressionFactory: номера плотные, от нуля
+    Variable(const std::string& n, int slot) : name(n), slot(slot) {}
 
     void print() const override {
         std::cout << name;
@@ -135,6 +583,22 @@ public:
     int calculate(const std::map<std::string, int>& context) const override {
         return context.at(name);
     }
+
+    // Вектор из bind() устаревает, если фабрика потом создала новые переменные
+    int calculate(std::span<const int> slots) const override {
+        if (static_cast<size_t>(slot) >= slots.size()) {
+            throw std::out_of_range("no slot for variable " + name);
+        }
+        return slots[slot];
+    }
+
+    int getSlot() const {
+        return slot;
+    }
+
+    void compile(ExpressionProgram& program) const override {
+        program.emitVariable(name, slot);
+    }
 };
 
 
@@ -165,7 +629,7 @@ public:
     {
         Variables::const_iterator it = mVariables.find( name );
         if ( mVariables.end() == it ) {
-             mVariables[name] = std::make_shared<Variable>(name);
+             mVariables[name] = std::make_shared<Variable>(name, static_cast<int>(mVariables.size()));
              std::cout<<"creating Variable with name: "<<name<<" | new one created\n";
             return mVariables[name] ;
         } else {
@@ -174,14 +638,474 @@ public:
         }
     }
 
+    // Составные узлы тоже интернируются по операции и узлам-операндам:
+    // одинаковые подвыражения становятся одним узлом, выражения - DAG
+    std::shared_ptr<Expression> createAddition(std::shared_ptr<Expression> left, std::shared_ptr<Expression> right)
+    {
+        return createOperation<Addition>('+', std::move(left), std::move(right));
+    }
+    std::shared_ptr<Expression> createSubtraction(std::shared_ptr<Expression> left, std::shared_ptr<Expression> right)
+    {
+        return createOperation<Subtraction>('-', std::move(left), std::move(right));
+    }
+    std::shared_ptr<Expression> createMultiplication(std::shared_ptr<Expression> left, std::shared_ptr<Expression> right)
+    {
+        return createOperation<Multiplication>('*', std::move(left), std::move(right));
+    }
+
+    // Записи индекса составных узлов, включая ещё не выброшенные истёкшие
+    int operationsCount() const
+    {
+        return static_cast<int>(mOperations.size());
+    }
+
+    // Выбрасывает из индекса записи узлов, на которые больше никто не ссылается:
+    // блок make_shared такого узла освобождается только вместе с записью.
+    // Вызывается и сама, когда индекс вырастает вдвое с прошлой чистки
+    void releaseUnused()
+    {
+        std::erase_if(mOperations, [](const Operations::value_type& entry) {return entry.second.expired();});
+        mSweepSize = std::max<size_t>(64, 2 * mOperations.size());
+    }
+
+    int variablesCount() const
+    {
+        return static_cast<int>(mVariables.size());
+    }
+
+    // Память индекса составных узлов: на запись - узел красно-чёрного дерева
+    // std::map (цвет и три указателя) со значением. Сами узлы сюда не входят
+    size_t operationsMemoryUsage() const
+    {
+        return mOperations.size() * (sizeof(Operations::value_type) + 4 * sizeof(void*));
+    }
+
+    // Контекст по ячейкам из контекста по именам. Заполняется один раз и дальше
+    // передаётся в calculate и ExpressionProgram::evaluate. Переменная фабрики,
+    // которой нет в контексте, - ошибка out_of_range, как в calculate по именам
+    std::vector<int> bind(const std::map<std::string, int>& context) const
+    {
+        std::vector<int> slots(mVariables.size());
+        for (const auto& [name, variable] : mVariables) {
+            auto it = context.find(name);
+            if (it == context.end()) {
+                throw std::out_of_range("no value for variable " + name);
+            }
+            slots[variable->getSlot()] = it->second;
+        }
+        return slots;
+    }
+
 private:
     using Constants = std::map < int, std::shared_ptr<Constant> >;
     Constants mConstants;
 
     using Variables = std::map <std::string, std::shared_ptr<Variable>>;
     Variables mVariables;
+
+    // Ключ - операция и адреса операндов, он однозначен, только пока операнды
+    // живы. Индекс не владеет узлами: пока узел записи жив, он сам держит свои
+    // операнды. Истёкшая запись могла совпасть по адресам с новыми операндами,
+    // поэтому она не используется, а перезаписывается или выбрасывается
+    using Operations = std::map <std::tuple<char, const Expression*, const Expression*>, std::weak_ptr<Expression>>;
+    Operations mOperations;
+    // Размер индекса, при котором из него выбрасываются истёкшие записи
+    size_t mSweepSize = 64;
+
+    template <typename Operation>
+    std::shared_ptr<Expression> createOperation(char op, std::shared_ptr<Expression> left, std::shared_ptr<Expression> right)
+    {
+        std::weak_ptr<Expression>& entry = mOperations[std::make_tuple(op, left.get(), right.get())];
+        if (std::shared_ptr<Expression> node = entry.lock()) {
+            return node;
+        }
+        std::shared_ptr<Expression> node = std::make_shared<Operation>(std::move(left), std::move(right));
+        entry = node;
+        if (mOperations.size() >= mSweepSize) {
+            releaseUnused();
+        }
+        return node;
+    }
+};
+
+ExpressionProgram ExpressionProgram::compile(const Expression& expression) {
+    const Expression* expressions[] = {&expression};
+    return compile(expressions);
+}
+
+// Два прохода: первый только считает ссылки на составные узлы во всех
+// выражениях, второй выдаёт код, сохраняя в память узлы с несколькими ссылками
+ExpressionProgram ExpressionProgram::compile(std::span<const Expression* const> expressions) {
+    ExpressionProgram counter;
+    counter.counting = true;
+    for (const Expression* expression : expressions) {
+        expression->compile(counter);
+    }
+    ExpressionProgram program;
+    program.uses = std::move(counter.uses);
+    for (const Expression* expression : expressions) {
+        expression->compile(program);
+        program.emitResult();
+    }
+    program.uses.clear();
+    program.memoSlots.clear();
+    program.values.resize(program.slotsCount);
+    program.stack.resize(program.maxDepth);
+    program.memo.resize(program.memoCount);
+    program.outputs.resize(program.outputsCount);
+    return program;
+}
+
+// Случайное выражение из leaves листьев над переменными variables. Если deep,
+// дерево вырожденное: у каждой операции один из операндов - лист, и глубина
+// равна числу листьев. Иначе дерево сбалансированное. Умножение - только на
+// лист со значением от -1 до 1, так что при таких же значениях переменных
+// результат не переполняется
+std::shared_ptr<Expression> randomLeaf(const std::vector<std::shared_ptr<Variable>>& variables, int maxConstant, std::mt19937& rng) {
+    if (rng() % 2 == 0) {
+        return variables[rng() % variables.size()];
+    }
+    return std::make_shared<Constant>(static_cast<int>(rng() % (2 * maxConstant + 1)) - maxConstant);
+}
+
+std::shared_ptr<Expression> randomOperation(std::shared_ptr<Expression> left, std::shared_ptr<Expression> right,
+                                            const std::vector<std::shared_ptr<Variable>>& variables, std::mt19937& rng) {
+    switch (rng() % 3) {
+        case 0:
+            return std::make_shared<Addition>(left, right);
+        case 1:
+            return std::make_shared<Subtraction>(left, right);
+        default:
+            return std::make_shared<Multiplication>(std::make_shared<Addition>(left, right), randomLeaf(variables, 1, rng));
+    }
+}
+
+std::shared_ptr<Expression> randomExpression(const std::vector<std::shared_ptr<Variable>>& variables, int leaves, bool deep, std::mt19937& rng) {
+    if (leaves == 1) {
+        return randomLeaf(variables, 9, rng);
+    }
+    if (deep) {
+        std::shared_ptr<Expression> result = randomLeaf(variables, 9, rng);
+        for (int i = 1; i < leaves; i++) {
+            std::shared_ptr<Expression> leaf = randomLeaf(variables, 9, rng);
+            result = rng() % 2 == 0 ? randomOperation(result, leaf, variables, rng) : randomOperation(leaf, result, variables, rng);
+        }
+        return result;
+    }
+    std::shared_ptr<Expression> left = randomExpression(variables, leaves / 2, false, rng);
+    return randomOperation(left, randomExpression(variables, leaves - leaves / 2, false, rng), variables, rng);
+}
+
+// Вычисления в секунду: дерево через calculate против скомпилированной программы
+void benchmarkCompiledExpression(const char* title, const Expression& expression, const std::map<std::string, int>& context, int evaluations) {
+    ExpressionProgram program = ExpressionProgram::compile(expression);
+    long long treeSum = 0, programSum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < evaluations; i++) {
+        treeSum += expression.calculate(context);
+    }
+    std::chrono::duration<double> treeTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < evaluations; i++) {
+        programSum += program.evaluate(context);
+    }
+    std::chrono::duration<double> programTime = std::chrono::steady_clock::now() - start;
+    std::cout << title << ", " << program.size() << " instructions: calculate " << evaluations / treeTime.count()
+              << " evals/sec, bytecode " << evaluations / programTime.count() << " evals/sec"
+              << (treeSum == programSum ? "" : " (results differ!)") << "\n";
+}
+
+void benchmarkCompiledExpressions(ExpressionFactory& factory) {
+    std::cout << "\ncalculate() vs bytecode\n";
+    std::mt19937 rng(47);
+    std::vector<std::shared_ptr<Variable>> variables;
+    std::map<std::string, int> context;
+    for (int i = 0; i < 8; i++) {
+        std::string name = "v" + std::to_string(i);
+        variables.push_back(factory.createVariable(name));
+        context[name] = static_cast<int>(rng() % 3) - 1;
+    }
+    std::shared_ptr<Expression> small = randomExpression(variables, 6, false, rng);
+    benchmarkCompiledExpression("6 leaves", *small, context, 2000000);
+    std::shared_ptr<Expression> deep = randomExpression(variables, 4096, true, rng);
+    benchmarkCompiledExpression("deep, 4096 leaves", *deep, context, 2000);
+    std::shared_ptr<Expression> wide = randomExpression(variables, 4096, false, rng);
+    benchmarkCompiledExpression("balanced, 4096 leaves", *wide, context, 2000);
+}
+
+// Выражение, в котором почти всё - ссылки на переменные: сравнение поиска
+// по именам в std::map с ячейками фабрики
+void benchmarkVariableSlots(ExpressionFactory& factory) {
+    std::cout << "\nvariable lookup: std::map context vs slots\n";
+    std::mt19937 rng(48);
+    std::vector<std::shared_ptr<Variable>> variables;
+    std::map<std::string, int> context;
+    for (int i = 0; i < 32; i++) {
+        std::string name = "sensor_reading_" + std::to_string(i);
+        variables.push_back(factory.createVariable(name));
+        context[name] = static_cast<int>(rng() % 100);
+    }
+    std::shared_ptr<Expression> expression = variables[0];
+    for (int i = 1; i < 256; i++) {
+        std::shared_ptr<Expression> variable = variables[rng() % variables.size()];
+        if (i % 2 == 0) {
+            expression = std::make_shared<Addition>(expression, variable);
+        } else {
+            expression = std::make_shared<Subtraction>(variable, expression);
+        }
+    }
+    ExpressionProgram program = ExpressionProgram::compile(*expression);
+    std::vector<int> slots = factory.bind(context);
+
+    const int evaluations = 200000;
+    long long sums[5] = {};
+    double rates[5];
+    for (int method = 0; method < 5; method++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < evaluations; i++) {
+            switch (method) {
+                case 0: sums[method] += expression->calculate(context); break;
+                case 1: sums[method] += expression->calculate(std::span<const int>(slots)); break;
+                case 2: sums[method] += program.evaluate(context); break;
+                case 3: sums[method] += program.evaluate(std::span<const int>(slots)); break;
+                default: sums[method] += program.evaluate(std::span<const int>(factory.bind(context))); break;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        rates[method] = evaluations / elapsed.count();
+    }
+    bool same = std::all_of(sums, sums + 5, [&sums](long long sum) {return sum == sums[0];});
+    std::cout << "256 references to 32 variables, evals/sec: calculate(map) " << rates[0]
+              << ", calculate(slots) " << rates[1] << ", bytecode(map) " << rates[2]
+              << ", bytecode(slots) " << rates[3] << ", bind + bytecode(slots) " << rates[4]
+              << (same ? "" : " (results differ!)") << "\n";
+}
+
+// Одно выражение над count контекстами: по одному через std::map и calculate,
+// по одному через ячейки и байткод, и пакетом по столбцам
+void benchmarkBatchEvaluation(ExpressionFactory& factory, int count) {
+    std::cout << "\nbatch evaluation over " << count << " contexts\n";
+    std::mt19937 rng(49);
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<Variable>> variables;
+    for (int i = 0; i < 8; i++) {
+        names.push_back("v" + std::to_string(i));
+        variables.push_back(factory.createVariable(names.back()));
+    }
+    std::shared_ptr<Expression> expression = randomExpression(variables, 64, false, rng);
+    ExpressionProgram program = ExpressionProgram::compile(*expression);
+
+    std::vector<std::vector<int>> storage(factory.variablesCount());
+    std::vector<const int*> columns(factory.variablesCount(), nullptr);
+    for (const std::shared_ptr<Variable>& variable : variables) {
+        std::vector<int>& column = storage[variable->getSlot()];
+        column.resize(count);
+        for (int& value : column) {
+            value = static_cast<int>(rng() % 3) - 1;
+        }
+        columns[variable->getSlot()] = column.data();
+    }
+
+    std::vector<int> expected(count);
+    std::map<std::string, int> context;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < 8; v++) {
+            context[names[v]] = columns[variables[v]->getSlot()][i];
+        }
+        expected[i] = expression->calculate(context);
+    }
+    std::chrono::duration<double> mapTime = std::chrono::steady_clock::now() - start;
+
+    std::vector<int> results(count);
+    std::vector<int> slots(factory.variablesCount());
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        for (const std::shared_ptr<Variable>& variable : variables) {
+            slots[variable->getSlot()] = columns[variable->getSlot()][i];
+        }
+        results[i] = program.evaluate(std::span<const int>(slots));
+    }
+    std::chrono::duration<double> slotsTime = std::chrono::steady_clock::now() - start;
+    bool same = results == expected;
+
+    std::cout << program.size() << " instructions, evals/sec: calculate(map) " << count / mapTime.count()
+              << ", bytecode(slots) " << count / slotsTime.count();
+    for (int threads : {1, 2, 4}) {
+        std::fill(results.begin(), results.end(), 0);
+        start = std::chrono::steady_clock::now();
+        program.evaluateBatch(columns, results, threads);
+        std::chrono::duration<double> batchTime = std::chrono::steady_clock::now() - start;
+        same = same && results == expected;
+        std::cout << ", batch " << threads << (threads == 1 ? " thread " : " threads ") << count / batchTime.count();
+    }
+    std::cout << (same ? "" : " (results differ!)") << "\n";
+}
+
+// Подвыражение номер key на глубине depth. Одинаковые (depth, key) дают
+// одинаковые подвыражения, так что у формул много общих частей. make(op, left,
+// right) создаёт узел: напрямую (дерево) или через фабрику (DAG)
+template <typename Make>
+std::shared_ptr<Expression> sharedFormula(int depth, int key, const std::vector<std::shared_ptr<Variable>>& variables, Make& make) {
+    const int keys = 16;
+    if (depth == 0) {
+        return variables[key % variables.size()];
+    }
+    std::shared_ptr<Expression> left = sharedFormula(depth - 1, (key * 7 + 1) % keys, variables, make);
+    if (key % 3 == 2) {
+        return make(2, left, variables[key % variables.size()]);
+    }
+    return make(key % 3, left, sharedFormula(depth - 1, (key * 13 + 5) % keys, variables, make));
+}
+
+// Распределитель для замера памяти узлов в benchmarkSharedSubexpressions:
+// занятые байты копятся в countedBytes. Состояния у него нет, поэтому блок
+// allocate_shared с ним того же размера, что и блок make_shared
+size_t countedBytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        countedBytes += count * sizeof(T);
+        return std::allocator<T>().allocate(count);
+    }
+    void deallocate(T* pointer, size_t count) {
+        countedBytes -= count * sizeof(T);
+        std::allocator<T>().deallocate(pointer, count);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>&) const {
+        return true;
+    }
 };
 
+// Размер блока make_shared (счётчики и сам узел) для узла операции Node
+template <typename Node>
+size_t sharedNodeBytes() {
+    size_t before = countedBytes;
+    std::shared_ptr<Node> node = std::allocate_shared<Node>(CountingAllocator<Node>(), std::shared_ptr<Expression>(),
+                                                            std::shared_ptr<Expression>());
+    return countedBytes - before;
+}
+
+// Набор формул с общими подвыражениями: деревья без общих узлов против DAG
+// из фабрики. Память - узлы с блоками счётчиков make_shared и, для DAG,
+// записи индекса фабрики
+void benchmarkSharedSubexpressions(ExpressionFactory& factory) {
+    std::cout << "\nshared subexpressions: trees vs DAG\n";
+    std::mt19937 rng(50);
+    std::vector<std::shared_ptr<Variable>> variables;
+    std::map<std::string, int> context;
+    for (int i = 0; i < 8; i++) {
+        std::string name = "v" + std::to_string(i);
+        variables.push_back(factory.createVariable(name));
+        context[name] = static_cast<int>(rng() % 3) - 1;
+    }
+    std::vector<int> slots = factory.bind(context);
+
+    const int formulasCount = 64, depth = 12;
+    // Узлы деревьев создаются через CountingAllocator, и их память считается
+    // точно. Узлы DAG создаёт фабрика через make_shared, их память - сумма
+    // блоков новых узлов (того же размера) и прирост индекса фабрики
+    int treeNodes = 0;
+    auto makeTree = [&treeNodes](int op, std::shared_ptr<Expression> left, std::shared_ptr<Expression> right) -> std::shared_ptr<Expression> {
+        treeNodes++;
+        if (op == 0) {
+            return std::allocate_shared<Addition>(CountingAllocator<Addition>(), left, right);
+        }
+        if (op == 1) {
+            return std::allocate_shared<Subtraction>(CountingAllocator<Subtraction>(), left, right);
+        }
+        return std::allocate_shared<Multiplication>(CountingAllocator<Multiplication>(), left, right);
+    };
+    const size_t nodeBytes[] = {sharedNodeBytes<Addition>(), sharedNodeBytes<Subtraction>(), sharedNodeBytes<Multiplication>()};
+    size_t sharedBytes = 0;
+    std::unordered_set<const Expression*> sharedNodes;
+    auto makeShared = [&factory, &nodeBytes, &sharedBytes, &sharedNodes](int op, std::shared_ptr<Expression> left, std::shared_ptr<Expression> right) {
+        std::shared_ptr<Expression> node = op == 0 ? factory.createAddition(left, right) :
+                                           op == 1 ? factory.createSubtraction(left, right) :
+                                                     factory.createMultiplication(left, right);
+        if (sharedNodes.insert(node.get()).second) {
+            sharedBytes += nodeBytes[op];
+        }
+        return node;
+    };
+    std::vector<std::shared_ptr<Expression>> trees, shared;
+    size_t treeBytesBefore = countedBytes;
+    for (int i = 0; i < formulasCount; i++) {
+        trees.push_back(sharedFormula(depth, i, variables, makeTree));
+    }
+    size_t treeBytes = countedBytes - treeBytesBefore;
+    size_t indexBefore = factory.operationsMemoryUsage();
+    for (int i = 0; i < formulasCount; i++) {
+        shared.push_back(sharedFormula(depth, i, variables, makeShared));
+    }
+    sharedBytes += factory.operationsMemoryUsage() - indexBefore;
+    std::cout << formulasCount << " formulas of depth " << depth << ": trees " << treeNodes << " nodes, "
+              << treeBytes / 1024.0 << " KB; DAG " << sharedNodes.size() << " nodes, "
+              << sharedBytes / 1024.0 << " KB\n";
+
+    std::vector<ExpressionProgram> treePrograms, sharedPrograms;
+    size_t treeInstructions = 0, sharedInstructions = 0;
+    for (int i = 0; i < formulasCount; i++) {
+        treePrograms.push_back(ExpressionProgram::compile(*trees[i]));
+        sharedPrograms.push_back(ExpressionProgram::compile(*shared[i]));
+        treeInstructions += treePrograms.back().size();
+        sharedInstructions += sharedPrograms.back().size();
+    }
+
+    std::vector<const Expression*> roots;
+    for (const std::shared_ptr<Expression>& formula : shared) {
+        roots.push_back(formula.get());
+    }
+    ExpressionProgram setProgram = ExpressionProgram::compile(roots);
+    std::vector<int> results(formulasCount);
+
+    const int evaluations = 20;
+    long long sums[5] = {};
+    double times[5];
+    for (int method = 0; method < 5; method++) {
+        if (method == 4) {
+            auto start = std::chrono::steady_clock::now();
+            for (int e = 0; e < evaluations; e++) {
+                setProgram.evaluate(slots, results);
+                for (int result : results) {
+                    sums[method] += result;
+                }
+            }
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            times[method] = elapsed.count() / evaluations;
+            break;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int e = 0; e < evaluations; e++) {
+            for (int i = 0; i < formulasCount; i++) {
+                switch (method) {
+                    case 0: sums[method] += trees[i]->calculate(std::span<const int>(slots)); break;
+                    case 1: sums[method] += shared[i]->calculate(std::span<const int>(slots)); break;
+                    case 2: sums[method] += treePrograms[i].evaluate(std::span<const int>(slots)); break;
+                    default: sums[method] += sharedPrograms[i].evaluate(std::span<const int>(slots)); break;
+                }
+            }
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        times[method] = elapsed.count() / evaluations;
+    }
+    bool same = std::all_of(sums, sums + 5, [&sums](long long sum) {return sum == sums[0];});
+    std::cout << "one context, all formulas: calculate on trees " << times[0] << " us, calculate on DAG " << times[1]
+              << " us\nbytecode of trees (" << treeInstructions << " instructions) " << times[2]
+              << " us, DAG per formula (" << sharedInstructions << " instructions) " << times[3]
+              << " us, DAG as one set (" << setProgram.size() << " instructions) " << times[4] << " us"
+              << (same ? "" : " (results differ!)") << "\n";
+}
+
 int main() {
     ExpressionFactory factory;
     std::shared_ptr<Constant> c = factory.createConstant(2);
@@ -213,7 +1137,31 @@ int main() {
     expression4->print();
     std::cout << " = " << expression4->calculate(context) << std::endl;
 
+    ExpressionProgram program3 = ExpressionProgram::compile(*expression3);
+    std::cout << "compiled to " << program3.size() << " instructions = " << program3.evaluate(context) << std::endl;
+    std::vector<int> slots = factory.bind(context);
+    std::cout << "with " << slots.size() << " variable slots = " << expression3->calculate(std::span<const int>(slots))
+              << ", compiled = " << program3.evaluate(std::span<const int>(slots)) << std::endl;
+
     delete expression3;
+    delete expression4;
+
+    // Через фабрику одинаковые составные узлы - один узел, и в программе
+    // (2 + x) вычисляется один раз
+    std::shared_ptr<Expression> sum = factory.createAddition(c, v);
+    std::shared_ptr<Expression> square = factory.createMultiplication(factory.createAddition(c, v), sum);
+    square->print();
+    ExpressionProgram squareProgram = ExpressionProgram::compile(*square);
+    std::cout << " = " << squareProgram.evaluate(context) << ", " << squareProgram.size() << " instructions" << std::endl;
+
+    benchmarkCompiledExpressions(factory);
+    // bind требует значений всех переменных фабрики, поэтому замеры, у которых
+    // контекст только из своих переменных, работают с отдельными фабриками
+    ExpressionFactory slotsFactory;
+    benchmarkVariableSlots(slotsFactory);
+    benchmarkBatchEvaluation(factory, 1000000);
+    ExpressionFactory sharedFactory;
+    benchmarkSharedSubexpressions(sharedFactory);
 
     return 0;
 }